@@ -34,14 +34,87 @@ typedef uchar4 color_rgba;
 	#define assert(x)
 #endif
 
+// Compile time specializations, set with -D by ocl::create_kernel_variant(). Each work item processes VEC_WIDTH bytes.
+// If buf_size is known to be a multiple of VEC_WIDTH (BUF_SIZE_MULTIPLE), the bounds check is compiled out and the loop is fully unrolled.
+#ifndef VEC_WIDTH
+	#define VEC_WIDTH 1
+#endif
+
+#ifndef BUF_SIZE_MULTIPLE
+	#define BUF_SIZE_MULTIPLE 1
+#endif
+
 kernel void process_buffer(
     const global uint8_t *pInput_buf,
 	global uint8_t *pOutput_buf,
-    uint32_t buf_size)
+    uint32_t buf_size,
+	uint64_t base_ofs)
+{
+	// When the buffer is split into shards, the global work offset is the shard's offset in the full buffer (in work items) and the buffers only hold the shard.
+	// Shards start on 4KB boundaries, so only the work item at the very end of the buffer can be partial.
+	// base_ofs is the buffer's own offset in a larger stream or file (0 if none). Byte offsets in that stream can exceed 4GB, so they're 64-bit.
+	const uint32_t buf_ofs = get_global_id(0) * VEC_WIDTH;
+	const uint32_t shard_ofs = (get_global_id(0) - get_global_offset(0)) * VEC_WIDTH;
+	const uint64_t stream_ofs = base_ofs + buf_ofs;
+
+	assert(buf_ofs < buf_size);
+	
+#if (BUF_SIZE_MULTIPLE % VEC_WIDTH) == 0
+	#pragma unroll
+	for (uint32_t i = 0; i < VEC_WIDTH; i++)
+		pOutput_buf[shard_ofs + i] = pInput_buf[shard_ofs + i] ^ (uint8_t)(stream_ofs + i);
+#else
+	const uint32_t n = min((uint32_t)VEC_WIDTH, buf_size - buf_ofs);
+	for (uint32_t i = 0; i < n; i++)
+		pOutput_buf[shard_ofs + i] = pInput_buf[shard_ofs + i] ^ (uint8_t)(stream_ofs + i);
+#endif
+}
+
+// In place version of process_buffer: a single read/write buffer, so each shard needs half the device memory and one buffer instead of two.
+kernel void process_buffer_inplace(
+	global uint8_t *pBuf,
+    uint32_t buf_size,
+	uint64_t base_ofs)
 {
-	const uint32_t buf_ofs = get_global_id(0);
+	const uint32_t buf_ofs = get_global_id(0) * VEC_WIDTH;
+	const uint32_t shard_ofs = (get_global_id(0) - get_global_offset(0)) * VEC_WIDTH;
+	const uint64_t stream_ofs = base_ofs + buf_ofs;
 
 	assert(buf_ofs < buf_size);
 	
-	pOutput_buf[buf_ofs] = pInput_buf[buf_ofs] ^ (uint8_t)buf_ofs;
+#if (BUF_SIZE_MULTIPLE % VEC_WIDTH) == 0
+	#pragma unroll
+	for (uint32_t i = 0; i < VEC_WIDTH; i++)
+		pBuf[shard_ofs + i] ^= (uint8_t)(stream_ofs + i);
+#else
+	const uint32_t n = min((uint32_t)VEC_WIDTH, buf_size - buf_ofs);
+	for (uint32_t i = 0; i < n; i++)
+		pBuf[shard_ofs + i] ^= (uint8_t)(stream_ofs + i);
+#endif
+}
+
+// Batched process_buffer for many small buffers in one launch. pInput_buf starts with an offset table of num_items + 1 uint32_t's, and the items follow at data_ofs, 
+// packed back to back. Item i is [offsets[i], offsets[i + 1]) of the packed data (in pOutput_buf too), and is processed as if it were a buffer of its own.
+// One work item per byte of packed data.
+kernel void process_buffer_batch(
+	const global uint8_t *pInput_buf,
+	global uint8_t *pOutput_buf,
+	uint32_t num_items,
+	uint32_t data_ofs)
+{
+	const global uint32_t *pOffsets = (const global uint32_t *)pInput_buf;
+	const uint32_t ofs = get_global_id(0);
+
+	// Find the last item starting at or before ofs. Empty items share their start with the next one, so they're skipped.
+	uint32_t lo = 0, hi = num_items - 1;
+	while (lo < hi)
+	{
+		const uint32_t mid = (lo + hi + 1) >> 1;
+		if (pOffsets[mid] <= ofs)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	pOutput_buf[ofs] = pInput_buf[data_ofs + ofs] ^ (uint8_t)(ofs - pOffsets[lo]);
 }
@@ -0,0 +1,25 @@
+# embed_file.cmake
+# Writes a file as a C array, in the same format as "xxd -i". Used to embed bin/ocl_kernels.cl in the build (or to refresh src/ocl_kernels.h).
+# Usage: cmake -DINPUT=<file> -DOUTPUT=<header> -DVAR=<array name> -P embed_file.cmake
+
+if (NOT INPUT OR NOT OUTPUT OR NOT VAR)
+	message(FATAL_ERROR "embed_file.cmake: INPUT, OUTPUT and VAR must be defined")
+endif()
+
+file(READ "${INPUT}" HEX_DATA HEX)
+string(LENGTH "${HEX_DATA}" HEX_LEN)
+math(EXPR DATA_LEN "${HEX_LEN} / 2")
+
+# 12 bytes per line, like xxd.
+string(REGEX REPLACE "([0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f])" "\\1\n" HEX_DATA "${HEX_DATA}")
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1, " HEX_DATA "${HEX_DATA}")
+string(REGEX REPLACE ", \n" ",\n  " HEX_DATA "${HEX_DATA}")
+string(REGEX REPLACE "[,\n ]+$" "" HEX_DATA "${HEX_DATA}")
+
+get_filename_component(INPUT_NAME "${INPUT}" NAME)
+
+# Only touch the output if it changed, so dependent sources aren't rebuilt needlessly.
+set(CONTENTS "// Generated from ${INPUT_NAME} by cmake/embed_file.cmake, do not edit.\nunsigned char ${VAR}[] = {\n  ${HEX_DATA}\n};\nunsigned int ${VAR}_len = ${DATA_LEN};\n")
+file(WRITE "${OUTPUT}.tmp" "${CONTENTS}")
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different "${OUTPUT}.tmp" "${OUTPUT}")
+file(REMOVE "${OUTPUT}.tmp")
@@ -0,0 +1,221 @@
+// ocl_binary_cache.h
+// Persistent on-disk cache of OpenCL program binaries. Each entry is one file holding the binaries of every device the program was built for.
+// Entries are written to a temp file which is then renamed, so processes sharing a cache directory never see partially written files.
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <functional>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+class ocl_binary_cache
+{
+public:
+	static const uint64_t cFNVOffset64 = 0xCBF29CE484222325ULL;
+
+	// FNV-1a 64
+	static uint64_t hash(const void* pData, size_t size, uint64_t h = cFNVOffset64)
+	{
+		const uint8_t* p = static_cast<const uint8_t*>(pData);
+		for (size_t i = 0; i < size; i++)
+		{
+			h ^= p[i];
+			h *= 0x100000001B3ULL;
+		}
+		return h;
+	}
+
+	// Includes the string's length, so ("ab", "c") and ("a", "bc") hash differently.
+	static uint64_t hash(const std::string& str, uint64_t h)
+	{
+		const uint64_t len = str.size();
+		h = hash(&len, sizeof(len), h);
+		return hash(str.data(), str.size(), h);
+	}
+
+	ocl_binary_cache() { }
+
+	bool is_enabled() const { return !m_dir.empty(); }
+	const std::string& get_dir() const { return m_dir; }
+
+	// nullptr or "" disables the cache. The directory is created if it doesn't exist.
+	void set_dir(const char* pDir)
+	{
+		m_dir = pDir ? pDir : "";
+		if (m_dir.empty())
+			return;
+
+		if ((m_dir.back() == '/') || (m_dir.back() == '\\'))
+			m_dir.pop_back();
+
+#ifdef _WIN32
+		_mkdir(m_dir.c_str());
+#else
+		mkdir(m_dir.c_str(), 0755);
+#endif
+	}
+
+	// Returns false if there's no valid entry for key. Truncated or corrupted entries are treated as missing.
+	bool load(uint64_t key, std::vector< std::vector<uint8_t> >& binaries) const
+	{
+		binaries.resize(0);
+
+		if (!is_enabled())
+			return false;
+
+		FILE* pFile = fopen(get_filename(key).c_str(), "rb");
+		if (!pFile)
+			return false;
+
+		bool success = false;
+
+		file_header hdr;
+		if ((fread(&hdr, sizeof(hdr), 1, pFile) == 1) && (hdr.m_magic == cMagic) && (hdr.m_version == cVersion) && (hdr.m_key == key) && (hdr.m_num_binaries) && (hdr.m_num_binaries <= cMaxBinaries))
+		{
+			std::vector<uint64_t> sizes(hdr.m_num_binaries);
+			if (fread(sizes.data(), sizeof(uint64_t), sizes.size(), pFile) == sizes.size())
+			{
+				binaries.resize(hdr.m_num_binaries);
+
+				uint64_t payload_hash = cFNVOffset64;
+				success = true;
+
+				for (uint32_t i = 0; i < hdr.m_num_binaries; i++)
+				{
+					if ((!sizes[i]) || (sizes[i] > cMaxBinarySize))
+					{
+						success = false;
+						break;
+					}
+
+					binaries[i].resize((size_t)sizes[i]);
+					if (fread(binaries[i].data(), 1, binaries[i].size(), pFile) != binaries[i].size())
+					{
+						success = false;
+						break;
+					}
+
+					payload_hash = hash(binaries[i].data(), binaries[i].size(), payload_hash);
+				}
+
+				if (payload_hash != hdr.m_payload_hash)
+					success = false;
+			}
+		}
+
+		fclose(pFile);
+
+		if (!success)
+			binaries.resize(0);
+
+		return success;
+	}
+
+	bool store(uint64_t key, const std::vector< std::vector<uint8_t> >& binaries) const
+	{
+		if ((!is_enabled()) || (binaries.empty()) || (binaries.size() > cMaxBinaries))
+			return false;
+
+		file_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.m_magic = cMagic;
+		hdr.m_version = cVersion;
+		hdr.m_key = key;
+		hdr.m_num_binaries = (uint32_t)binaries.size();
+		hdr.m_payload_hash = cFNVOffset64;
+
+		std::vector<uint64_t> sizes(binaries.size());
+		for (uint32_t i = 0; i < binaries.size(); i++)
+		{
+			sizes[i] = binaries[i].size();
+			hdr.m_payload_hash = hash(binaries[i].data(), binaries[i].size(), hdr.m_payload_hash);
+		}
+
+		const std::string filename(get_filename(key));
+
+		// Unique temp name per process and thread.
+		char suffix[64];
+		snprintf(suffix, sizeof(suffix), ".%u.%llx.tmp", get_pid(), (unsigned long long)std::hash<std::thread::id>()(std::this_thread::get_id()));
+		const std::string temp_filename(filename + suffix);
+
+		FILE* pFile = fopen(temp_filename.c_str(), "wb");
+		if (!pFile)
+			return false;
+
+		bool success = (fwrite(&hdr, sizeof(hdr), 1, pFile) == 1) && (fwrite(sizes.data(), sizeof(uint64_t), sizes.size(), pFile) == sizes.size());
+		for (uint32_t i = 0; success && (i < binaries.size()); i++)
+			success = fwrite(binaries[i].data(), 1, binaries[i].size(), pFile) == binaries[i].size();
+
+		if (fclose(pFile) != 0)
+			success = false;
+
+		if (success)
+		{
+#ifdef _WIN32
+			success = MoveFileExA(temp_filename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+			success = rename(temp_filename.c_str(), filename.c_str()) == 0;
+#endif
+		}
+
+		if (!success)
+			remove(temp_filename.c_str());
+
+		return success;
+	}
+
+private:
+	enum
+	{
+		cMagic = 0x424C434F, // "OCLB"
+		cVersion = 1,
+		cMaxBinaries = 256
+	};
+
+	static const uint64_t cMaxBinarySize = 1024ULL * 1024ULL * 1024ULL;
+
+#pragma pack(push, 1)
+	struct file_header
+	{
+		uint32_t m_magic;
+		uint32_t m_version;
+		uint64_t m_key;
+		uint32_t m_num_binaries;
+		uint32_t m_reserved;
+		uint64_t m_payload_hash;
+	};
+#pragma pack(pop)
+
+	std::string m_dir;
+
+	std::string get_filename(uint64_t key) const
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "/ocl_%016llx.bin", (unsigned long long)key);
+		return m_dir + buf;
+	}
+
+	static uint32_t get_pid()
+	{
+#ifdef _WIN32
+		return (uint32_t)_getpid();
+#else
+		return (uint32_t)getpid();
+#endif
+	}
+};
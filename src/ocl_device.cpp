@@ -5,30 +5,362 @@
 // Otherwise, it will attempt to load the kernel program source from disk.
 #define OCL_USE_KERNELS_HEADER (1)
 
+// Defined by the CMake build, which regenerates the header from bin/ocl_kernels.cl in its build directory. Other builds use the checked in copy.
+#ifndef OCL_USE_GENERATED_KERNELS_HEADER
+#define OCL_USE_GENERATED_KERNELS_HEADER (0)
+#endif
+
 #if OCL_USE_KERNELS_HEADER
+#if OCL_USE_GENERATED_KERNELS_HEADER
+#include "ocl_kernels_generated.h"
+#else
 #include "ocl_kernels.h"
 #endif
+#endif
 
 #define OPENCL_ASSERT_ON_ANY_ERRORS (1)
 #include "simple_ocl_wrapper.h"
+#include "ocl_job_pool.h"
+#include "ocl_numa.h"
+#include "ocl_mapped_file.h"
+
+// Defined by the CMake build when SIMPLE_OCL_EMBED_BINARIES is on: ocl_kernel_binaries.h then holds the kernels precompiled (by ocl_offline_compile) for the
+// configured devices. On those devices the program is created from the embedded binary, skipping the compiler. Anywhere else the source is compiled as usual.
+#ifndef OCL_USE_EMBEDDED_BINARIES
+#define OCL_USE_EMBEDDED_BINARIES (0)
+#endif
+
+#if OCL_USE_EMBEDDED_BINARIES
+#include "ocl_kernel_binaries.h"
+#endif
+
+#include <chrono>
+#include <atomic>
+#include <sys/stat.h>
 
 // If 1, the kernel source code will come from encoders/ocl_kernels.h. Otherwise, it will be read from the "ocl_kernels.cl" file in the current directory (for development).
 #define OCL_KERNELS_FILENAME "ocl_kernels.cl"
 
-// Library global state
-ocl g_ocl;
+// Maximum number of devices used in multi-device mode.
+#define OCL_MAX_DEVICES (16)
+
+// Buffers are only split across devices in shards of at least this many bytes, so small buffers don't pay the extra per-device overhead.
+#define OCL_MIN_SHARD_SIZE (256 * 1024)
+
+// In co-execution mode, the host's share of a buffer is split into tasks of at least this many bytes.
+#define OCL_COEXEC_MIN_HOST_TASK_SIZE (64 * 1024)
+
+// The co-execution split never goes fully to one side, so the other side's throughput keeps getting measured.
+#define OCL_COEXEC_MIN_FRACTION (.02f)
+
+// Weight of the most recent call's measured throughput in the co-execution throughput averages.
+#define OCL_COEXEC_EMA_WEIGHT (.25)
+
+// Largest process_buffer VEC_WIDTH specialization. Must divide the 4KB shard alignment.
+#define OCL_MAX_VEC_WIDTH (64)
+#define OCL_TOTAL_PROCESS_BUFFER_VARIANTS (2)
+
+// Maximum number of device buffers a context keeps for itself between calls (the rest go back to the engine's buffer pool).
+#define OCL_MAX_CONTEXT_BUFFERS (OCL_MAX_DEVICES * 4)
+
+// Maximum number of opencl_alloc_pinned_buffer() allocations per context.
+#define OCL_MAX_PINNED_BUFFERS (16)
+
+// Default window size of opencl_process_file(), and default chunk size of opencl_process_buffer_stream().
+#define OCL_FILE_WINDOW_SIZE (16 * 1024 * 1024)
+#define OCL_STREAM_CHUNK_SIZE (8 * 1024 * 1024)
+
+// Largest file window/stream chunk.
+#define OCL_MAX_CHUNK_SIZE (1024 * 1024 * 1024)
+
+// Initial size of each context's opencl_process_buffer_batch() packing buffers, which grow in powers of 2.
+#define OCL_MIN_BATCH_BUFFER_SIZE (64 * 1024)
+
+// opencl_process_buffer_stream() rotates chunks through this many device buffer sets, one each for the upload, kernel and download in flight.
+#define OCL_STREAM_STAGES (3)
+
+// Host (CPU) implementation of a kernel, used by co-execution mode. pInput_buf/pOutput_buf point at the host's part of the buffer, which starts at buf_ofs in the full buffer.
+// Each one must produce exactly the same output as its OpenCL kernel.
+typedef void (*host_kernel_func)(const uint8_t* pInput_buf, uint8_t* pOutput_buf, uint64_t buf_ofs, uint64_t size);
+
+// Also used for process_buffer_inplace, with pInput_buf == pOutput_buf.
+static void host_process_buffer(const uint8_t* pInput_buf, uint8_t* pOutput_buf, uint64_t buf_ofs, uint64_t size)
+{
+	for (uint64_t i = 0; i < size; i++)
+		pOutput_buf[i] = pInput_buf[i] ^ (uint8_t)(buf_ofs + i);
+}
+
+// Kernel registry. Every kernel entry point used from this file is declared here once, by name and argument count. To add one, add its enum and table entry,
+// then fetch it with get_context_kernel(): each context creates its kernels lazily, on first use, so adding kernels doesn't add to context creation time or memory.
+// m_pHost_func is the kernel's host implementation for co-execution mode, or nullptr if it can't be co-executed.
+enum ocl_kernel_id
+{
+	OCL_KERNEL_PROCESS_BUFFER,
+	OCL_KERNEL_PROCESS_BUFFER_INPLACE,
+	OCL_KERNEL_PROCESS_BUFFER_BATCH,
+	OCL_TOTAL_KERNELS
+};
+
+static const struct 
+{
+	const char* m_pName;
+	uint32_t m_num_args;
+	host_kernel_func m_pHost_func;
+} g_kernels[OCL_TOTAL_KERNELS] = 
+{
+	{ "process_buffer", 4, host_process_buffer },
+	{ "process_buffer_inplace", 3, host_process_buffer },
+	{ "process_buffer_batch", 4, nullptr }
+};
+
+// Adaptive device/host split state for one co-executed kernel.
+struct coexec_state
+{
+	coexec_state() { reset(); }
+
+	void reset()
+	{
+		m_device_fraction = .5f;
+		m_device_bytes_per_sec = 0.0;
+		m_host_bytes_per_sec = 0.0;
+		m_total_calls = 0;
+	}
+
+	std::mutex m_mutex;
+	float m_device_fraction;
+	double m_device_bytes_per_sec;
+	double m_host_bytes_per_sec;
+	uint64_t m_total_calls;
+};
+
+// All state of one engine: its OpenCL device(s), context and program, and everything built on top of them.
+// Engines share nothing, so several can run side by side in one process (each with its own cl_serializer mutex).
+struct opencl_engine
+{
+	opencl_engine() : 
+		m_kernel_source_load_secs(0.0), m_init_secs(0.0), m_program_ready_secs(0.0), m_variant_build_secs(0.0), 
+		m_pBuild_callback(nullptr), m_pBuild_callback_data(nullptr), 
+		m_watch_kill(false), m_watch_interval_ms(0), 
+		m_vec_width(1),
+		m_coexec_enabled(false),
+		m_context_buffer_hits(0),
+		m_context_buffer_max_bytes(0),
+		m_context_cached_bytes(0),
+		m_staging_buffer_size(0),
+		m_zero_copy(false),
+		m_zero_copy_alignment(0),
+		m_scratch_arena_size(0)
+	{
+	}
+
+	ocl m_ocl;
+
+	// JSON array of the capabilities of every device in the context, built once at init.
+	std::string m_device_caps_json;
+
+	// Maps the calling thread to its NUMA node/L3 domain, when the CPU device is partitioned by affinity domain.
+	ocl_cpu_topology m_cpu_topology;
+
+	// Init phase timings. m_program_ready_secs and m_variant_build_secs are written by the build thread in async build mode.
+	std::chrono::high_resolution_clock::time_point m_init_start_time;
+	double m_kernel_source_load_secs;
+	double m_init_secs;
+	std::atomic<double> m_program_ready_secs;
+	std::atomic<double> m_variant_build_secs;
+	opencl_build_callback m_pBuild_callback;
+	void* m_pBuild_callback_data;
+
+	// The file the kernel source was read from, or empty if it came from memory.
+	std::string m_kernel_filename;
+
+	// Kernel source watcher state (development mode hot reload)
+	std::thread m_watch_thread;
+	std::mutex m_watch_mutex;
+	std::condition_variable m_watch_cv;
+	bool m_watch_kill;
+	uint32_t m_watch_interval_ms;
+
+	// process_buffer VEC_WIDTH specialization, 1 = use the generic kernel.
+	uint32_t m_vec_width;
+
+	bool m_coexec_enabled;
+	ocl_job_pool m_coexec_job_pool;
+	coexec_state m_coexec_states[OCL_TOTAL_KERNELS];
+
+	// Buffer acquires served from a context's own free list, which never reach the engine's buffer pool.
+	std::atomic<uint64_t> m_context_buffer_hits;
+
+	// Most device memory each context keeps on its own free list, and the total kept by all contexts. These buffers are outside the shared pool, so 
+	// m_buffer_pool_max_free_bytes and opencl_trim_buffer_pool() don't see them: the per-context cap is what bounds them.
+	uint64_t m_context_buffer_max_bytes;
+	std::atomic<uint64_t> m_context_cached_bytes;
+
+	// Size of each context's pinned staging buffer, 0 if staged transfers are disabled.
+	size_t m_staging_buffer_size;
+
+	// Zero copy mode on devices with host unified memory, see use_zero_copy().
+	bool m_zero_copy;
+	uint32_t m_zero_copy_alignment;
+
+	// Slab size of each context's scratch arena, 0 if disabled. Slabs are kept until the context is destroyed, and the memory budget can't evict them.
+	size_t m_scratch_arena_size;
+
+private:
+	opencl_engine(const opencl_engine&);
+	opencl_engine& operator= (const opencl_engine&);
+};
+
+// The engine used by the engine-less API (opencl_init() etc.)
+static opencl_engine* g_pDefault_engine;
 
 // All per-thread state goes here
 struct opencl_context
 {
+	opencl_engine* m_pEngine;
+
 	uint32_t m_ocl_total_pixel_blocks;
 	cl_mem m_ocl_pixel_blocks;
 
-	cl_command_queue m_command_queue;
+	// Normally one command queue per device in the OpenCL context, with m_command_queues[0] on the primary device.
+	// With affinity domain sub-devices, just one queue on the sub-device local to the thread that created the context.
+	uint32_t m_num_command_queues;
+	cl_command_queue m_command_queues[OCL_MAX_DEVICES];
+	uint32_t m_device_indices[OCL_MAX_DEVICES];
+
+	// NUMA node of the thread that created the context
+	uint32_t m_numa_node;
+
+	// A kernel and the program generation it was created from. If the program gets hot reloaded, the kernel is replaced on its next use.
+	struct context_kernel
+	{
+		cl_kernel m_kernel;
+		uint32_t m_generation;
+	};
+
+	// Indexed by ocl_kernel_id, nullptr until first use.
+	context_kernel m_kernels[OCL_TOTAL_KERNELS];
+
+	// VEC_WIDTH specializations of process_buffer, created on first use. [1] is also specialized for buffer sizes which are a multiple of VEC_WIDTH.
+	context_kernel m_process_buffer_variants[OCL_TOTAL_PROCESS_BUFFER_VARIANTS];
 
-	cl_kernel m_ocl_process_buffer_kernel;
+	// Bump mode arena for a call's small buffers, reset at the end of each call. Created on first use.
+	ocl_buffer_arena* m_pScratch_arena;
+
+	// Device buffers this context reuses across calls without locking the engine's buffer pool, in no particular order.
+	uint32_t m_num_cached_buffers;
+	ocl_pooled_buffer m_cached_buffers[OCL_MAX_CONTEXT_BUFFERS];
+	uint64_t m_cached_bytes;
+
+	// Pinned staging buffer for transfers between pageable memory and devices without host unified memory, created on first use.
+	ocl_staging_buffer m_staging;
+	bool m_staging_failed;
+
+	// opencl_alloc_pinned_buffer() allocations, which are transferred from/to directly.
+	uint32_t m_num_pinned_buffers;
+	ocl_pinned_buffer m_pinned_buffers[OCL_MAX_PINNED_BUFFERS];
+
+	// opencl_process_buffer_stream()'s upload, kernel and download queues on the primary device, created on first use.
+	cl_command_queue m_stream_queues[OCL_STREAM_STAGES];
+
+	// opencl_process_buffer_batch()'s pinned packing buffers: the offset table and packed items, and the packed results. Grown on demand.
+	ocl_pinned_buffer m_batch_input, m_batch_output;
 };
 
+static void uncache_context_bytes(opencl_context* pContext, uint64_t size)
+{
+	pContext->m_cached_bytes -= size;
+	pContext->m_pEngine->m_context_cached_bytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+// Returns all the buffers on the context's free list to the engine's buffer pool.
+static void release_context_cached_buffers(opencl_context* pContext)
+{
+	while (pContext->m_num_cached_buffers)
+	{
+		ocl_pooled_buffer& buf = pContext->m_cached_buffers[--pContext->m_num_cached_buffers];
+		uncache_context_bytes(pContext, buf.m_size);
+		pContext->m_pEngine->m_ocl.release_pooled_buffer(buf);
+	}
+}
+
+// Takes a buffer of the right flags and size class from the context's free list, or else from the engine's buffer pool.
+// Buffers up to a quarter of the scratch arena's slab size are sub-buffers of the arena instead, marked by an m_size of 0. They're all released at once when the calling entry point resets the arena (m_pScratch_arena->reset()) at its end.
+static bool acquire_context_buffer(opencl_context* pContext, cl_mem_flags flags, size_t size, ocl_pooled_buffer& buf)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	if ((pEngine->m_scratch_arena_size) && (size <= pEngine->m_scratch_arena_size / 4))
+	{
+		if (!pContext->m_pScratch_arena)
+		{
+			pContext->m_pScratch_arena = new ocl_buffer_arena;
+			pContext->m_pScratch_arena->init(pEngine->m_ocl, pEngine->m_scratch_arena_size, ocl_buffer_arena::cModeBump);
+		}
+
+		buf.m_buf = pContext->m_pScratch_arena->alloc(flags, size);
+		buf.m_flags = flags;
+		buf.m_size = 0;
+		if (buf.m_buf)
+			return true;
+	}
+
+	const size_t size_class = pEngine->m_ocl.get_buffer_size_class(size);
+
+	for (uint32_t i = 0; i < pContext->m_num_cached_buffers; i++)
+	{
+		if ((pContext->m_cached_buffers[i].m_flags == flags) && (pContext->m_cached_buffers[i].m_size == size_class))
+		{
+			buf = pContext->m_cached_buffers[i];
+			pContext->m_cached_buffers[i] = pContext->m_cached_buffers[--pContext->m_num_cached_buffers];
+			uncache_context_bytes(pContext, buf.m_size);
+
+			pEngine->m_context_buffer_hits.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+
+	// Without cached buffers of its own to give back, this is the only attempt.
+	if (pEngine->m_ocl.acquire_pooled_buffer(flags, size, buf, !pContext->m_num_cached_buffers))
+		return true;
+
+	// Over the memory budget: the buffers this context keeps for itself can only be evicted once they're back in the shared pool.
+	// Other contexts' cached buffers are out of reach, which is what m_context_buffer_max_bytes bounds.
+	if (!pContext->m_num_cached_buffers)
+		return false;
+
+	release_context_cached_buffers(pContext);
+
+	return pEngine->m_ocl.acquire_pooled_buffer(flags, size, buf);
+}
+
+// Keeps the buffer on the context's free list, or returns it to the engine's buffer pool if the list is full or would exceed the context's byte cap. Clears buf.
+static void release_context_buffer(opencl_context* pContext, ocl_pooled_buffer& buf)
+{
+	if (!buf.m_buf)
+		return;
+
+	// Scratch arena sub-buffer
+	if (!buf.m_size)
+	{
+		buf.m_buf = nullptr;
+		return;
+	}
+
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	if ((pContext->m_num_cached_buffers < OCL_MAX_CONTEXT_BUFFERS) && (pEngine->m_ocl.is_buffer_size_pooled(buf.m_size)) && 
+		(pContext->m_cached_bytes + buf.m_size <= pEngine->m_context_buffer_max_bytes))
+	{
+		pContext->m_cached_buffers[pContext->m_num_cached_buffers++] = buf;
+		pContext->m_cached_bytes += buf.m_size;
+		pEngine->m_context_cached_bytes.fetch_add(buf.m_size, std::memory_order_relaxed);
+		buf.m_buf = nullptr;
+		return;
+	}
+
+	pEngine->m_ocl.release_pooled_buffer(buf);
+}
+
 static bool read_file_to_vec(const char* pFilename, std::vector<uint8_t>& data)
 {
 	FILE* pFile = nullptr;
@@ -78,161 +410,1767 @@ static bool read_file_to_vec(const char* pFilename, std::vector<uint8_t>& data)
 	return true;
 }
 		
-bool opencl_init(bool force_serialization)
+// Returns false if the file doesn't exist.
+static bool get_file_stamp(const char* pFilename, int64_t& mod_time, int64_t& size)
 {
-	if (g_ocl.is_initialized())
-	{
-		assert(0);
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(pFilename, &st) != 0)
 		return false;
-	}
+#else
+	struct stat st;
+	if (stat(pFilename, &st) != 0)
+		return false;
+#endif
+	mod_time = (int64_t)st.st_mtime;
+	size = (int64_t)st.st_size;
+	return true;
+}
+
+// Build defines of process_buffer variant variant_index (see opencl_context::m_process_buffer_variants).
+static void get_process_buffer_variant_defines(uint32_t vec_width, uint32_t variant_index, char* pBuf, size_t buf_size)
+{
+	snprintf(pBuf, buf_size, variant_index ? "VEC_WIDTH=%u BUF_SIZE_MULTIPLE=%u" : "VEC_WIDTH=%u", vec_width, vec_width);
+}
 
-	if (!g_ocl.init(force_serialization))
+// Builds every process_buffer variant of the current program in parallel, instead of one after another on the first dispatches that need them.
+// Returns the elapsed time in seconds.
+static double build_process_buffer_variants(opencl_engine* pEngine)
+{
+	if (pEngine->m_vec_width <= 1)
+		return 0.0;
+
+	char defines[OCL_TOTAL_PROCESS_BUFFER_VARIANTS][64];
+	const char* pDefines[OCL_TOTAL_PROCESS_BUFFER_VARIANTS];
+	for (uint32_t i = 0; i < OCL_TOTAL_PROCESS_BUFFER_VARIANTS; i++)
 	{
-		ocl_error_printf("opencl_init: Failed initializing OpenCL\n");
-		return false;
+		get_process_buffer_variant_defines(pEngine->m_vec_width, i, defines[i], sizeof(defines[i]));
+		pDefines[i] = defines[i];
 	}
 
-	const char* pKernel_src = nullptr;
-	size_t kernel_src_size = 0;
+	double wall_secs = 0.0, total_build_secs = 0.0;
+	if (!pEngine->m_ocl.build_program_variants(pDefines, OCL_TOTAL_PROCESS_BUFFER_VARIANTS, &wall_secs, &total_build_secs))
+		ocl_error_printf("build_process_buffer_variants: Failed compiling OpenCL kernel variants\n");
 
-#if OCL_USE_KERNELS_HEADER
-	pKernel_src = (const char *)ocl_kernels_cl;
-	kernel_src_size = ocl_kernels_cl_len;
+	printf("Built %u kernel variants in %3.3f ms (%3.3f ms of build time)\n", OCL_TOTAL_PROCESS_BUFFER_VARIANTS, wall_secs * 1000.0, total_build_secs * 1000.0);
 
-	printf("Using kernel source code from array in header src/ocl_kernels.h\n");
-#else
-	std::vector<uint8_t> kernel_src;
+	return wall_secs;
+}
 
-	// Read the text file containing the OpenCL kernels into the buffer.
-	// You could also embed the OpenCL kernel source into the app using the "xxd" Linux tool.
-	if (!read_file_to_vec(OCL_KERNELS_FILENAME, kernel_src))
-	{
-		ocl_error_printf("opencl_init: Cannot read OpenCL kernel source file \"%s\"! Make sure the current directory is \"bin\".\n", OCL_KERNELS_FILENAME);
-		g_ocl.deinit();
-		return false;
-	}
+// Polls the engine's kernel source file, and rebuilds and swaps in the program when it changes. Contexts pick up the new program on their next dispatch.
+static void kernel_source_watch_thread(opencl_engine* pEngine)
+{
+	const char* pFilename = pEngine->m_kernel_filename.c_str();
 
-	printf("Read kernel source from file \"%s\"\n", OCL_KERNELS_FILENAME);
-		
-	pKernel_src = (char*)kernel_src.data();
-	kernel_src_size = kernel_src.size();
-#endif
-	
-	if (!kernel_src_size)
+	int64_t last_mod_time = 0, last_size = 0;
+	get_file_stamp(pFilename, last_mod_time, last_size);
+
+	std::unique_lock<std::mutex> lock(pEngine->m_watch_mutex);
+
+	for ( ; ; )
 	{
-		ocl_error_printf("opencl_init: Invalid OpenCL kernel source file \"%s\"\n", OCL_KERNELS_FILENAME);
-		g_ocl.deinit();
-		return false;
+		if (pEngine->m_watch_cv.wait_for(lock, std::chrono::milliseconds(pEngine->m_watch_interval_ms), [pEngine] { return pEngine->m_watch_kill; }))
+			break;
+
+		int64_t mod_time = 0, size = 0;
+		if ((!get_file_stamp(pFilename, mod_time, size)) || ((mod_time == last_mod_time) && (size == last_size)))
+			continue;
+
+		lock.unlock();
+
+		std::vector<uint8_t> kernel_src;
+		if ((read_file_to_vec(pFilename, kernel_src)) && (kernel_src.size()))
+		{
+			// Only remember the new stamp once the file was read, in case it was caught mid-save.
+			last_mod_time = mod_time;
+			last_size = size;
+
+			printf("Kernel source file \"%s\" changed, rebuilding\n", pFilename);
+
+			if (pEngine->m_ocl.rebuild_program((const char*)kernel_src.data(), kernel_src.size()))
+			{
+				printf("Reloaded OpenCL program, generation %u\n", pEngine->m_ocl.get_program_generation());
+				build_process_buffer_variants(pEngine);
+			}
+			else
+				printf("Failed rebuilding OpenCL program, still using the previous one\n");
+		}
+
+		lock.lock();
 	}
+}
+
+static void stop_kernel_source_watch(opencl_engine* pEngine)
+{
+	if (!pEngine->m_watch_thread.joinable())
+		return;
 
-	if (!g_ocl.init_program(pKernel_src, kernel_src_size))
 	{
-		ocl_error_printf("opencl_init: Failed compiling OpenCL program\n");
-		g_ocl.deinit();
-		return false;
+		std::lock_guard<std::mutex> lock(pEngine->m_watch_mutex);
+		pEngine->m_watch_kill = true;
 	}
-							
-	printf("OpenCL context initialized successfully\n");
+	pEngine->m_watch_cv.notify_all();
 
-	return true;
+	pEngine->m_watch_thread.join();
 }
 
-void opencl_deinit()
+// Called when the program build finishes, on the build thread in async build mode. pUser_data is the engine.
+static void program_built_callback(bool success, void* pUser_data)
 {
-	g_ocl.deinit();
-}
+	opencl_engine* pEngine = static_cast<opencl_engine*>(pUser_data);
 
-bool opencl_is_available()
-{
-	return g_ocl.is_initialized();
+	pEngine->m_program_ready_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - pEngine->m_init_start_time).count();
+
+	if (!success)
+		ocl_error_printf("opencl_create_engine: Failed compiling OpenCL program\n");
+	else
+		pEngine->m_variant_build_secs = build_process_buffer_variants(pEngine);
+	
+	if (pEngine->m_pBuild_callback)
+		pEngine->m_pBuild_callback(success, pEngine->m_pBuild_callback_data);
 }
 
-opencl_context_ptr opencl_create_context()
+static bool to_program_modules(const opencl_kernel_module* pModules, uint32_t num_modules, ocl_program_module_vec& modules)
 {
-	if (!opencl_is_available())
-	{
-		ocl_error_printf("opencl_create_context: OpenCL not initialized\n");
-		assert(0);
-		return nullptr;
-	}
+	if (!pModules)
+		return false;
 
-	opencl_context* pContext = static_cast<opencl_context * >(calloc(sizeof(opencl_context), 1));
-	if (!pContext)
-		return nullptr;
-			
-	// To avoid driver bugs in some drivers - serialize this. Likely not necessary, we don't know.
-	// https://community.intel.com/t5/OpenCL-for-CPU/Bug-report-clCreateKernelsInProgram-is-not-thread-safe/td-p/1159771
-	
-	pContext->m_command_queue = g_ocl.create_command_queue();
-	if (!pContext->m_command_queue)
+	modules.resize(num_modules);
+	for (uint32_t i = 0; i < num_modules; i++)
 	{
-		ocl_error_printf("opencl_create_context: Failed creating OpenCL command queue!\n");
-		opencl_destroy_context(pContext);
-		return nullptr;
-	}
+		if ((!pModules[i].m_pName) || (!pModules[i].m_pSource))
+			return false;
 
-	// Create our kernel(s) here.
-	pContext->m_ocl_process_buffer_kernel = g_ocl.create_kernel("process_buffer");
-	if (!pContext->m_ocl_process_buffer_kernel)
-	{
-		ocl_error_printf("opencl_create_context: Failed creating OpenCL kernel process_buffer\n");
-		opencl_destroy_context(pContext);
-		return nullptr;
+		modules[i].m_name = pModules[i].m_pName;
+		modules[i].m_src.assign(pModules[i].m_pSource, pModules[i].m_source_size ? pModules[i].m_source_size : strlen(pModules[i].m_pSource));
+		modules[i].m_is_header = pModules[i].m_is_header;
 	}
 
-	return pContext;
+	return true;
 }
 
-void opencl_destroy_context(opencl_context_ptr pContext)
+static bool init_engine(opencl_engine* pEngine, const opencl_init_params& params)
 {
-	if (!pContext)
-		return;
-
-	g_ocl.destroy_kernel(pContext->m_ocl_process_buffer_kernel);
+	pEngine->m_init_start_time = std::chrono::high_resolution_clock::now();
+	pEngine->m_pBuild_callback = params.m_pBuild_callback;
+	pEngine->m_pBuild_callback_data = params.m_pBuild_callback_data;
 
-	g_ocl.destroy_command_queue(pContext->m_command_queue);
-		
-	memset(pContext, 0, sizeof(opencl_context));
+	ocl_init_params ocl_params;
+	ocl_params.m_force_serialization = params.m_force_serialization;
+	ocl_params.m_pDevice_override = params.m_pDevice_override;
+	ocl_params.m_pBinary_cache_dir = params.m_pBinary_cache_dir;
+	ocl_params.m_buffer_pool_min_size = params.m_buffer_pool_min_size;
+	ocl_params.m_buffer_pool_max_size = params.m_buffer_pool_max_size;
+	ocl_params.m_buffer_pool_max_free_bytes = params.m_buffer_pool_max_free_bytes;
+	ocl_params.m_mem_budget = params.m_mem_budget;
+#if OCL_USE_EMBEDDED_BINARIES
+	ocl_params.m_pEmbedded_binaries = ocl_kernel_binaries;
+	ocl_params.m_num_embedded_binaries = ocl_num_kernel_binaries;
+#endif
+	ocl_params.m_max_devices = (params.m_max_devices < OCL_MAX_DEVICES) ? params.m_max_devices : OCL_MAX_DEVICES;
+	ocl_params.m_cpu_sub_devices = (params.m_cpu_sub_devices < OCL_MAX_DEVICES) ? params.m_cpu_sub_devices : OCL_MAX_DEVICES;
+	if (params.m_cpu_partition == cOpenCLCPUPartitionNUMA)
+		ocl_params.m_cpu_affinity_domain = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+	else if (params.m_cpu_partition == cOpenCLCPUPartitionL3Cache)
+		ocl_params.m_cpu_affinity_domain = CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE;
 
-	free(pContext);
-}
+	pEngine->m_cpu_topology.init(params.m_cpu_partition == cOpenCLCPUPartitionL3Cache);
 
-// Example thread-safe function to process a buffer and return some output.
-bool opencl_process_buffer(
-	opencl_context_ptr pContext,
-	const uint8_t* pBuffer,
-	uint8_t* pOutput_buffer,
-	uint32_t buffer_size)
-{
-	if (!opencl_is_available())
+	if (!pEngine->m_ocl.init(ocl_params))
+	{
+		ocl_error_printf("opencl_create_engine: Failed initializing OpenCL\n");
 		return false;
+	}
 
-	bool status = false;
+	const std::chrono::high_resolution_clock::time_point load_start_time = std::chrono::high_resolution_clock::now();
 
-	// Create input/output OpenCL buffers.			
-	cl_mem input_buf = g_ocl.alloc_and_init_read_buffer(pContext->m_command_queue, pBuffer, buffer_size);
-	cl_mem output_buf = g_ocl.alloc_write_buffer(buffer_size);
+	const char* pKernel_src = nullptr;
+	size_t kernel_src_size = 0;
+	std::vector<uint8_t> kernel_src;
+	ocl_program_module_vec modules;
 
-	if (!input_buf || !output_buf)
-		goto exit;
+	if (params.m_num_kernel_modules)
+	{
+		if (!to_program_modules(params.m_pKernel_modules, params.m_num_kernel_modules, modules))
+		{
+			ocl_error_printf("opencl_create_engine: Invalid OpenCL kernel modules\n");
+			return false;
+		}
+	}
+	else if (params.m_pKernel_source)
+	{
+		pKernel_src = params.m_pKernel_source;
+		kernel_src_size = params.m_kernel_source_size ? params.m_kernel_source_size : strlen(params.m_pKernel_source);
+	}
+	else
+	{
+#if OCL_USE_KERNELS_HEADER
+		if (!params.m_pKernel_filename)
+		{
+			pKernel_src = (const char*)ocl_kernels_cl;
+			kernel_src_size = ocl_kernels_cl_len;
 
-	// Set the kernel arguments
-	if (!g_ocl.set_kernel_args(pContext->m_ocl_process_buffer_kernel, input_buf, output_buf, buffer_size))
-		goto exit;
+			printf("Using kernel source code from array in header src/ocl_kernels.h\n");
+		}
+		else
+#endif
+		{
+			pEngine->m_kernel_filename = params.m_pKernel_filename ? params.m_pKernel_filename : OCL_KERNELS_FILENAME;
 
-	// Run the kernel
-	if (!g_ocl.run_2D(pContext->m_command_queue, pContext->m_ocl_process_buffer_kernel, buffer_size, 1))
-		goto exit;
+			// Read the text file containing the OpenCL kernels into the buffer.
+			// You could also embed the OpenCL kernel source into the app using the "xxd" Linux tool.
+			if (!read_file_to_vec(pEngine->m_kernel_filename.c_str(), kernel_src))
+			{
+				ocl_error_printf("opencl_create_engine: Cannot read OpenCL kernel source file \"%s\"! Make sure the current directory is \"bin\".\n", pEngine->m_kernel_filename.c_str());
+				return false;
+			}
 
-	// Retrieve the output
-	if (!g_ocl.read_from_buffer(pContext->m_command_queue, output_buf, pOutput_buffer, buffer_size))
-		goto exit;
+			printf("Read kernel source from file \"%s\"\n", pEngine->m_kernel_filename.c_str());
 
-	status = true;
+			pKernel_src = (char*)kernel_src.data();
+			kernel_src_size = kernel_src.size();
+		}
+	}
+	
+	if (modules.empty())
+	{
+		if (!kernel_src_size)
+		{
+			ocl_error_printf("opencl_create_engine: Invalid OpenCL kernel source\n");
+			return false;
+		}
 
-exit:
-	g_ocl.destroy_buffer(input_buf);
-	g_ocl.destroy_buffer(output_buf);
+		modules.resize(1);
+		modules[0].m_src.assign(pKernel_src, kernel_src_size);
+	}
+
+	pEngine->m_kernel_source_load_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - load_start_time).count();
+
+	// Set before the build starts, since the build callback prebuilds the variants.
+	if (params.m_vec_width > 1)
+	{
+		if ((params.m_vec_width <= OCL_MAX_VEC_WIDTH) && ((params.m_vec_width & (params.m_vec_width - 1)) == 0))
+		{
+			pEngine->m_vec_width = params.m_vec_width;
+			printf("Using process_buffer VEC_WIDTH=%u kernel variants\n", pEngine->m_vec_width);
+		}
+		else
+			printf("Invalid vector width %u (must be a power of 2 <= %u), ignoring\n", params.m_vec_width, OCL_MAX_VEC_WIDTH);
+	}
+
+	if (params.m_async_build)
+	{
+		// The build thread gets its own copy of the source. Kernels get created on first use, which waits for the build if it's still running.
+		pEngine->m_ocl.init_program_async(modules, program_built_callback, pEngine);
+	}
+	else if (!pEngine->m_ocl.init_program(modules))
+	{
+		ocl_error_printf("opencl_create_engine: Failed compiling OpenCL program\n");
+		return false;
+	}
+	else
+	{
+		program_built_callback(true, pEngine);
+	}
+							
+	pEngine->m_device_caps_json = "[";
+	for (uint32_t i = 0; i < pEngine->m_ocl.get_num_devices(); i++)
+	{
+		if (i)
+			pEngine->m_device_caps_json += ",";
+		pEngine->m_device_caps_json += pEngine->m_ocl.get_device_caps(i).to_json();
+	}
+	pEngine->m_device_caps_json += "]";
+
+	pEngine->m_staging_buffer_size = params.m_staging_buffer_size;
+	pEngine->m_zero_copy = params.m_zero_copy;
+	pEngine->m_zero_copy_alignment = params.m_zero_copy_alignment;
+	pEngine->m_scratch_arena_size = params.m_scratch_arena_size;
+	pEngine->m_context_buffer_max_bytes = params.m_context_buffer_max_bytes;
+
+	pEngine->m_coexec_enabled = params.m_coexec;
+	if (pEngine->m_coexec_enabled)
+	{
+		uint32_t num_host_threads = params.m_coexec_host_threads;
+		if (!num_host_threads)
+		{
+			// The calling thread feeds the device(s), and the driver needs a core too.
+			const uint32_t num_cores = std::thread::hardware_concurrency();
+			num_host_threads = (num_cores > 2) ? (num_cores - 2) : 0;
+		}
+
+		// The calling thread is blocked on the device(s) while they work, so without workers the host part couldn't overlap with them.
+		if (!num_host_threads)
+		{
+			pEngine->m_coexec_enabled = false;
+			printf("Co-execution disabled, no host worker threads available\n");
+		}
+		else
+		{
+			pEngine->m_coexec_job_pool.init(num_host_threads);
+			printf("Co-execution enabled, %u host worker threads\n", num_host_threads);
+		}
+	}
+							
+	if (params.m_watch_kernel_source)
+	{
+		if (pEngine->m_kernel_filename.empty())
+		{
+			printf("Kernel source watching requires the kernel source to be loaded from a file, ignoring\n");
+		}
+		else
+		{
+			pEngine->m_watch_interval_ms = params.m_watch_interval_ms ? params.m_watch_interval_ms : 500;
+			pEngine->m_watch_thread = std::thread(kernel_source_watch_thread, pEngine);
+
+			printf("Watching kernel source file \"%s\" for changes\n", pEngine->m_kernel_filename.c_str());
+		}
+	}
+
+	pEngine->m_init_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - pEngine->m_init_start_time).count();
+
+	printf("OpenCL context initialized successfully\n");
+
+	return true;
+}
+
+opencl_engine_ptr opencl_create_engine(const opencl_init_params& params)
+{
+	opencl_engine* pEngine = new opencl_engine;
+
+	if (!init_engine(pEngine, params))
+	{
+		opencl_destroy_engine(pEngine);
+		return nullptr;
+	}
+
+	return pEngine;
+}
+
+void opencl_destroy_engine(opencl_engine_ptr pEngine)
+{
+	if (!pEngine)
+		return;
+
+	stop_kernel_source_watch(pEngine);
+
+	pEngine->m_coexec_job_pool.deinit();
+
+	pEngine->m_ocl.deinit();
+
+	delete pEngine;
+}
+
+bool opencl_is_available(opencl_engine_ptr pEngine)
+{
+	return pEngine && pEngine->m_ocl.is_initialized();
+}
+
+bool opencl_get_init_timings(opencl_engine_ptr pEngine, opencl_init_timings& timings)
+{
+	memset(&timings, 0, sizeof(timings));
+
+	if (!opencl_is_available(pEngine))
+		return false;
+
+	timings.m_device_select_secs = pEngine->m_ocl.get_device_select_secs();
+	timings.m_context_create_secs = pEngine->m_ocl.get_context_create_secs();
+	timings.m_kernel_source_load_secs = pEngine->m_kernel_source_load_secs;
+	timings.m_init_secs = pEngine->m_init_secs;
+
+	// The build timings are only valid once the program is ready.
+	if (pEngine->m_ocl.is_program_ready())
+	{
+		timings.m_program_build_secs = pEngine->m_ocl.get_program_build_secs();
+		timings.m_program_ready_secs = pEngine->m_program_ready_secs;
+		timings.m_variant_build_secs = pEngine->m_variant_build_secs;
+	}
+
+	return true;
+}
+
+const char* opencl_get_device_caps_json(opencl_engine_ptr pEngine)
+{
+	return pEngine ? pEngine->m_device_caps_json.c_str() : "";
+}
+
+bool opencl_rebuild_program(opencl_engine_ptr pEngine, const opencl_kernel_module* pModules, uint32_t num_modules)
+{
+	if (!opencl_is_available(pEngine))
+		return false;
+
+	ocl_program_module_vec modules;
+	if (!to_program_modules(pModules, num_modules, modules))
+	{
+		ocl_error_printf("opencl_rebuild_program: Invalid OpenCL kernel modules\n");
+		return false;
+	}
+
+	if (!pEngine->m_ocl.rebuild_program(modules))
+		return false;
+
+	build_process_buffer_variants(pEngine);
+	return true;
+}
+
+bool opencl_init(bool force_serialization, const char* pDevice_override)
+{
+	opencl_init_params params;
+	params.m_force_serialization = force_serialization;
+	params.m_pDevice_override = pDevice_override;
+	return opencl_init(params);
+}
+
+bool opencl_init(const opencl_init_params& params)
+{
+	if (g_pDefault_engine)
+	{
+		assert(0);
+		return false;
+	}
+
+	g_pDefault_engine = opencl_create_engine(params);
+
+	return g_pDefault_engine != nullptr;
+}
+
+void opencl_deinit()
+{
+	opencl_destroy_engine(g_pDefault_engine);
+	g_pDefault_engine = nullptr;
+}
+
+bool opencl_is_available()
+{
+	return opencl_is_available(g_pDefault_engine);
+}
+
+bool opencl_get_init_timings(opencl_init_timings& timings)
+{
+	return opencl_get_init_timings(g_pDefault_engine, timings);
+}
+
+const char* opencl_get_device_caps_json()
+{
+	return opencl_get_device_caps_json(g_pDefault_engine);
+}
+
+// Slow path of get_context_kernel(). Waits for the program if it's still being built.
+static cl_kernel create_context_kernel(opencl_context_ptr pContext, ocl_kernel_id kernel_id)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+	opencl_context::context_kernel& k = pContext->m_kernels[kernel_id];
+
+	if (!pEngine->m_ocl.wait_for_program())
+	{
+		ocl_error_printf("create_context_kernel: OpenCL program failed to build\n");
+		return nullptr;
+	}
+
+	// Return a kernel from an older program generation (the pool releases it). Any work already queued with it still completes.
+	pEngine->m_ocl.release_pooled_kernel(g_kernels[kernel_id].m_pName, k.m_kernel, k.m_generation);
+
+	k.m_kernel = pEngine->m_ocl.acquire_pooled_kernel(g_kernels[kernel_id].m_pName, &k.m_generation);
+	if (!k.m_kernel)
+	{
+		ocl_error_printf("create_context_kernel: Failed creating OpenCL kernel %s\n", g_kernels[kernel_id].m_pName);
+		return nullptr;
+	}
+
+	// Catch the registry and the kernel source getting out of sync.
+	const uint32_t num_args = pEngine->m_ocl.get_kernel_num_args(k.m_kernel);
+	if (num_args != g_kernels[kernel_id].m_num_args)
+	{
+		ocl_error_printf("create_context_kernel: OpenCL kernel %s has %u arguments, expected %u\n", g_kernels[kernel_id].m_pName, num_args, g_kernels[kernel_id].m_num_args);
+
+		pEngine->m_ocl.release_pooled_kernel(g_kernels[kernel_id].m_pName, k.m_kernel, k.m_generation);
+		k.m_kernel = nullptr;
+		return nullptr;
+	}
+
+	return k.m_kernel;
+}
+
+static inline cl_kernel get_context_kernel(opencl_context_ptr pContext, ocl_kernel_id kernel_id)
+{
+	const opencl_context::context_kernel& k = pContext->m_kernels[kernel_id];
+	if ((k.m_kernel) && (k.m_generation == pContext->m_pEngine->m_ocl.get_program_generation()))
+		return k.m_kernel;
+
+	return create_context_kernel(pContext, kernel_id);
+}
+
+opencl_context_ptr opencl_create_context(opencl_engine_ptr pEngine)
+{
+	if (!opencl_is_available(pEngine))
+	{
+		ocl_error_printf("opencl_create_context: OpenCL not initialized\n");
+		assert(0);
+		return nullptr;
+	}
+
+	opencl_context* pContext = static_cast<opencl_context * >(calloc(sizeof(opencl_context), 1));
+	if (!pContext)
+		return nullptr;
+
+	pContext->m_pEngine = pEngine;
+
+	pContext->m_numa_node = pEngine->m_cpu_topology.get_current_node();
+
+	if (pEngine->m_ocl.get_affinity_domain())
+	{
+		// Bind this context to the sub-device of the affinity domain the calling thread is running on.
+		pContext->m_num_command_queues = 1;
+		pContext->m_device_indices[0] = pEngine->m_cpu_topology.get_current_domain() % pEngine->m_ocl.get_num_devices();
+	}
+	else
+	{
+		pContext->m_num_command_queues = std::min<uint32_t>(pEngine->m_ocl.get_num_devices(), OCL_MAX_DEVICES);
+		for (uint32_t i = 0; i < pContext->m_num_command_queues; i++)
+			pContext->m_device_indices[i] = i;
+	}
+
+	for (uint32_t i = 0; i < pContext->m_num_command_queues; i++)
+	{
+		pContext->m_command_queues[i] = pEngine->m_ocl.create_command_queue(pContext->m_device_indices[i]);
+		if (!pContext->m_command_queues[i])
+		{
+			ocl_error_printf("opencl_create_context: Failed creating OpenCL command queue!\n");
+			opencl_destroy_context(pContext);
+			return nullptr;
+		}
+	}
+
+	// Kernels are taken from the engine's kernel pool on first use, see get_context_kernel().
+
+	return pContext;
+}
+
+opencl_context_ptr opencl_create_context()
+{
+	return opencl_create_context(g_pDefault_engine);
+}
+
+void opencl_destroy_context(opencl_context_ptr pContext)
+{
+	if (!pContext)
+		return;
+
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	// Requests still in flight on the context's queues finish first. Their handles stay valid until opencl_release_request().
+	for (uint32_t i = 0; i < pContext->m_num_command_queues; i++)
+		pEngine->m_ocl.flush(pContext->m_command_queues[i]);
+
+	for (uint32_t i = 0; i < OCL_TOTAL_KERNELS; i++)
+		pEngine->m_ocl.release_pooled_kernel(g_kernels[i].m_pName, pContext->m_kernels[i].m_kernel, pContext->m_kernels[i].m_generation);
+
+	for (uint32_t i = 0; i < OCL_TOTAL_PROCESS_BUFFER_VARIANTS; i++)
+		pEngine->m_ocl.destroy_kernel(pContext->m_process_buffer_variants[i].m_kernel);
+
+	release_context_cached_buffers(pContext);
+
+	delete pContext->m_pScratch_arena;
+
+	if (pContext->m_num_command_queues)
+	{
+		pEngine->m_ocl.deinit_staging_buffer(pContext->m_command_queues[0], pContext->m_staging);
+
+		for (uint32_t i = 0; i < pContext->m_num_pinned_buffers; i++)
+			pEngine->m_ocl.free_pinned_buffer(pContext->m_command_queues[0], pContext->m_pinned_buffers[i]);
+
+		pEngine->m_ocl.free_pinned_buffer(pContext->m_command_queues[0], pContext->m_batch_input);
+		pEngine->m_ocl.free_pinned_buffer(pContext->m_command_queues[0], pContext->m_batch_output);
+	}
+
+	for (uint32_t i = 0; i < pContext->m_num_command_queues; i++)
+		pEngine->m_ocl.destroy_command_queue(pContext->m_command_queues[i]);
+
+	for (uint32_t i = 0; i < OCL_STREAM_STAGES; i++)
+		pEngine->m_ocl.destroy_command_queue(pContext->m_stream_queues[i]);
+		
+	memset(pContext, 0, sizeof(opencl_context));
+
+	free(pContext);
+}
+
+void* opencl_alloc_host_buffer(opencl_context_ptr pContext, size_t size)
+{
+	return ocl_cpu_topology::alloc_on_node(size, pContext ? pContext->m_numa_node : 0);
+}
+
+void opencl_free_host_buffer(opencl_context_ptr pContext, void* p, size_t size)
+{
+	(void)pContext;
+	ocl_cpu_topology::free_on_node(p, size);
+}
+
+void* opencl_alloc_pinned_buffer(opencl_context_ptr pContext, size_t size)
+{
+	if ((!pContext) || (!size) || (!pContext->m_command_queues[0]))
+		return nullptr;
+
+	if (pContext->m_num_pinned_buffers == OCL_MAX_PINNED_BUFFERS)
+	{
+		ocl_error_printf("opencl_alloc_pinned_buffer: Too many pinned buffers\n");
+		return nullptr;
+	}
+
+	ocl_pinned_buffer& pb = pContext->m_pinned_buffers[pContext->m_num_pinned_buffers];
+	if (!pContext->m_pEngine->m_ocl.alloc_pinned_buffer(pContext->m_command_queues[0], size, pb))
+		return nullptr;
+
+	pContext->m_num_pinned_buffers++;
+	return pb.m_pPtr;
+}
+
+void opencl_free_pinned_buffer(opencl_context_ptr pContext, void* p)
+{
+	if ((!pContext) || (!p))
+		return;
+
+	for (uint32_t i = 0; i < pContext->m_num_pinned_buffers; i++)
+	{
+		if (pContext->m_pinned_buffers[i].m_pPtr == p)
+		{
+			pContext->m_pEngine->m_ocl.free_pinned_buffer(pContext->m_command_queues[0], pContext->m_pinned_buffers[i]);
+			pContext->m_pinned_buffers[i] = pContext->m_pinned_buffers[--pContext->m_num_pinned_buffers];
+			return;
+		}
+	}
+
+	assert(0);
+}
+
+// Returns true if [p, p + size) lies within one of the context's pinned buffers.
+static bool is_pinned_memory(const opencl_context* pContext, const void* p, size_t size)
+{
+	const uint8_t* pBytes = static_cast<const uint8_t*>(p);
+
+	for (uint32_t i = 0; i < pContext->m_num_pinned_buffers; i++)
+	{
+		const ocl_pinned_buffer& pb = pContext->m_pinned_buffers[i];
+		if ((pBytes >= pb.m_pPtr) && (size <= pb.m_size) && ((size_t)(pBytes - pb.m_pPtr) <= pb.m_size - size))
+			return true;
+	}
+
+	return false;
+}
+
+// Returns true if the kernel on device device_index can access the caller's memory at p in place: the device shares memory with the host, and p is aligned
+// to the device's CL_DEVICE_MEM_BASE_ADDR_ALIGN (or m_zero_copy_alignment, if larger). Anything else takes the copying path.
+static bool use_zero_copy(const opencl_context* pContext, uint32_t device_index, const void* p)
+{
+	const opencl_engine* pEngine = pContext->m_pEngine;
+	if (!pEngine->m_zero_copy)
+		return false;
+
+	const ocl_device_caps& caps = pEngine->m_ocl.get_device_caps(device_index);
+	if (!caps.m_host_unified_memory)
+		return false;
+
+	const uintptr_t alignment = std::max<uintptr_t>(std::max<uintptr_t>(caps.m_mem_base_addr_align, pEngine->m_zero_copy_alignment), 1);
+	return ((uintptr_t)p % alignment) == 0;
+}
+
+// Transfers between the caller's memory and the device with index device_index go through the context's pinned staging buffer, unless the device 
+// shares memory with the host, the memory is already pinned, or staging is disabled. Creates the staging buffer on first use.
+static bool use_staging(opencl_context* pContext, uint32_t device_index, const void* p, size_t size)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	if ((!pEngine->m_staging_buffer_size) || (pContext->m_staging_failed) || (pEngine->m_ocl.get_device_caps(device_index).m_host_unified_memory) || (is_pinned_memory(pContext, p, size)))
+		return false;
+
+	if (!pContext->m_staging.m_pinned.m_buf)
+	{
+		if (!pEngine->m_ocl.init_staging_buffer(pContext->m_command_queues[0], pEngine->m_staging_buffer_size, pContext->m_staging))
+		{
+			printf("use_staging: Failed creating pinned staging buffer, disabling staged transfers\n");
+			pContext->m_staging_failed = true;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Splits the first device_size bytes of the buffer into shards across the context's devices, weighted by each device's score. Returns the number of shards.
+static uint32_t compute_shards(opencl_context_ptr pContext, uint32_t device_size, uint32_t* pShard_ofs, uint32_t* pShard_size)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	uint32_t num_shards = device_size / OCL_MIN_SHARD_SIZE;
+	if (num_shards > pContext->m_num_command_queues)
+		num_shards = pContext->m_num_command_queues;
+	if (!num_shards)
+		num_shards = 1;
+
+	// Devices are ordered by descending score, so the first num_shards devices are the fastest ones.
+	float total_score = 0.0f;
+	for (uint32_t i = 0; i < num_shards; i++)
+		total_score += pEngine->m_ocl.get_device_score(pContext->m_device_indices[i]);
+
+	uint32_t cur_ofs = 0;
+	for (uint32_t i = 0; i < num_shards; i++)
+	{
+		uint32_t size = device_size - cur_ofs;
+		if ((i + 1 < num_shards) && (total_score > 0.0f))
+		{
+			// Keep shard boundaries 4KB aligned.
+			size = (uint32_t)(((double)device_size * pEngine->m_ocl.get_device_score(pContext->m_device_indices[i])) / total_score) & ~4095U;
+			if (size > device_size - cur_ofs)
+				size = device_size - cur_ofs;
+		}
+
+		pShard_ofs[i] = cur_ofs;
+		pShard_size[i] = size;
+		cur_ofs += size;
+	}
+
+	return num_shards;
+}
+
+// Returns how many bytes at the start of the buffer the device(s) should process in co-execution mode. The host gets the rest.
+static uint32_t coexec_get_device_size(opencl_engine* pEngine, uint32_t coexec_kernel_index, uint32_t buffer_size)
+{
+	coexec_state& state = pEngine->m_coexec_states[coexec_kernel_index];
+
+	float device_fraction;
+	{
+		std::lock_guard<std::mutex> lock(state.m_mutex);
+		device_fraction = state.m_device_fraction;
+	}
+
+	// Keep the split 4KB aligned.
+	uint32_t device_size = (uint32_t)((double)buffer_size * device_fraction) & ~4095U;
+	if (buffer_size - device_size < OCL_COEXEC_MIN_HOST_TASK_SIZE)
+		device_size = buffer_size;
+
+	return device_size;
+}
+
+// Updates the device/host throughput averages from the last call, and moves the split so both sides should finish at about the same time.
+static void coexec_update_split(opencl_engine* pEngine, uint32_t coexec_kernel_index, uint32_t device_size, double device_secs, uint32_t host_size, double host_secs)
+{
+	coexec_state& state = pEngine->m_coexec_states[coexec_kernel_index];
+
+	std::lock_guard<std::mutex> lock(state.m_mutex);
+
+	state.m_total_calls++;
+
+	if ((device_size) && (device_secs > 0.0))
+	{
+		const double bytes_per_sec = device_size / device_secs;
+		state.m_device_bytes_per_sec = (state.m_device_bytes_per_sec > 0.0) ? (state.m_device_bytes_per_sec + (bytes_per_sec - state.m_device_bytes_per_sec) * OCL_COEXEC_EMA_WEIGHT) : bytes_per_sec;
+	}
+
+	if ((host_size) && (host_secs > 0.0))
+	{
+		const double bytes_per_sec = host_size / host_secs;
+		state.m_host_bytes_per_sec = (state.m_host_bytes_per_sec > 0.0) ? (state.m_host_bytes_per_sec + (bytes_per_sec - state.m_host_bytes_per_sec) * OCL_COEXEC_EMA_WEIGHT) : bytes_per_sec;
+	}
+
+	if ((state.m_device_bytes_per_sec > 0.0) && (state.m_host_bytes_per_sec > 0.0))
+	{
+		float f = (float)(state.m_device_bytes_per_sec / (state.m_device_bytes_per_sec + state.m_host_bytes_per_sec));
+		if (f < OCL_COEXEC_MIN_FRACTION)
+			f = OCL_COEXEC_MIN_FRACTION;
+		else if (f > 1.0f - OCL_COEXEC_MIN_FRACTION)
+			f = 1.0f - OCL_COEXEC_MIN_FRACTION;
+
+		state.m_device_fraction = f;
+	}
+}
+
+bool opencl_get_coexec_stats(opencl_engine_ptr pEngine, opencl_coexec_stats& stats)
+{
+	memset(&stats, 0, sizeof(stats));
+
+	if ((!pEngine) || (!pEngine->m_coexec_enabled))
+		return false;
+
+	coexec_state& state = pEngine->m_coexec_states[OCL_KERNEL_PROCESS_BUFFER];
+
+	std::lock_guard<std::mutex> lock(state.m_mutex);
+
+	stats.m_device_fraction = state.m_device_fraction;
+	stats.m_device_bytes_per_sec = state.m_device_bytes_per_sec;
+	stats.m_host_bytes_per_sec = state.m_host_bytes_per_sec;
+	stats.m_total_calls = state.m_total_calls;
+
+	return true;
+}
+
+bool opencl_get_coexec_stats(opencl_coexec_stats& stats)
+{
+	return opencl_get_coexec_stats(g_pDefault_engine, stats);
+}
+
+bool opencl_get_kernel_pool_stats(opencl_engine_ptr pEngine, opencl_kernel_pool_stats& stats)
+{
+	memset(&stats, 0, sizeof(stats));
+
+	if (!opencl_is_available(pEngine))
+		return false;
+
+	ocl_kernel_pool_stats pool_stats;
+	pEngine->m_ocl.get_kernel_pool_stats(pool_stats);
+
+	stats.m_total_kernels = pool_stats.m_total_kernels;
+	stats.m_kernels_in_use = pool_stats.m_kernels_in_use;
+	stats.m_peak_kernels_in_use = pool_stats.m_peak_kernels_in_use;
+	stats.m_total_acquires = pool_stats.m_total_acquires;
+	stats.m_total_bulk_creates = pool_stats.m_total_bulk_creates;
+
+	return true;
+}
+
+bool opencl_get_kernel_pool_stats(opencl_kernel_pool_stats& stats)
+{
+	return opencl_get_kernel_pool_stats(g_pDefault_engine, stats);
+}
+
+bool opencl_get_buffer_pool_stats(opencl_engine_ptr pEngine, opencl_buffer_pool_stats& stats)
+{
+	memset(&stats, 0, sizeof(stats));
+
+	if (!opencl_is_available(pEngine))
+		return false;
+
+	ocl_buffer_pool_stats pool_stats;
+	pEngine->m_ocl.get_buffer_pool_stats(pool_stats);
+
+	const uint64_t context_hits = pEngine->m_context_buffer_hits.load(std::memory_order_relaxed);
+
+	stats.m_total_bytes = pool_stats.m_total_bytes;
+	stats.m_peak_total_bytes = pool_stats.m_peak_total_bytes;
+	stats.m_free_bytes = pool_stats.m_free_bytes;
+	stats.m_context_cached_bytes = pEngine->m_context_cached_bytes.load(std::memory_order_relaxed);
+	stats.m_total_buffers = pool_stats.m_total_buffers;
+	stats.m_free_buffers = pool_stats.m_free_buffers;
+	stats.m_total_acquires = pool_stats.m_total_acquires + context_hits;
+	stats.m_total_hits = pool_stats.m_total_hits + context_hits;
+	stats.m_total_trimmed_bytes = pool_stats.m_total_trimmed_bytes;
+	stats.m_hit_rate = stats.m_total_acquires ? (float)((double)stats.m_total_hits / (double)stats.m_total_acquires) : 0.0f;
+
+	return true;
+}
+
+bool opencl_get_buffer_pool_stats(opencl_buffer_pool_stats& stats)
+{
+	return opencl_get_buffer_pool_stats(g_pDefault_engine, stats);
+}
+
+uint64_t opencl_trim_buffer_pool(opencl_engine_ptr pEngine, uint64_t max_free_bytes)
+{
+	if (!opencl_is_available(pEngine))
+		return 0;
+
+	return pEngine->m_ocl.trim_buffer_pool(max_free_bytes);
+}
+
+uint64_t opencl_trim_buffer_pool(uint64_t max_free_bytes)
+{
+	return opencl_trim_buffer_pool(g_pDefault_engine, max_free_bytes);
+}
+
+bool opencl_get_mem_stats(opencl_engine_ptr pEngine, opencl_mem_stats& stats)
+{
+	memset(&stats, 0, sizeof(stats));
+
+	if (!opencl_is_available(pEngine))
+		return false;
+
+	ocl_mem_stats mem_stats;
+	pEngine->m_ocl.get_mem_stats(mem_stats);
+
+	stats.m_budget = mem_stats.m_budget;
+	stats.m_allocated_bytes = mem_stats.m_allocated_bytes;
+	stats.m_peak_allocated_bytes = mem_stats.m_peak_allocated_bytes;
+	stats.m_num_buffers = mem_stats.m_num_buffers;
+	stats.m_num_images = mem_stats.m_num_images;
+	stats.m_num_sub_buffers = mem_stats.m_num_sub_buffers;
+	stats.m_total_evictions = mem_stats.m_total_evictions;
+	stats.m_total_evicted_bytes = mem_stats.m_total_evicted_bytes;
+	stats.m_total_failed_allocs = mem_stats.m_total_failed_allocs;
+	stats.m_total_budget_misses = mem_stats.m_total_budget_misses;
+
+	return true;
+}
+
+bool opencl_get_mem_stats(opencl_mem_stats& stats)
+{
+	return opencl_get_mem_stats(g_pDefault_engine, stats);
+}
+
+bool opencl_set_mem_budget(opencl_engine_ptr pEngine, uint64_t budget)
+{
+	if (!opencl_is_available(pEngine))
+		return false;
+
+	pEngine->m_ocl.set_mem_budget(budget);
+	return true;
+}
+
+bool opencl_set_mem_budget(uint64_t budget)
+{
+	return opencl_set_mem_budget(g_pDefault_engine, budget);
+}
+
+// Uploads one shard of the caller's buffer, through the context's staging buffer when that pays off (see use_staging()).
+static bool upload_shard(opencl_context* pContext, uint32_t queue_index, cl_mem buf, const uint8_t* pSrc, uint32_t size)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+	cl_command_queue command_queue = pContext->m_command_queues[queue_index];
+
+	if (use_staging(pContext, pContext->m_device_indices[queue_index], pSrc, size))
+		return pEngine->m_ocl.write_to_buffer_staged(command_queue, buf, 0, pSrc, size, pContext->m_staging);
+
+	return pEngine->m_ocl.write_to_buffer(command_queue, buf, pSrc, size, false);
+}
+
+// Runs a process_buffer style kernel (one output byte per input byte) over the buffer, sharded across the context's devices, plus the host in co-execution mode.
+// If in_place is true, pBuffer and pOutput_buffer are the same memory and the kernel takes a single read/write buffer: (buf, buf_size, base_ofs) instead of (input, output, buf_size, base_ofs).
+// base_ofs is the buffer's 64-bit offset in a larger stream or file it's part of (0 if none), which the kernel sees as the offset of its first byte.
+static bool run_process_buffer(opencl_context* pContext, ocl_kernel_id kernel_id, cl_kernel kernel, uint32_t vec_width, bool in_place,
+	const uint8_t* pBuffer, uint8_t* pOutput_buffer, uint32_t buffer_size, uint64_t base_ofs = 0)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	bool status = false;
+
+	// In co-execution mode the device(s) process the start of the buffer, and the host the rest.
+	const uint32_t device_size = pEngine->m_coexec_enabled ? coexec_get_device_size(pEngine, kernel_id, buffer_size) : buffer_size;
+	const uint32_t host_size = buffer_size - device_size;
+
+	uint32_t shard_ofs[OCL_MAX_DEVICES], shard_size[OCL_MAX_DEVICES];
+	const uint32_t num_shards = compute_shards(pContext, device_size, shard_ofs, shard_size);
+
+	ocl_pooled_buffer input_bufs[OCL_MAX_DEVICES], output_bufs[OCL_MAX_DEVICES];
+	memset(input_bufs, 0, sizeof(input_bufs));
+	memset(output_bufs, 0, sizeof(output_bufs));
+
+	// Buffers wrapping the caller's memory in zero copy mode, nullptr for shards that use pooled buffers.
+	cl_mem zero_copy_inputs[OCL_MAX_DEVICES], zero_copy_outputs[OCL_MAX_DEVICES];
+	memset(zero_copy_inputs, 0, sizeof(zero_copy_inputs));
+	memset(zero_copy_outputs, 0, sizeof(zero_copy_outputs));
+
+	bool staged_reads[OCL_MAX_DEVICES];
+	memset(staged_reads, 0, sizeof(staged_reads));
+	bool downloads_ok = true;
+
+	const std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+
+	std::chrono::high_resolution_clock::time_point host_start_time;
+	std::vector<std::chrono::high_resolution_clock::time_point> host_task_end_times;
+	std::function<void(uint32_t)> host_task;
+	ocl_job_batch host_batch;
+	uint32_t num_host_tasks = 0;
+	double device_secs = 0.0, host_secs = 0.0;
+
+	// Queue the upload, kernel and download of each shard on its device's command queue without blocking, so all the shards run concurrently.
+	// Kernel arguments are captured at enqueue time, so the same kernel object can be reused for each shard.
+	for (uint32_t i = 0; i < num_shards; i++)
+	{
+		if (!shard_size[i])
+			continue;
+
+		cl_command_queue command_queue = pContext->m_command_queues[i];
+		const uint32_t device_index = pContext->m_device_indices[i];
+
+		if (in_place)
+		{
+			// One read/write buffer, uploaded and downloaded in place. In zero copy mode it wraps the caller's memory.
+			if (use_zero_copy(pContext, device_index, pOutput_buffer + shard_ofs[i]))
+				zero_copy_outputs[i] = pEngine->m_ocl.alloc_host_ptr_buffer(CL_MEM_READ_WRITE, pOutput_buffer + shard_ofs[i], shard_size[i], false);
+
+			if (!zero_copy_outputs[i])
+			{
+				if (!acquire_context_buffer(pContext, CL_MEM_READ_WRITE, shard_size[i], output_bufs[i]))
+					goto exit;
+
+				if (!upload_shard(pContext, i, output_bufs[i].m_buf, pOutput_buffer + shard_ofs[i], shard_size[i]))
+					goto exit;
+			}
+		}
+		else
+		{
+			// In zero copy mode the kernel reads and writes the caller's memory in place. If wrapping it fails, fall back to copying.
+			if (use_zero_copy(pContext, device_index, pBuffer + shard_ofs[i]))
+				zero_copy_inputs[i] = pEngine->m_ocl.alloc_host_ptr_buffer(CL_MEM_READ_ONLY, const_cast<uint8_t*>(pBuffer + shard_ofs[i]), shard_size[i], false);
+			if (use_zero_copy(pContext, device_index, pOutput_buffer + shard_ofs[i]))
+				zero_copy_outputs[i] = pEngine->m_ocl.alloc_host_ptr_buffer(CL_MEM_WRITE_ONLY, pOutput_buffer + shard_ofs[i], shard_size[i], false);
+
+			// Otherwise get input/output OpenCL buffers from the buffer pool. They may be larger than the shard.
+			if (!zero_copy_inputs[i])
+			{
+				if (!acquire_context_buffer(pContext, CL_MEM_READ_ONLY, shard_size[i], input_bufs[i]))
+					goto exit;
+
+				if (!upload_shard(pContext, i, input_bufs[i].m_buf, pBuffer + shard_ofs[i], shard_size[i]))
+					goto exit;
+			}
+
+			if ((!zero_copy_outputs[i]) && (!acquire_context_buffer(pContext, CL_MEM_WRITE_ONLY, shard_size[i], output_bufs[i])))
+				goto exit;
+		}
+
+		// Set the kernel arguments
+		{
+			cl_mem input_buf = zero_copy_inputs[i] ? zero_copy_inputs[i] : input_bufs[i].m_buf;
+			cl_mem output_buf = zero_copy_outputs[i] ? zero_copy_outputs[i] : output_bufs[i].m_buf;
+
+			const cl_ulong kernel_base_ofs = base_ofs;
+
+			if (!(in_place ? pEngine->m_ocl.set_kernel_args(kernel, output_buf, buffer_size, kernel_base_ofs) : pEngine->m_ocl.set_kernel_args(kernel, input_buf, output_buf, buffer_size, kernel_base_ofs)))
+				goto exit;
+		}
+
+		// Run the kernel, one work item per VEC_WIDTH bytes. The global work offset tells the kernel where this shard lives in the full buffer.
+		if (!pEngine->m_ocl.run_1D(command_queue, kernel, shard_ofs[i] / vec_width, (shard_size[i] + vec_width - 1) / vec_width))
+			goto exit;
+
+		// Retrieve the output. Staged downloads block, so they're done below, once every shard is queued.
+		if (zero_copy_outputs[i])
+		{
+			if (!pEngine->m_ocl.sync_host_ptr_buffer(command_queue, zero_copy_outputs[i], shard_size[i]))
+				goto exit;
+		}
+		else
+		{
+			staged_reads[i] = use_staging(pContext, device_index, pOutput_buffer + shard_ofs[i], shard_size[i]);
+			if ((!staged_reads[i]) && (!pEngine->m_ocl.read_from_buffer(command_queue, output_bufs[i].m_buf, pOutput_buffer + shard_ofs[i], shard_size[i], false)))
+				goto exit;
+		}
+
+		pEngine->m_ocl.submit(command_queue);
+	}
+
+	status = true;
+
+	// While the device(s) work, the host worker threads process the rest of the buffer. The calling thread is busy below with the staged downloads and the flush, 
+	// so there's one task per worker: one more would only get run by a worker after its first one, doubling the host time.
+	if (host_size)
+	{
+		num_host_tasks = host_size / OCL_COEXEC_MIN_HOST_TASK_SIZE;
+		if (num_host_tasks > pEngine->m_coexec_job_pool.get_num_threads())
+			num_host_tasks = pEngine->m_coexec_job_pool.get_num_threads();
+		if (!num_host_tasks)
+			num_host_tasks = 1;
+
+		host_task_end_times.resize(num_host_tasks);
+
+		host_task = [&](uint32_t task_index)
+		{
+			const uint32_t task_size = host_size / num_host_tasks;
+			const uint32_t task_ofs = device_size + task_index * task_size;
+			const uint32_t size = (task_index == num_host_tasks - 1) ? (buffer_size - task_ofs) : task_size;
+
+			g_kernels[kernel_id].m_pHost_func(pBuffer + task_ofs, pOutput_buffer + task_ofs, base_ofs + task_ofs, size);
+
+			host_task_end_times[task_index] = std::chrono::high_resolution_clock::now();
+		};
+
+		host_start_time = std::chrono::high_resolution_clock::now();
+
+		pEngine->m_coexec_job_pool.begin_parallel(host_batch, num_host_tasks, host_task);
+	}
+
+	// Each staged download overlaps copying one chunk out with the DMA of the next, while the later shards' devices keep working.
+	for (uint32_t i = 0; (i < num_shards) && (downloads_ok); i++)
+		if (staged_reads[i])
+			downloads_ok = pEngine->m_ocl.read_from_buffer_staged(pContext->m_command_queues[i], output_bufs[i].m_buf, 0, pOutput_buffer + shard_ofs[i], shard_size[i], pContext->m_staging);
+
+exit:
+	// Always wait for everything that was queued before releasing the buffers, even on failure, because the device may still be accessing the caller's memory.
+	for (uint32_t i = 0; i < num_shards; i++)
+		pEngine->m_ocl.flush(pContext->m_command_queues[i]);
+
+	device_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	if (host_size)
+	{
+		if (status)
+		{
+			// The calling thread picks up any host tasks the workers haven't started.
+			pEngine->m_coexec_job_pool.wait_parallel(host_batch);
+
+			for (uint32_t i = 0; i < host_task_end_times.size(); i++)
+				host_secs = std::max(host_secs, std::chrono::duration<double>(host_task_end_times[i] - host_start_time).count());
+		}
+	}
+
+	if (!downloads_ok)
+		status = false;
+
+	if ((status) && (pEngine->m_coexec_enabled))
+		coexec_update_split(pEngine, kernel_id, device_size, device_secs, host_size, host_secs);
+
+	for (uint32_t i = 0; i < num_shards; i++)
+	{
+		release_context_buffer(pContext, input_bufs[i]);
+		release_context_buffer(pContext, output_bufs[i]);
+
+		pEngine->m_ocl.destroy_buffer(zero_copy_inputs[i]);
+		pEngine->m_ocl.destroy_buffer(zero_copy_outputs[i]);
+	}
+
+	// Everything queued has finished, so the call's scratch buffers can all go at once.
+	if (pContext->m_pScratch_arena)
+		pContext->m_pScratch_arena->reset();
+
+	return status;
+}
+
+// Returns the process_buffer kernel for a buffer of kernel_buf_size bytes: the generic one, or the context's VEC_WIDTH variant.
+static cl_kernel get_process_buffer_kernel(opencl_context* pContext, uint32_t kernel_buf_size)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	cl_kernel kernel = get_context_kernel(pContext, OCL_KERNEL_PROCESS_BUFFER);
+	if (!kernel)
+		return nullptr;
+
+	const uint32_t vec_width = pEngine->m_vec_width;
+	if (vec_width > 1)
+	{
+		const uint32_t variant_index = ((kernel_buf_size % vec_width) == 0) ? 1 : 0;
+		opencl_context::context_kernel& v = pContext->m_process_buffer_variants[variant_index];
+
+		if ((!v.m_kernel) || (v.m_generation != pContext->m_kernels[OCL_KERNEL_PROCESS_BUFFER].m_generation))
+		{
+			pEngine->m_ocl.destroy_kernel(v.m_kernel);
+
+			char defines[64];
+			get_process_buffer_variant_defines(vec_width, variant_index, defines, sizeof(defines));
+
+			v.m_kernel = pEngine->m_ocl.create_kernel_variant(g_kernels[OCL_KERNEL_PROCESS_BUFFER].m_pName, defines, &v.m_generation);
+			if (!v.m_kernel)
+			{
+				ocl_error_printf("get_process_buffer_kernel: Failed creating OpenCL kernel variant \"%s\"\n", defines);
+				return nullptr;
+			}
+		}
+
+		kernel = v.m_kernel;
+	}
+
+	return kernel;
+}
+
+// Example thread-safe function to process a buffer and return some output.
+bool opencl_process_buffer(
+	opencl_context_ptr pContext,
+	const uint8_t* pBuffer,
+	uint8_t* pOutput_buffer,
+	uint32_t buffer_size)
+{
+	if (!pContext)
+		return false;
+
+	cl_kernel kernel = get_process_buffer_kernel(pContext, buffer_size);
+	if (!kernel)
+		return false;
+
+	return run_process_buffer(pContext, OCL_KERNEL_PROCESS_BUFFER, kernel, pContext->m_pEngine->m_vec_width, false, pBuffer, pOutput_buffer, buffer_size);
+}
+
+bool opencl_process_buffer_inplace(
+	opencl_context_ptr pContext,
+	uint8_t* pBuffer,
+	uint32_t buffer_size)
+{
+	if (!pContext)
+		return false;
+
+	cl_kernel kernel = get_context_kernel(pContext, OCL_KERNEL_PROCESS_BUFFER_INPLACE);
+	if (!kernel)
+		return false;
+
+	return run_process_buffer(pContext, OCL_KERNEL_PROCESS_BUFFER_INPLACE, kernel, 1, true, pBuffer, pBuffer, buffer_size);
+}
+
+
+// Grows one of the context's batch packing buffers to at least size bytes. Its contents are lost.
+static bool reserve_batch_buffer(opencl_context* pContext, ocl_pinned_buffer& pb, size_t size)
+{
+	if (pb.m_size >= size)
+		return true;
+
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	pEngine->m_ocl.free_pinned_buffer(pContext->m_command_queues[0], pb);
+
+	size_t new_size = OCL_MIN_BATCH_BUFFER_SIZE;
+	while (new_size < size)
+		new_size <<= 1;
+
+	return pEngine->m_ocl.alloc_pinned_buffer(pContext->m_command_queues[0], new_size, pb);
+}
+
+bool opencl_process_buffer_batch(
+	opencl_context_ptr pContext,
+	const opencl_batch_item* pItems,
+	uint32_t num_items)
+{
+	if (!pContext)
+		return false;
+
+	opencl_engine* pEngine = pContext->m_pEngine;
+	cl_command_queue command_queue = pContext->m_command_queues[0];
+
+	// Packed layout: the offset table, then the items back to back, starting on a 64 byte boundary.
+	const uint64_t data_ofs = ((uint64_t)(num_items + 1) * sizeof(uint32_t) + 63) & ~63ULL;
+
+	uint64_t total_size = 0;
+	for (uint32_t i = 0; i < num_items; i++)
+		total_size += pItems[i].m_size;
+
+	if (!total_size)
+		return true;
+
+	if (data_ofs + total_size > UINT32_MAX)
+	{
+		ocl_error_printf("opencl_process_buffer_batch: Batch too large\n");
+		return false;
+	}
+
+	cl_kernel kernel = get_context_kernel(pContext, OCL_KERNEL_PROCESS_BUFFER_BATCH);
+	if (!kernel)
+		return false;
+
+	const uint32_t packed_size = (uint32_t)(data_ofs + total_size);
+
+	if ((!reserve_batch_buffer(pContext, pContext->m_batch_input, packed_size)) || (!reserve_batch_buffer(pContext, pContext->m_batch_output, (size_t)total_size)))
+	{
+		ocl_error_printf("opencl_process_buffer_batch: Failed allocating packing buffers\n");
+		return false;
+	}
+
+	// Gather the items into pinned memory, which is DMA'd directly.
+	uint32_t* pOffsets = reinterpret_cast<uint32_t*>(pContext->m_batch_input.m_pPtr);
+	uint8_t* pPacked = pContext->m_batch_input.m_pPtr + data_ofs;
+
+	uint32_t ofs = 0;
+	for (uint32_t i = 0; i < num_items; i++)
+	{
+		pOffsets[i] = ofs;
+		memcpy(pPacked + ofs, pItems[i].m_pInput_buf, pItems[i].m_size);
+		ofs += pItems[i].m_size;
+	}
+	pOffsets[num_items] = ofs;
+
+	ocl_pooled_buffer input_buf, output_buf;
+	memset(&input_buf, 0, sizeof(input_buf));
+	memset(&output_buf, 0, sizeof(output_buf));
+
+	bool status = false;
+
+	if ((!acquire_context_buffer(pContext, CL_MEM_READ_ONLY, packed_size, input_buf)) || (!acquire_context_buffer(pContext, CL_MEM_WRITE_ONLY, (size_t)total_size, output_buf)))
+		goto exit;
+
+	if (!pEngine->m_ocl.write_to_buffer(command_queue, input_buf.m_buf, pContext->m_batch_input.m_pPtr, packed_size, false))
+		goto exit;
+
+	if (!pEngine->m_ocl.set_kernel_args(kernel, input_buf.m_buf, output_buf.m_buf, num_items, (uint32_t)data_ofs))
+		goto exit;
+
+	if (!pEngine->m_ocl.run_1D(command_queue, kernel, (size_t)total_size))
+		goto exit;
+
+	if (!pEngine->m_ocl.read_from_buffer(command_queue, output_buf.m_buf, pContext->m_batch_output.m_pPtr, (size_t)total_size, false))
+		goto exit;
+
+	status = true;
+
+exit:
+	pEngine->m_ocl.flush(command_queue);
+
+	release_context_buffer(pContext, input_buf);
+	release_context_buffer(pContext, output_buf);
+
+	if (pContext->m_pScratch_arena)
+		pContext->m_pScratch_arena->reset();
+
+	if (!status)
+		return false;
+
+	// Scatter the results back.
+	for (uint32_t i = 0; i < num_items; i++)
+		memcpy(pItems[i].m_pOutput_buf, pContext->m_batch_output.m_pPtr + pOffsets[i], pItems[i].m_size);
+
+	return true;
+}
+
+// Queues one chunk's upload, kernel and download on the context's three stream queues. Its buffer set was last used by the chunk OCL_STREAM_STAGES before,
+// whose kernel (reading input_buf) and download (reading output_buf) are kernel_event and download_event: the upload waits for that kernel and this kernel for that 
+// download, while everything else overlaps. Both events are replaced by this chunk's.
+static bool enqueue_stream_chunk(opencl_context* pContext, cl_mem input_buf, cl_mem output_buf, cl_event& kernel_event, cl_event& download_event,
+	const uint8_t* pSrc, uint8_t* pDst, uint32_t size, uint64_t base_ofs)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+	cl_command_queue* pQueues = pContext->m_stream_queues;
+	const uint32_t vec_width = pEngine->m_vec_width;
+
+	cl_event upload_event = nullptr, new_kernel_event = nullptr;
+	bool status = false;
+
+	cl_kernel kernel = get_process_buffer_kernel(pContext, size);
+	if (!kernel)
+		return false;
+
+	const cl_ulong kernel_base_ofs = base_ofs;
+
+	if (!pEngine->m_ocl.enqueue_write_buffer(pQueues[0], input_buf, 0, pSrc, size, kernel_event ? 1 : 0, &kernel_event, &upload_event))
+		goto exit;
+
+	if (!pEngine->m_ocl.set_kernel_args(kernel, input_buf, output_buf, size, kernel_base_ofs))
+		goto exit;
+
+	{
+		cl_event wait_events[2] = { upload_event, download_event };
+		if (!pEngine->m_ocl.enqueue_run_1D(pQueues[1], kernel, 0, (size + vec_width - 1) / vec_width, download_event ? 2 : 1, wait_events, &new_kernel_event))
+			goto exit;
+	}
+
+	pEngine->m_ocl.release_event(kernel_event);
+	kernel_event = new_kernel_event;
+	new_kernel_event = nullptr;
+
+	pEngine->m_ocl.release_event(download_event);
+	download_event = nullptr;
+
+	if (!pEngine->m_ocl.enqueue_read_buffer(pQueues[2], output_buf, 0, pDst, size, 1, &kernel_event, &download_event))
+		goto exit;
+
+	// Commands waiting on another queue's events only start once that queue is flushed.
+	for (uint32_t i = 0; i < OCL_STREAM_STAGES; i++)
+		pEngine->m_ocl.submit(pQueues[i]);
+
+	status = true;
+
+exit:
+	pEngine->m_ocl.release_event(upload_event);
+	pEngine->m_ocl.release_event(new_kernel_event);
+
+	return status;
+}
+
+bool opencl_process_buffer_stream(
+	opencl_context_ptr pContext,
+	const uint8_t* pBuffer,
+	uint8_t* pOutput_buffer,
+	uint64_t buffer_size,
+	uint32_t chunk_size,
+	uint64_t stream_ofs)
+{
+	if (!pContext)
+		return false;
+
+	if (!buffer_size)
+		return true;
+
+	opencl_engine* pEngine = pContext->m_pEngine;
+	const uint32_t device_index = pContext->m_device_indices[0];
+
+	// 4KB aligned chunks keep every chunk as aligned as the buffer, so zero copy applies to all of them.
+	if (!chunk_size)
+		chunk_size = OCL_STREAM_CHUNK_SIZE;
+	chunk_size = std::min<uint32_t>(chunk_size, OCL_MAX_CHUNK_SIZE);
+	chunk_size = std::max<uint32_t>(chunk_size & ~4095U, 4096U);
+
+	// In zero copy mode there are no transfers to overlap with the kernel, so the chunks just go through the usual path one after another. That path shards each chunk
+	// across all the context's devices (and the host, in co-execution mode), like opencl_process_buffer().
+	if ((use_zero_copy(pContext, device_index, pBuffer)) && (use_zero_copy(pContext, device_index, pOutput_buffer)))
+	{
+		for (uint64_t ofs = 0; ofs < buffer_size; ofs += chunk_size)
+		{
+			const uint32_t size = (uint32_t)std::min<uint64_t>(chunk_size, buffer_size - ofs);
+			cl_kernel kernel = get_process_buffer_kernel(pContext, size);
+			if ((!kernel) || (!run_process_buffer(pContext, OCL_KERNEL_PROCESS_BUFFER, kernel, pEngine->m_vec_width, false, pBuffer + ofs, pOutput_buffer + ofs, size, stream_ofs + ofs)))
+				return false;
+		}
+
+		return true;
+	}
+
+	for (uint32_t i = 0; i < OCL_STREAM_STAGES; i++)
+	{
+		if (!pContext->m_stream_queues[i])
+			pContext->m_stream_queues[i] = pEngine->m_ocl.create_command_queue(device_index);
+
+		if (!pContext->m_stream_queues[i])
+		{
+			ocl_error_printf("opencl_process_buffer_stream: Failed creating OpenCL command queue!\n");
+			return false;
+		}
+	}
+
+	ocl_pooled_buffer input_bufs[OCL_STREAM_STAGES], output_bufs[OCL_STREAM_STAGES];
+	memset(input_bufs, 0, sizeof(input_bufs));
+	memset(output_bufs, 0, sizeof(output_bufs));
+
+	// The last kernel and download of each buffer set.
+	cl_event kernel_events[OCL_STREAM_STAGES], download_events[OCL_STREAM_STAGES];
+	memset(kernel_events, 0, sizeof(kernel_events));
+	memset(download_events, 0, sizeof(download_events));
+
+	bool status = true;
+
+	const uint32_t buf_size = (uint32_t)std::min<uint64_t>(chunk_size, buffer_size);
+
+	uint64_t chunk = 0;
+	for (uint64_t ofs = 0; (ofs < buffer_size) && (status); ofs += chunk_size, chunk++)
+	{
+		const uint32_t set = (uint32_t)(chunk % OCL_STREAM_STAGES);
+		const uint32_t size = (uint32_t)std::min<uint64_t>(chunk_size, buffer_size - ofs);
+
+		if (!input_bufs[set].m_buf)
+		{
+			status = (acquire_context_buffer(pContext, CL_MEM_READ_ONLY, buf_size, input_bufs[set])) && (acquire_context_buffer(pContext, CL_MEM_WRITE_ONLY, buf_size, output_bufs[set]));
+			if (!status)
+				break;
+		}
+
+		// Keep the host at most OCL_STREAM_STAGES chunks ahead of the device. This chunk's upload can't start before that kernel finishes anyway.
+		status = pEngine->m_ocl.wait_for_event(kernel_events[set]) &&
+			enqueue_stream_chunk(pContext, input_bufs[set].m_buf, output_bufs[set].m_buf, kernel_events[set], download_events[set], pBuffer + ofs, pOutput_buffer + ofs, size, stream_ofs + ofs);
+	}
+
+	// Always wait for everything that was queued, even on failure, because the device may still be accessing the caller's memory.
+	for (uint32_t i = 0; i < OCL_STREAM_STAGES; i++)
+		pEngine->m_ocl.flush(pContext->m_stream_queues[i]);
+
+	for (uint32_t i = 0; i < OCL_STREAM_STAGES; i++)
+	{
+		pEngine->m_ocl.release_event(kernel_events[i]);
+		pEngine->m_ocl.release_event(download_events[i]);
+
+		release_context_buffer(pContext, input_bufs[i]);
+		release_context_buffer(pContext, output_bufs[i]);
+	}
+
+	if (pContext->m_pScratch_arena)
+		pContext->m_pScratch_arena->reset();
+
+	return status;
+}
+
+// One opencl_process_buffer_async() call. Owns its device buffers and the last event of each shard's command chain until opencl_release_request().
+struct opencl_request
+{
+	opencl_request() : 
+		m_pEngine(nullptr), 
+		m_pCallback(nullptr), m_pCallback_data(nullptr),
+		m_num_pending(1), m_failed(false), m_done(false)
+	{
+		memset(m_input_bufs, 0, sizeof(m_input_bufs));
+		memset(m_output_bufs, 0, sizeof(m_output_bufs));
+		memset(m_zero_copy_inputs, 0, sizeof(m_zero_copy_inputs));
+		memset(m_zero_copy_outputs, 0, sizeof(m_zero_copy_outputs));
+		memset(m_done_events, 0, sizeof(m_done_events));
+	}
+
+	opencl_engine* m_pEngine;
+
+	ocl_pooled_buffer m_input_bufs[OCL_MAX_DEVICES], m_output_bufs[OCL_MAX_DEVICES];
+	cl_mem m_zero_copy_inputs[OCL_MAX_DEVICES], m_zero_copy_outputs[OCL_MAX_DEVICES];
+	cl_event m_done_events[OCL_MAX_DEVICES];
+
+	opencl_request_callback m_pCallback;
+	void* m_pCallback_data;
+
+	// Shards whose last event hasn't called back yet, plus 1 while opencl_process_buffer_async() is still queuing. The request completes when it drops to 0.
+	std::atomic<uint32_t> m_num_pending;
+	std::atomic<bool> m_failed;
+
+	std::mutex m_mutex;
+	std::condition_variable m_done_cv;
+	bool m_done;
+
+private:
+	opencl_request(const opencl_request&);
+	opencl_request& operator= (const opencl_request&);
+};
+
+// The request is only marked done after its callback returns, so the callback never races with opencl_release_request().
+static void finish_request_part(opencl_request* pRequest)
+{
+	if (pRequest->m_num_pending.fetch_sub(1) != 1)
+		return;
+
+	if (pRequest->m_pCallback)
+		pRequest->m_pCallback(pRequest, !pRequest->m_failed.load(), pRequest->m_pCallback_data);
+
+	std::lock_guard<std::mutex> lock(pRequest->m_mutex);
+	pRequest->m_done = true;
+	pRequest->m_done_cv.notify_all();
+}
+
+// Runs on an OpenCL runtime thread.
+static void CL_CALLBACK request_event_callback(cl_event event, cl_int status, void* pData)
+{
+	(void)event;
+
+	opencl_request* pRequest = static_cast<opencl_request*>(pData);
+	if (status < 0)
+		pRequest->m_failed = true;
+
+	finish_request_part(pRequest);
+}
+
+// Queues one shard as a chain of non-blocking commands: upload, kernel (waiting on the upload's event), then download or host sync (waiting on the kernel's event).
+static bool enqueue_request_shard(opencl_context* pContext, opencl_request* pRequest, uint32_t i, cl_kernel kernel, uint32_t vec_width,
+	const uint8_t* pInput_buffer, uint8_t* pOutput_buffer, uint32_t shard_ofs, uint32_t shard_size, uint32_t buffer_size)
+{
+	opencl_engine* pEngine = pContext->m_pEngine;
+	cl_command_queue command_queue = pContext->m_command_queues[i];
+	const uint32_t device_index = pContext->m_device_indices[i];
+
+	cl_event upload_event = nullptr, kernel_event = nullptr;
+	bool status = false;
+
+	if (use_zero_copy(pContext, device_index, pInput_buffer))
+		pRequest->m_zero_copy_inputs[i] = pEngine->m_ocl.alloc_host_ptr_buffer(CL_MEM_READ_ONLY, const_cast<uint8_t*>(pInput_buffer), shard_size, false);
+	if (use_zero_copy(pContext, device_index, pOutput_buffer))
+		pRequest->m_zero_copy_outputs[i] = pEngine->m_ocl.alloc_host_ptr_buffer(CL_MEM_WRITE_ONLY, pOutput_buffer, shard_size, false);
+
+	// The buffers come straight from the engine's buffer pool, since the request may be released after its context is gone.
+	if (!pRequest->m_zero_copy_inputs[i])
+	{
+		if (!pEngine->m_ocl.acquire_pooled_buffer(CL_MEM_READ_ONLY, shard_size, pRequest->m_input_bufs[i]))
+			goto exit;
+
+		if (!pEngine->m_ocl.enqueue_write_buffer(command_queue, pRequest->m_input_bufs[i].m_buf, 0, pInput_buffer, shard_size, 0, nullptr, &upload_event))
+			goto exit;
+	}
+
+	if ((!pRequest->m_zero_copy_outputs[i]) && (!pEngine->m_ocl.acquire_pooled_buffer(CL_MEM_WRITE_ONLY, shard_size, pRequest->m_output_bufs[i])))
+		goto exit;
+
+	{
+		cl_mem input_buf = pRequest->m_zero_copy_inputs[i] ? pRequest->m_zero_copy_inputs[i] : pRequest->m_input_bufs[i].m_buf;
+		cl_mem output_buf = pRequest->m_zero_copy_outputs[i] ? pRequest->m_zero_copy_outputs[i] : pRequest->m_output_bufs[i].m_buf;
+
+		if (!pEngine->m_ocl.set_kernel_args(kernel, input_buf, output_buf, buffer_size, (cl_ulong)0))
+			goto exit;
+	}
+
+	if (!pEngine->m_ocl.enqueue_run_1D(command_queue, kernel, shard_ofs / vec_width, (shard_size + vec_width - 1) / vec_width, upload_event ? 1 : 0, &upload_event, &kernel_event))
+		goto exit;
+
+	if (pRequest->m_zero_copy_outputs[i])
+	{
+		if (!pEngine->m_ocl.enqueue_sync_host_ptr_buffer(command_queue, pRequest->m_zero_copy_outputs[i], shard_size, 1, &kernel_event, &pRequest->m_done_events[i]))
+			goto exit;
+	}
+	else if (!pEngine->m_ocl.enqueue_read_buffer(command_queue, pRequest->m_output_bufs[i].m_buf, 0, pOutput_buffer, shard_size, 1, &kernel_event, &pRequest->m_done_events[i]))
+		goto exit;
+
+	// The callback may run before set_event_callback() even returns.
+	pRequest->m_num_pending++;
+	if (!pEngine->m_ocl.set_event_callback(pRequest->m_done_events[i], request_event_callback, pRequest))
+	{
+		pRequest->m_num_pending--;
+		goto exit;
+	}
+
+	status = true;
+
+exit:
+	// Commands keep the events they wait on alive, so these can go now.
+	pEngine->m_ocl.release_event(upload_event);
+	pEngine->m_ocl.release_event(kernel_event);
+
+	return status;
+}
+
+opencl_request_ptr opencl_process_buffer_async(
+	opencl_context_ptr pContext,
+	const uint8_t* pBuffer,
+	uint8_t* pOutput_buffer,
+	uint32_t buffer_size,
+	opencl_request_callback pCallback,
+	void* pCallback_data)
+{
+	if (!pContext)
+		return nullptr;
+
+	opencl_engine* pEngine = pContext->m_pEngine;
+
+	cl_kernel kernel = get_process_buffer_kernel(pContext, buffer_size);
+	if (!kernel)
+		return nullptr;
+
+	opencl_request* pRequest = new opencl_request;
+	pRequest->m_pEngine = pEngine;
+
+	uint32_t shard_ofs[OCL_MAX_DEVICES], shard_size[OCL_MAX_DEVICES];
+	const uint32_t num_shards = compute_shards(pContext, buffer_size, shard_ofs, shard_size);
+
+	bool status = true;
+	for (uint32_t i = 0; (i < num_shards) && (status); i++)
+	{
+		if (shard_size[i])
+			status = enqueue_request_shard(pContext, pRequest, i, kernel, pEngine->m_vec_width, pBuffer + shard_ofs[i], pOutput_buffer + shard_ofs[i], shard_ofs[i], shard_size[i], buffer_size);
+	}
+
+	for (uint32_t i = 0; i < num_shards; i++)
+		pEngine->m_ocl.submit(pContext->m_command_queues[i]);
+
+	if (!status)
+	{
+		// The callback was never set, so it isn't called. Whatever did get queued (including partial chains, which have no callback) has to finish before 
+		// its buffers can be released.
+		for (uint32_t i = 0; i < num_shards; i++)
+			pEngine->m_ocl.flush(pContext->m_command_queues[i]);
+
+		finish_request_part(pRequest);
+		opencl_release_request(pRequest);
+		return nullptr;
+	}
+
+	// Nothing can complete the request before the queuing part is finished, so the callback can't be missed. If every shard already finished, 
+	// this call completes the request and runs the callback right here, on the caller's thread.
+	pRequest->m_pCallback = pCallback;
+	pRequest->m_pCallback_data = pCallback_data;
+	finish_request_part(pRequest);
+
+	return pRequest;
+}
+
+opencl_request_status opencl_poll_request(opencl_request_ptr pRequest)
+{
+	if (!pRequest)
+		return cOpenCLRequestFailed;
+
+	std::lock_guard<std::mutex> lock(pRequest->m_mutex);
+	if (!pRequest->m_done)
+		return cOpenCLRequestPending;
+
+	return pRequest->m_failed ? cOpenCLRequestFailed : cOpenCLRequestSucceeded;
+}
+
+bool opencl_wait_request(opencl_request_ptr pRequest)
+{
+	if (!pRequest)
+		return false;
+
+	std::unique_lock<std::mutex> lock(pRequest->m_mutex);
+	pRequest->m_done_cv.wait(lock, [pRequest] { return pRequest->m_done; });
+
+	return !pRequest->m_failed;
+}
+
+void opencl_release_request(opencl_request_ptr pRequest)
+{
+	if (!pRequest)
+		return;
+
+	// The device may still be accessing the caller's memory, and the callbacks the request.
+	opencl_wait_request(pRequest);
+
+	opencl_engine* pEngine = pRequest->m_pEngine;
+
+	for (uint32_t i = 0; i < OCL_MAX_DEVICES; i++)
+	{
+		pEngine->m_ocl.release_pooled_buffer(pRequest->m_input_bufs[i]);
+		pEngine->m_ocl.release_pooled_buffer(pRequest->m_output_bufs[i]);
+
+		pEngine->m_ocl.destroy_buffer(pRequest->m_zero_copy_inputs[i]);
+		pEngine->m_ocl.destroy_buffer(pRequest->m_zero_copy_outputs[i]);
+
+		pEngine->m_ocl.release_event(pRequest->m_done_events[i]);
+	}
+
+	delete pRequest;
+}
+
+bool opencl_process_file(
+	opencl_context_ptr pContext,
+	const char* pInput_filename,
+	const char* pOutput_filename,
+	size_t window_size)
+{
+	if ((!pContext) || (!pInput_filename) || (!pOutput_filename))
+		return false;
+
+	ocl_mapped_file input_file, output_file;
+
+	if (!input_file.open_read(pInput_filename))
+	{
+		ocl_error_printf("opencl_process_file: Failed opening input file \"%s\"\n", pInput_filename);
+		return false;
+	}
+
+	const uint64_t file_size = input_file.get_size();
+
+	if (!output_file.create(pOutput_filename, file_size))
+	{
+		ocl_error_printf("opencl_process_file: Failed creating output file \"%s\"\n", pOutput_filename);
+		return false;
+	}
+
+	// Windows start on mapping granularity boundaries, which are also 4KB shard boundaries and multiples of any VEC_WIDTH.
+	const size_t granularity = std::max<size_t>(ocl_mapped_file::get_granularity(), 4096);
+
+	if (!window_size)
+		window_size = OCL_FILE_WINDOW_SIZE;
+	window_size = std::min<size_t>(window_size, OCL_MAX_CHUNK_SIZE);
+	window_size = std::max<size_t>((window_size / granularity) * granularity, granularity);
+
+	auto get_window_size = [&](uint64_t ofs) { return (size_t)std::min<uint64_t>(window_size, file_size - ofs); };
+
+	bool status = true;
+
+	uint8_t* pInput_window = nullptr;
+	if (file_size)
+	{
+		pInput_window = input_file.map_window(0, get_window_size(0));
+		ocl_mapped_file::prefetch_window(pInput_window, get_window_size(0));
+	}
+
+	for (uint64_t ofs = 0; ofs < file_size; ofs += window_size)
+	{
+		const size_t size = get_window_size(ofs);
+
+		// Map the next input window and have the OS read it in while this one is processed, so file reads overlap the transfers and kernel.
+		const uint64_t next_ofs = ofs + size;
+		uint8_t* pNext_input_window = nullptr;
+		if (next_ofs < file_size)
+		{
+			pNext_input_window = input_file.map_window(next_ofs, get_window_size(next_ofs));
+			ocl_mapped_file::prefetch_window(pNext_input_window, get_window_size(next_ofs));
+		}
+
+		uint8_t* pOutput_window = output_file.map_window(ofs, size);
+
+		if ((!pInput_window) || (!pOutput_window))
+		{
+			ocl_error_printf("opencl_process_file: Failed mapping the window at offset %llu\n", (unsigned long long)ofs);
+			status = false;
+		}
+		else
+		{
+			cl_kernel kernel = get_process_buffer_kernel(pContext, (uint32_t)size);
+
+			status = (kernel != nullptr) &&
+				run_process_buffer(pContext, OCL_KERNEL_PROCESS_BUFFER, kernel, pContext->m_pEngine->m_vec_width, false, pInput_window, pOutput_window, (uint32_t)size, ofs);
+		}
+
+		// Unmapping drops the windows' pages from the process, and the OS writes the output back in the background.
+		ocl_mapped_file::unmap_window(pInput_window, size);
+		ocl_mapped_file::unmap_window(pOutput_window, size);
+
+		pInput_window = pNext_input_window;
+
+		if (!status)
+		{
+			ocl_mapped_file::unmap_window(pNext_input_window, get_window_size(next_ofs));
+			break;
+		}
+	}
 
 	return status;
 }
@@ -3,18 +3,303 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-bool opencl_init(bool force_serialization);
+enum opencl_cpu_partition
+{
+	cOpenCLCPUPartitionNone,
+	cOpenCLCPUPartitionNUMA,		// One sub-device per NUMA node
+	cOpenCLCPUPartitionL3Cache		// One sub-device per L3 cache
+};
+
+typedef void (*opencl_build_callback)(bool success, void *pUser_data);
+
+// One kernel source module. Header modules aren't compiled on their own, the other modules can #include them by m_pName.
+struct opencl_kernel_module
+{
+	const char *m_pName;
+	const char *m_pSource;
+	size_t m_source_size;		// 0 if m_pSource is zero terminated
+	bool m_is_header;
+};
+
+struct opencl_init_params
+{
+	bool m_force_serialization = false;
+
+	// nullptr (pick the highest scoring device on any platform), a device index in the device table printed at init, or a case insensitive substring of the device or platform name.
+	const char *m_pDevice_override = nullptr;
+
+	// If not nullptr, program binaries are cached in this directory (created if needed), keyed by the kernel source, build options, and device/driver/platform versions.
+	// Later runs load the binary instead of compiling. Missing, corrupt or stale entries silently fall back to compiling from source.
+	const char *m_pBinary_cache_dir = nullptr;
+
+	// Multi-device mode: if > 1, up to this many devices from the selected device's platform share one context, and opencl_process_buffer() splits large buffers into shards across them.
+	uint32_t m_max_devices = 1;
+
+	// If >= 2 and the selected device is a CPU, it's partitioned into this many equal sub-devices which are then used in multi-device mode. Handy for testing sharding without a GPU.
+	uint32_t m_cpu_sub_devices = 0;
+
+	// If the selected device is a CPU, partition it into one sub-device per NUMA node or L3 cache. Each opencl_context then gets a single command queue on the sub-device
+	// local to the thread that created it (so worker threads should be pinned to a node), and opencl_alloc_host_buffer() allocates on that node. Overrides m_cpu_sub_devices.
+	opencl_cpu_partition m_cpu_partition = cOpenCLCPUPartitionNone;
+
+	// Co-execution mode: opencl_process_buffer() processes part of each buffer with the kernel's host implementation on a pool of worker threads, while the device(s) process the rest.
+	// The split adapts to the measured device/host throughput of recent calls, so both sides finish at about the same time.
+	bool m_coexec = false;
+
+	// Number of host worker threads in co-execution mode. 0 = number of cores - 2. Co-execution is disabled if that leaves no workers.
+	uint32_t m_coexec_host_threads = 0;
+
+	// Async build mode: opencl_init() returns once the device and context are set up, and the program is built on a background thread.
+	// opencl_create_context() doesn't wait for the build; a context's kernels are created on its first dispatch, which waits only if the build is still running.
+	bool m_async_build = false;
+
+	// Optional kernel source for this engine, so engines can use different kernel sets. If m_kernel_source_size is 0 the source must be zero terminated.
+	// Otherwise, if m_pKernel_filename isn't nullptr the source is read from that file, else the built in kernels are used (src/ocl_kernels.h, or ocl_kernels.cl if OCL_USE_KERNELS_HEADER is 0).
+	const char *m_pKernel_source = nullptr;
+	size_t m_kernel_source_size = 0;
+	const char *m_pKernel_filename = nullptr;
+
+	// Optional kernel library made of several modules, which overrides the above. Each module is compiled separately (clCompileProgram) and the results are linked (clLinkProgram).
+	// Compiled modules are cached in memory, so opencl_rebuild_program() only recompiles the modules which changed (or all of them, if a header changed).
+	const opencl_kernel_module *m_pKernel_modules = nullptr;
+	uint32_t m_num_kernel_modules = 0;
+
+	// Development mode hot reload (requires the kernel source to be read from a file): a background thread polls the kernel source file every m_watch_interval_ms (0 = 500ms).
+	// When it changes, the program is rebuilt in the background and atomically swapped in. Each context recreates its kernels on its next dispatch; command queues are kept.
+	bool m_watch_kernel_source = false;
+	uint32_t m_watch_interval_ms = 0;
+
+	// If > 1, opencl_process_buffer() uses variants of the kernel compiled with -DVEC_WIDTH=m_vec_width (plus -DBUF_SIZE_MULTIPLE when the buffer size is a multiple of it),
+	// so each work item processes m_vec_width bytes with a constant folded, unrolled loop. Must be a power of 2 <= 64. The variants are all compiled in parallel right after the program.
+	uint32_t m_vec_width = 1;
+
+	// Device buffer pool: opencl_process_buffer() rounds its buffers up to power of 2 size classes from m_buffer_pool_min_size to m_buffer_pool_max_size and reuses them across calls.
+	// Larger buffers are created and released on every call, as are all buffers if m_buffer_pool_max_size is 0. Free buffers beyond m_buffer_pool_max_free_bytes (0 = no limit) are released.
+	size_t m_buffer_pool_min_size = 4096;
+	size_t m_buffer_pool_max_size = 256 * 1024 * 1024;
+	uint64_t m_buffer_pool_max_free_bytes = 512ULL * 1024 * 1024;
+
+	// Each context also keeps up to this many bytes of idle buffers for itself, reused without locking the shared pool (0 = none). These don't count towards 
+	// m_buffer_pool_max_free_bytes and opencl_trim_buffer_pool() doesn't release them, so with many contexts keep this small.
+	uint64_t m_context_buffer_max_bytes = 32ULL * 1024 * 1024;
+
+	// On devices without host unified memory (discrete GPUs), opencl_process_buffer() copies pageable caller memory through a pinned (CL_MEM_ALLOC_HOST_PTR) staging buffer
+	// of this size per context, in chunks of half its size so the host copies and the DMA transfers overlap. 0 disables staging. Memory from opencl_alloc_pinned_buffer() is never staged.
+	size_t m_staging_buffer_size = 4 * 1024 * 1024;
+
+	// Zero copy mode: on devices with host unified memory (CPUs, integrated GPUs), opencl_process_buffer() wraps the caller's buffers with CL_MEM_USE_HOST_PTR, so the kernel
+	// reads and writes them in place with no copies at all. Only used for buffers aligned to the device's CL_DEVICE_MEM_BASE_ADDR_ALIGN, or to m_zero_copy_alignment if that's larger
+	// (some runtimes only avoid copying page aligned memory, so 4096 can be worth it). Other buffers are copied as usual. opencl_alloc_host_buffer() memory is always page aligned.
+	bool m_zero_copy = true;
+	uint32_t m_zero_copy_alignment = 0;
+
+	// If not 0, each context carves the device buffers of small shards (up to a quarter of this size) out of slabs of this size with clCreateSubBuffer(), 
+	// bump allocated and released all at once at the end of each call, instead of taking them from the buffer pool. Sizes are rounded to CL_DEVICE_MEM_BASE_ADDR_ALIGN.
+	// A context's slabs are only freed when it's destroyed: they count against m_mem_budget, but the budget can't evict them like free pooled buffers.
+	size_t m_scratch_arena_size = 0;
+
+	// Device memory budget for everything the engine allocates. When an allocation would exceed it, the least recently used free buffers of the buffer pool are released first,
+	// and the allocation fails if that isn't enough. 0 = 90% of the smallest device's CL_DEVICE_GLOBAL_MEM_SIZE, UINT64_MAX = no limit.
+	// Only the shared free list is evictable. Buffers cached by other contexts (up to m_context_buffer_max_bytes each), scratch arena slabs, staging and 
+	// pinned buffers still count against the budget but are never evicted, so leave headroom for them.
+	uint64_t m_mem_budget = 0;
+
+	// Optional, called when the program build finishes (from the build thread in async build mode).
+	opencl_build_callback m_pBuild_callback = nullptr;
+	void *m_pBuild_callback_data = nullptr;
+};
+
+// Timings of each opencl_init() phase, in seconds.
+struct opencl_init_timings
+{
+	double m_device_select_secs;		// Enumerating/scoring platforms and devices, creating sub-devices
+	double m_context_create_secs;		// Creating the OpenCL context and default queue
+	double m_kernel_source_load_secs;
+	double m_init_secs;					// Total time opencl_init() blocked the caller
+	double m_program_build_secs;		// Program build time, 0 until the build finishes
+	double m_program_ready_secs;		// From the start of opencl_init() until the program was ready, 0 until the build finishes
+	double m_variant_build_secs;		// Wall time of the parallel kernel variant prebuild after the program build (only if m_vec_width > 1)
+};
+
+// An engine owns its own OpenCL device(s), context, program, serialization mutex and co-execution thread pool. 
+// Several engines (on different devices, or with different kernel sets) can be used side by side in one process without sharing any state.
+struct opencl_engine;
+typedef opencl_engine* opencl_engine_ptr;
+
+opencl_engine_ptr opencl_create_engine(const opencl_init_params &params);
+
+// All of the engine's contexts must be destroyed first.
+void opencl_destroy_engine(opencl_engine_ptr engine);
+
+bool opencl_is_available(opencl_engine_ptr engine);
+
+// Builds a new program from the given modules, reusing the engine's compiled modules whose source didn't change, and atomically swaps it in.
+// Each context recreates its kernels on its next dispatch. On failure the current program stays.
+bool opencl_rebuild_program(opencl_engine_ptr engine, const opencl_kernel_module *pModules, uint32_t num_modules);
+bool opencl_get_init_timings(opencl_engine_ptr engine, opencl_init_timings &timings);
+const char *opencl_get_device_caps_json(opencl_engine_ptr engine);
+
+// The functions below without an engine parameter use a default engine, created by opencl_init() and destroyed by opencl_deinit().
+bool opencl_init(const opencl_init_params &params);
+bool opencl_init(bool force_serialization, const char *pDevice_override = nullptr);
 void opencl_deinit();
 bool opencl_is_available();
 
+bool opencl_get_init_timings(opencl_init_timings &timings);
+
+// Returns a JSON array describing the limits/capabilities of each device in the context (queried once at init), or "" if OpenCL isn't initialized.
+const char *opencl_get_device_caps_json();
+
 struct opencl_context;
 
-// Each thread calling OpenCL should have its own opencl_context_ptr. This corresponds to a OpenCL command queue. (Confusingly, we only use a single OpenCL device "context".)
+// Each thread calling OpenCL should have its own opencl_context_ptr, which belongs to the engine it was created from. This corresponds to a OpenCL command queue. (Confusingly, we only use a single OpenCL device "context".)
 typedef opencl_context* opencl_context_ptr;
 
+opencl_context_ptr opencl_create_context(opencl_engine_ptr engine);
 opencl_context_ptr opencl_create_context();
 void opencl_destroy_context(opencl_context_ptr context);
 
-// Example thread-safe processing function.
+// Allocates page aligned host memory on the context's NUMA node (the node of the thread that created the context). Free with opencl_free_host_buffer().
+void *opencl_alloc_host_buffer(opencl_context_ptr context, size_t size);
+void opencl_free_host_buffer(opencl_context_ptr context, void *p, size_t size);
+
+// Allocates pinned (page locked) host memory, mapped for its lifetime, which opencl_process_buffer() transfers from/to directly at full bus speed.
+// Callers that can produce their input (or consume their output) in place should use it on discrete GPUs. At most 16 per context. opencl_destroy_context() frees any that are left.
+void *opencl_alloc_pinned_buffer(opencl_context_ptr context, size_t size);
+void opencl_free_pinned_buffer(opencl_context_ptr context, void *p);
+
+struct opencl_coexec_stats
+{
+	float m_device_fraction;			// Current fraction of each buffer given to the device(s)
+	double m_device_bytes_per_sec;	// Moving average of the measured throughputs
+	double m_host_bytes_per_sec;
+	uint64_t m_total_calls;
+};
+
+// Returns false if co-execution mode isn't enabled.
+bool opencl_get_coexec_stats(opencl_engine_ptr engine, opencl_coexec_stats &stats);
+bool opencl_get_coexec_stats(opencl_coexec_stats &stats);
+
+// Contexts take their kernels from a per-engine pool (created in bulk with clCreateKernelsInProgram()) and return them when destroyed.
+struct opencl_kernel_pool_stats
+{
+	uint32_t m_total_kernels;			// Kernels created by the pool, free or in use
+	uint32_t m_kernels_in_use;
+	uint32_t m_peak_kernels_in_use;		// Most kernels in use at once, of all kernel functions together
+	uint64_t m_total_acquires;
+	uint64_t m_total_bulk_creates;
+};
+
+bool opencl_get_kernel_pool_stats(opencl_engine_ptr engine, opencl_kernel_pool_stats &stats);
+bool opencl_get_kernel_pool_stats(opencl_kernel_pool_stats &stats);
+
+// Each context keeps a few device buffers for itself between calls, and returns the rest (and all of them when destroyed) to the engine's shared buffer pool.
+struct opencl_buffer_pool_stats
+{
+	uint64_t m_total_bytes;				// Device memory of pooled buffers: free, cached by contexts, or in use
+	uint64_t m_peak_total_bytes;		// High water mark of m_total_bytes
+	uint64_t m_free_bytes;				// In the engine's shared free list
+	uint64_t m_context_cached_bytes;	// Idle buffers kept by contexts (see opencl_init_params::m_context_buffer_max_bytes), not included in m_free_bytes
+	uint32_t m_total_buffers;
+	uint32_t m_free_buffers;
+	uint64_t m_total_acquires;
+	uint64_t m_total_hits;				// Acquires served without clCreateBuffer()
+	uint64_t m_total_trimmed_bytes;
+	float m_hit_rate;					// m_total_hits / m_total_acquires
+};
+
+bool opencl_get_buffer_pool_stats(opencl_engine_ptr engine, opencl_buffer_pool_stats &stats);
+bool opencl_get_buffer_pool_stats(opencl_buffer_pool_stats &stats);
+
+// Releases free buffers of the engine's shared free list, largest first, until at most max_free_bytes remain. Buffers cached by contexts are kept (they are bounded by opencl_init_params::m_context_buffer_max_bytes per context). Returns the number of bytes released.
+uint64_t opencl_trim_buffer_pool(opencl_engine_ptr engine, uint64_t max_free_bytes);
+uint64_t opencl_trim_buffer_pool(uint64_t max_free_bytes = 0);
+
+// Device memory tracked against the engine's budget. Host memory backed buffers (zero copy, staging, pinned) and sub-buffers are counted, but use none of the budget.
+struct opencl_mem_stats
+{
+	uint64_t m_budget;
+	uint64_t m_allocated_bytes;			// Includes free buffers of the buffer pool
+	uint64_t m_peak_allocated_bytes;
+	uint32_t m_num_buffers;
+	uint32_t m_num_images;
+	uint32_t m_num_sub_buffers;
+	uint64_t m_total_evictions;			// Free pool buffers released to stay within the budget
+	uint64_t m_total_evicted_bytes;
+	uint64_t m_total_failed_allocs;
+	uint64_t m_total_budget_misses;		// Allocations refused by the budget, included in m_total_failed_allocs. Calls retry once after giving their cached buffers back.
+};
+
+bool opencl_get_mem_stats(opencl_engine_ptr engine, opencl_mem_stats &stats);
+bool opencl_get_mem_stats(opencl_mem_stats &stats);
+
+// Changes the engine's memory budget. Lowering it below what's allocated releases free pool buffers until the allocations fit, or none are left.
+bool opencl_set_mem_budget(opencl_engine_ptr engine, uint64_t budget);
+bool opencl_set_mem_budget(uint64_t budget);
+
+// Example thread-safe processing function. In multi-device mode, large buffers are split into shards which are processed concurrently on all devices.
 bool opencl_process_buffer(opencl_context_ptr context, const uint8_t *pInput_buf, uint8_t *pOutput_buf, uint32_t buf_size);
 
+// Same result as opencl_process_buffer(context, pBuf, pBuf, buf_size), but each shard uses a single CL_MEM_READ_WRITE device buffer which is uploaded, transformed in place 
+// and read back into pBuf. Needs half the device memory, so buffers up to twice as large fit. Always uses the generic kernel (no m_vec_width variants).
+bool opencl_process_buffer_inplace(opencl_context_ptr context, uint8_t *pBuf, uint32_t buf_size);
+
+// One buffer of an opencl_process_buffer_batch() call. m_pOutput_buf may be m_pInput_buf.
+struct opencl_batch_item
+{
+	const uint8_t *m_pInput_buf;
+	uint8_t *m_pOutput_buf;
+	uint32_t m_size;
+};
+
+// Processes many small buffers, each with the same result as opencl_process_buffer(), in one round trip: the items are packed back to back behind an offset table 
+// into a pinned buffer, uploaded at once, processed by a single launch of the process_buffer_batch kernel (which looks up each byte's item in the table), 
+// downloaded at once, and scattered back. The per-call overhead is paid once per batch instead of once per buffer. The items plus table must fit in 4GB.
+// Uses the primary device only.
+bool opencl_process_buffer_batch(opencl_context_ptr context, const opencl_batch_item *pItems, uint32_t num_items);
+
+// Same result as opencl_process_buffer() for buffers of any (64-bit) size, even larger than device memory. The buffer is split into chunks of chunk_size bytes 
+// (0 = 8MB, rounded down to a multiple of 4KB) which rotate through three device buffer sets, on separate upload, kernel and download queues of the primary device: 
+// while chunk N+1 is uploaded, the kernel processes chunk N and chunk N-1 is downloaded, so throughput approaches that of the slowest of the three.
+// Uses six chunk sized device buffers. On zero copy devices the chunks instead go through opencl_process_buffer()'s path one after another, which processes them in place
+// and shards them across all the context's devices (and the host, in co-execution mode). stream_ofs is the offset of pInput_buf in a larger logical buffer, so a huge buffer
+// can be processed in several calls, e.g. as it arrives, with the same result as a single call. The kernel gets each chunk's full 64-bit offset, so results past 4GB are exact.
+bool opencl_process_buffer_stream(opencl_context_ptr context, const uint8_t *pInput_buf, uint8_t *pOutput_buf, uint64_t buf_size, uint32_t chunk_size = 0, uint64_t stream_ofs = 0);
+
+// Asynchronous version of opencl_process_buffer(): queues each shard's upload, kernel and download as non-blocking commands chained by events, and returns a request 
+// handle without waiting, so one thread can keep many requests in flight. Host buffer lifetime: pInput_buf must stay unmodified, and pOutput_buf mustn't be read or 
+// freed, until the request completes, i.e. opencl_poll_request() returns something other than cOpenCLRequestPending, opencl_wait_request() returns, or pCallback is called.
+// Always uses the devices only (no co-execution, staging or scratch arena). Memory from opencl_alloc_pinned_buffer() is transferred with truly asynchronous DMA, while 
+// drivers may copy pageable memory at enqueue time. Returns nullptr if the request couldn't be queued, in which case pCallback is never called.
+typedef struct opencl_request* opencl_request_ptr;
+
+enum opencl_request_status
+{
+	cOpenCLRequestPending,
+	cOpenCLRequestSucceeded,
+	cOpenCLRequestFailed
+};
+
+// Called exactly once when the request completes, usually on an OpenCL runtime thread. If the request finishes before opencl_process_buffer_async() returns, 
+// it's called inline on the calling thread instead, so it must not take locks the caller may hold across that call. It must return quickly and not call OpenCL 
+// functions or wait on requests: typically it signals another thread or queues follow-up work.
+typedef void (*opencl_request_callback)(opencl_request_ptr request, bool success, void *pUser_data);
+
+opencl_request_ptr opencl_process_buffer_async(opencl_context_ptr context, const uint8_t *pInput_buf, uint8_t *pOutput_buf, uint32_t buf_size, 
+	opencl_request_callback pCallback = nullptr, void *pCallback_data = nullptr);
+
+opencl_request_status opencl_poll_request(opencl_request_ptr request);
+
+// Blocks until the request completes. Returns true if it succeeded.
+bool opencl_wait_request(opencl_request_ptr request);
+
+// Every request must be released, from any thread. Waits for the request first if it's still in flight, so its host buffers can be freed as soon as this returns.
+// Requests may outlive their context (opencl_destroy_context() waits for them to complete), but not their engine.
+void opencl_release_request(opencl_request_ptr request);
+
+// Processes a whole file like opencl_process_buffer() would if it were one buffer, into an output file of the same size (created or truncated), without reading either into memory.
+// The files are memory mapped window_size bytes at a time (0 = 16MB, rounded to the OS's mapping granularity), and each window goes through the usual path: pinned staging 
+// on discrete GPUs, zero copy on unified memory devices. While one window is processed the OS reads ahead the next, so file I/O overlaps compute, and peak RSS stays at a 
+// few windows regardless of file size. Files larger than 4GB are fine: the kernel gets each window's full 64-bit file offset.
+bool opencl_process_file(opencl_context_ptr context, const char *pInput_filename, const char *pOutput_filename, size_t window_size = 0);
+
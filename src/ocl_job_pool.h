@@ -0,0 +1,160 @@
+// ocl_job_pool.h
+// Minimal fixed size thread pool used to run host (CPU) work alongside OpenCL devices.
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// One call's worth of tasks. Lives on the caller's stack between begin_parallel() and wait_parallel().
+struct ocl_job_batch
+{
+	const std::function<void(uint32_t)>* m_pFunc = nullptr;
+	uint32_t m_num_tasks = 0;
+	uint32_t m_next_task = 0;
+	uint32_t m_num_done = 0;
+};
+
+class ocl_job_pool
+{
+public:
+	ocl_job_pool() { }
+	~ocl_job_pool() { deinit(); }
+
+	bool init(uint32_t num_threads)
+	{
+		deinit();
+
+		m_kill = false;
+
+		for (uint32_t i = 0; i < num_threads; i++)
+			m_threads.push_back(std::thread(&ocl_job_pool::worker_thread, this));
+
+		return true;
+	}
+
+	void deinit()
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_kill = true;
+		}
+		m_work_cv.notify_all();
+
+		for (uint32_t i = 0; i < m_threads.size(); i++)
+			m_threads[i].join();
+		m_threads.resize(0);
+
+		m_batches.clear();
+	}
+
+	uint32_t get_num_threads() const { return (uint32_t)m_threads.size(); }
+
+	// Queues func(0) to func(num_tasks - 1) on the worker threads and returns immediately. Several threads may use the pool at once.
+	// wait_parallel() must be called before batch or func go out of scope.
+	void begin_parallel(ocl_job_batch& batch, uint32_t num_tasks, const std::function<void(uint32_t)>& func)
+	{
+		batch.m_pFunc = &func;
+		batch.m_num_tasks = num_tasks;
+		batch.m_next_task = 0;
+		batch.m_num_done = 0;
+
+		if ((!num_tasks) || (m_threads.empty()))
+			return;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_batches.push_back(&batch);
+		}
+		m_work_cv.notify_all();
+	}
+
+	// The calling thread runs any of the batch's tasks that haven't been picked up yet, then waits for the rest.
+	void wait_parallel(ocl_job_batch& batch)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		for ( ; ; )
+		{
+			uint32_t task_index;
+			if (!take_task(batch, task_index))
+				break;
+
+			lock.unlock();
+			(*batch.m_pFunc)(task_index);
+			lock.lock();
+
+			batch.m_num_done++;
+		}
+
+		m_done_cv.wait(lock, [&batch] { return batch.m_num_done == batch.m_num_tasks; });
+	}
+
+	void run_parallel(uint32_t num_tasks, const std::function<void(uint32_t)>& func)
+	{
+		ocl_job_batch batch;
+		begin_parallel(batch, num_tasks, func);
+		wait_parallel(batch);
+	}
+
+private:
+	std::vector<std::thread> m_threads;
+	std::deque<ocl_job_batch*> m_batches;
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv, m_done_cv;
+	bool m_kill = false;
+
+	ocl_job_pool(const ocl_job_pool&);
+	ocl_job_pool& operator= (const ocl_job_pool&);
+
+	// Must be called with m_mutex held. Once a batch's last task is taken it's removed from the queue, so workers never touch a batch after wait_parallel() returns.
+	bool take_task(ocl_job_batch& batch, uint32_t& task_index)
+	{
+		if (batch.m_next_task >= batch.m_num_tasks)
+			return false;
+
+		task_index = batch.m_next_task++;
+
+		if (batch.m_next_task == batch.m_num_tasks)
+		{
+			for (auto it = m_batches.begin(); it != m_batches.end(); ++it)
+			{
+				if (*it == &batch)
+				{
+					m_batches.erase(it);
+					break;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	void worker_thread()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		for ( ; ; )
+		{
+			m_work_cv.wait(lock, [this] { return m_kill || !m_batches.empty(); });
+			if (m_kill)
+				break;
+
+			ocl_job_batch& batch = *m_batches.front();
+
+			uint32_t task_index;
+			if (!take_task(batch, task_index))
+				continue;
+
+			lock.unlock();
+			(*batch.m_pFunc)(task_index);
+			lock.lock();
+
+			if (++batch.m_num_done == batch.m_num_tasks)
+				m_done_cv.notify_all();
+		}
+	}
+};
@@ -1,4 +1,4 @@
-// Generated using "xxd -i ocl_kernels.cl"
+// Generated from ocl_kernels.cl by cmake/embed_file.cmake, do not edit.
 unsigned char ocl_kernels_cl[] = {
   0x2f, 0x2f, 0x23, 0x64, 0x65, 0x66, 0x69, 0x6e, 0x65, 0x20, 0x5f, 0x44,
   0x45, 0x42, 0x55, 0x47, 0x0a, 0x0a, 0x23, 0x69, 0x66, 0x6e, 0x64, 0x65,
@@ -55,28 +55,281 @@ unsigned char ocl_kernels_cl[] = {
   0x4e, 0x45, 0x5f, 0x5f, 0x29, 0x0a, 0x23, 0x65, 0x6c, 0x73, 0x65, 0x0a,
   0x09, 0x23, 0x64, 0x65, 0x66, 0x69, 0x6e, 0x65, 0x20, 0x61, 0x73, 0x73,
   0x65, 0x72, 0x74, 0x28, 0x78, 0x29, 0x0a, 0x23, 0x65, 0x6e, 0x64, 0x69,
-  0x66, 0x0a, 0x0a, 0x6b, 0x65, 0x72, 0x6e, 0x65, 0x6c, 0x20, 0x76, 0x6f,
-  0x69, 0x64, 0x20, 0x70, 0x72, 0x6f, 0x63, 0x65, 0x73, 0x73, 0x5f, 0x62,
-  0x75, 0x66, 0x66, 0x65, 0x72, 0x28, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x63,
+  0x66, 0x0a, 0x0a, 0x2f, 0x2f, 0x20, 0x43, 0x6f, 0x6d, 0x70, 0x69, 0x6c,
+  0x65, 0x20, 0x74, 0x69, 0x6d, 0x65, 0x20, 0x73, 0x70, 0x65, 0x63, 0x69,
+  0x61, 0x6c, 0x69, 0x7a, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x2c, 0x20,
+  0x73, 0x65, 0x74, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x2d, 0x44, 0x20,
+  0x62, 0x79, 0x20, 0x6f, 0x63, 0x6c, 0x3a, 0x3a, 0x63, 0x72, 0x65, 0x61,
+  0x74, 0x65, 0x5f, 0x6b, 0x65, 0x72, 0x6e, 0x65, 0x6c, 0x5f, 0x76, 0x61,
+  0x72, 0x69, 0x61, 0x6e, 0x74, 0x28, 0x29, 0x2e, 0x20, 0x45, 0x61, 0x63,
+  0x68, 0x20, 0x77, 0x6f, 0x72, 0x6b, 0x20, 0x69, 0x74, 0x65, 0x6d, 0x20,
+  0x70, 0x72, 0x6f, 0x63, 0x65, 0x73, 0x73, 0x65, 0x73, 0x20, 0x56, 0x45,
+  0x43, 0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x20, 0x62, 0x79, 0x74, 0x65,
+  0x73, 0x2e, 0x0a, 0x2f, 0x2f, 0x20, 0x49, 0x66, 0x20, 0x62, 0x75, 0x66,
+  0x5f, 0x73, 0x69, 0x7a, 0x65, 0x20, 0x69, 0x73, 0x20, 0x6b, 0x6e, 0x6f,
+  0x77, 0x6e, 0x20, 0x74, 0x6f, 0x20, 0x62, 0x65, 0x20, 0x61, 0x20, 0x6d,
+  0x75, 0x6c, 0x74, 0x69, 0x70, 0x6c, 0x65, 0x20, 0x6f, 0x66, 0x20, 0x56,
+  0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x20, 0x28, 0x42, 0x55,
+  0x46, 0x5f, 0x53, 0x49, 0x5a, 0x45, 0x5f, 0x4d, 0x55, 0x4c, 0x54, 0x49,
+  0x50, 0x4c, 0x45, 0x29, 0x2c, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x6f,
+  0x75, 0x6e, 0x64, 0x73, 0x20, 0x63, 0x68, 0x65, 0x63, 0x6b, 0x20, 0x69,
+  0x73, 0x20, 0x63, 0x6f, 0x6d, 0x70, 0x69, 0x6c, 0x65, 0x64, 0x20, 0x6f,
+  0x75, 0x74, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6c,
+  0x6f, 0x6f, 0x70, 0x20, 0x69, 0x73, 0x20, 0x66, 0x75, 0x6c, 0x6c, 0x79,
+  0x20, 0x75, 0x6e, 0x72, 0x6f, 0x6c, 0x6c, 0x65, 0x64, 0x2e, 0x0a, 0x23,
+  0x69, 0x66, 0x6e, 0x64, 0x65, 0x66, 0x20, 0x56, 0x45, 0x43, 0x5f, 0x57,
+  0x49, 0x44, 0x54, 0x48, 0x0a, 0x09, 0x23, 0x64, 0x65, 0x66, 0x69, 0x6e,
+  0x65, 0x20, 0x56, 0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x20,
+  0x31, 0x0a, 0x23, 0x65, 0x6e, 0x64, 0x69, 0x66, 0x0a, 0x0a, 0x23, 0x69,
+  0x66, 0x6e, 0x64, 0x65, 0x66, 0x20, 0x42, 0x55, 0x46, 0x5f, 0x53, 0x49,
+  0x5a, 0x45, 0x5f, 0x4d, 0x55, 0x4c, 0x54, 0x49, 0x50, 0x4c, 0x45, 0x0a,
+  0x09, 0x23, 0x64, 0x65, 0x66, 0x69, 0x6e, 0x65, 0x20, 0x42, 0x55, 0x46,
+  0x5f, 0x53, 0x49, 0x5a, 0x45, 0x5f, 0x4d, 0x55, 0x4c, 0x54, 0x49, 0x50,
+  0x4c, 0x45, 0x20, 0x31, 0x0a, 0x23, 0x65, 0x6e, 0x64, 0x69, 0x66, 0x0a,
+  0x0a, 0x6b, 0x65, 0x72, 0x6e, 0x65, 0x6c, 0x20, 0x76, 0x6f, 0x69, 0x64,
+  0x20, 0x70, 0x72, 0x6f, 0x63, 0x65, 0x73, 0x73, 0x5f, 0x62, 0x75, 0x66,
+  0x66, 0x65, 0x72, 0x28, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6e,
+  0x73, 0x74, 0x20, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x20, 0x75, 0x69,
+  0x6e, 0x74, 0x38, 0x5f, 0x74, 0x20, 0x2a, 0x70, 0x49, 0x6e, 0x70, 0x75,
+  0x74, 0x5f, 0x62, 0x75, 0x66, 0x2c, 0x0a, 0x09, 0x67, 0x6c, 0x6f, 0x62,
+  0x61, 0x6c, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x5f, 0x74, 0x20, 0x2a,
+  0x70, 0x4f, 0x75, 0x74, 0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x2c,
+  0x0a, 0x20, 0x20, 0x20, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f,
+  0x74, 0x20, 0x62, 0x75, 0x66, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x2c, 0x0a,
+  0x09, 0x75, 0x69, 0x6e, 0x74, 0x36, 0x34, 0x5f, 0x74, 0x20, 0x62, 0x61,
+  0x73, 0x65, 0x5f, 0x6f, 0x66, 0x73, 0x29, 0x0a, 0x7b, 0x0a, 0x09, 0x2f,
+  0x2f, 0x20, 0x57, 0x68, 0x65, 0x6e, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62,
+  0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 0x69, 0x73, 0x20, 0x73, 0x70, 0x6c,
+  0x69, 0x74, 0x20, 0x69, 0x6e, 0x74, 0x6f, 0x20, 0x73, 0x68, 0x61, 0x72,
+  0x64, 0x73, 0x2c, 0x20, 0x74, 0x68, 0x65, 0x20, 0x67, 0x6c, 0x6f, 0x62,
+  0x61, 0x6c, 0x20, 0x77, 0x6f, 0x72, 0x6b, 0x20, 0x6f, 0x66, 0x66, 0x73,
+  0x65, 0x74, 0x20, 0x69, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x68,
+  0x61, 0x72, 0x64, 0x27, 0x73, 0x20, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74,
+  0x20, 0x69, 0x6e, 0x20, 0x74, 0x68, 0x65, 0x20, 0x66, 0x75, 0x6c, 0x6c,
+  0x20, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 0x28, 0x69, 0x6e, 0x20,
+  0x77, 0x6f, 0x72, 0x6b, 0x20, 0x69, 0x74, 0x65, 0x6d, 0x73, 0x29, 0x20,
+  0x61, 0x6e, 0x64, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x75, 0x66, 0x66,
+  0x65, 0x72, 0x73, 0x20, 0x6f, 0x6e, 0x6c, 0x79, 0x20, 0x68, 0x6f, 0x6c,
+  0x64, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x68, 0x61, 0x72, 0x64, 0x2e,
+  0x0a, 0x09, 0x2f, 0x2f, 0x20, 0x53, 0x68, 0x61, 0x72, 0x64, 0x73, 0x20,
+  0x73, 0x74, 0x61, 0x72, 0x74, 0x20, 0x6f, 0x6e, 0x20, 0x34, 0x4b, 0x42,
+  0x20, 0x62, 0x6f, 0x75, 0x6e, 0x64, 0x61, 0x72, 0x69, 0x65, 0x73, 0x2c,
+  0x20, 0x73, 0x6f, 0x20, 0x6f, 0x6e, 0x6c, 0x79, 0x20, 0x74, 0x68, 0x65,
+  0x20, 0x77, 0x6f, 0x72, 0x6b, 0x20, 0x69, 0x74, 0x65, 0x6d, 0x20, 0x61,
+  0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x76, 0x65, 0x72, 0x79, 0x20, 0x65,
+  0x6e, 0x64, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x75,
+  0x66, 0x66, 0x65, 0x72, 0x20, 0x63, 0x61, 0x6e, 0x20, 0x62, 0x65, 0x20,
+  0x70, 0x61, 0x72, 0x74, 0x69, 0x61, 0x6c, 0x2e, 0x0a, 0x09, 0x2f, 0x2f,
+  0x20, 0x62, 0x61, 0x73, 0x65, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x69, 0x73,
+  0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x27,
+  0x73, 0x20, 0x6f, 0x77, 0x6e, 0x20, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74,
+  0x20, 0x69, 0x6e, 0x20, 0x61, 0x20, 0x6c, 0x61, 0x72, 0x67, 0x65, 0x72,
+  0x20, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x20, 0x6f, 0x72, 0x20, 0x66,
+  0x69, 0x6c, 0x65, 0x20, 0x28, 0x30, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f,
+  0x6e, 0x65, 0x29, 0x2e, 0x20, 0x42, 0x79, 0x74, 0x65, 0x20, 0x6f, 0x66,
+  0x66, 0x73, 0x65, 0x74, 0x73, 0x20, 0x69, 0x6e, 0x20, 0x74, 0x68, 0x61,
+  0x74, 0x20, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x20, 0x63, 0x61, 0x6e,
+  0x20, 0x65, 0x78, 0x63, 0x65, 0x65, 0x64, 0x20, 0x34, 0x47, 0x42, 0x2c,
+  0x20, 0x73, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x79, 0x27, 0x72, 0x65, 0x20,
+  0x36, 0x34, 0x2d, 0x62, 0x69, 0x74, 0x2e, 0x0a, 0x09, 0x63, 0x6f, 0x6e,
+  0x73, 0x74, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20,
+  0x62, 0x75, 0x66, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3d, 0x20, 0x67, 0x65,
+  0x74, 0x5f, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x5f, 0x69, 0x64, 0x28,
+  0x30, 0x29, 0x20, 0x2a, 0x20, 0x56, 0x45, 0x43, 0x5f, 0x57, 0x49, 0x44,
+  0x54, 0x48, 0x3b, 0x0a, 0x09, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75,
+  0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20, 0x73, 0x68, 0x61, 0x72,
+  0x64, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3d, 0x20, 0x28, 0x67, 0x65, 0x74,
+  0x5f, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x5f, 0x69, 0x64, 0x28, 0x30,
+  0x29, 0x20, 0x2d, 0x20, 0x67, 0x65, 0x74, 0x5f, 0x67, 0x6c, 0x6f, 0x62,
+  0x61, 0x6c, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x28, 0x30, 0x29,
+  0x29, 0x20, 0x2a, 0x20, 0x56, 0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54,
+  0x48, 0x3b, 0x0a, 0x09, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75, 0x69,
+  0x6e, 0x74, 0x36, 0x34, 0x5f, 0x74, 0x20, 0x73, 0x74, 0x72, 0x65, 0x61,
+  0x6d, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3d, 0x20, 0x62, 0x61, 0x73, 0x65,
+  0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b, 0x20, 0x62, 0x75, 0x66, 0x5f, 0x6f,
+  0x66, 0x73, 0x3b, 0x0a, 0x0a, 0x09, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74,
+  0x28, 0x62, 0x75, 0x66, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3c, 0x20, 0x62,
+  0x75, 0x66, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x29, 0x3b, 0x0a, 0x09, 0x0a,
+  0x23, 0x69, 0x66, 0x20, 0x28, 0x42, 0x55, 0x46, 0x5f, 0x53, 0x49, 0x5a,
+  0x45, 0x5f, 0x4d, 0x55, 0x4c, 0x54, 0x49, 0x50, 0x4c, 0x45, 0x20, 0x25,
+  0x20, 0x56, 0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x29, 0x20,
+  0x3d, 0x3d, 0x20, 0x30, 0x0a, 0x09, 0x23, 0x70, 0x72, 0x61, 0x67, 0x6d,
+  0x61, 0x20, 0x75, 0x6e, 0x72, 0x6f, 0x6c, 0x6c, 0x0a, 0x09, 0x66, 0x6f,
+  0x72, 0x20, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20,
+  0x69, 0x20, 0x3d, 0x20, 0x30, 0x3b, 0x20, 0x69, 0x20, 0x3c, 0x20, 0x56,
+  0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x3b, 0x20, 0x69, 0x2b,
+  0x2b, 0x29, 0x0a, 0x09, 0x09, 0x70, 0x4f, 0x75, 0x74, 0x70, 0x75, 0x74,
+  0x5f, 0x62, 0x75, 0x66, 0x5b, 0x73, 0x68, 0x61, 0x72, 0x64, 0x5f, 0x6f,
+  0x66, 0x73, 0x20, 0x2b, 0x20, 0x69, 0x5d, 0x20, 0x3d, 0x20, 0x70, 0x49,
+  0x6e, 0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x5b, 0x73, 0x68, 0x61,
+  0x72, 0x64, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b, 0x20, 0x69, 0x5d, 0x20,
+  0x5e, 0x20, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x5f, 0x74, 0x29, 0x28,
+  0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b,
+  0x20, 0x69, 0x29, 0x3b, 0x0a, 0x23, 0x65, 0x6c, 0x73, 0x65, 0x0a, 0x09,
+  0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32,
+  0x5f, 0x74, 0x20, 0x6e, 0x20, 0x3d, 0x20, 0x6d, 0x69, 0x6e, 0x28, 0x28,
+  0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x29, 0x56, 0x45, 0x43,
+  0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x2c, 0x20, 0x62, 0x75, 0x66, 0x5f,
+  0x73, 0x69, 0x7a, 0x65, 0x20, 0x2d, 0x20, 0x62, 0x75, 0x66, 0x5f, 0x6f,
+  0x66, 0x73, 0x29, 0x3b, 0x0a, 0x09, 0x66, 0x6f, 0x72, 0x20, 0x28, 0x75,
+  0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20, 0x69, 0x20, 0x3d, 0x20,
+  0x30, 0x3b, 0x20, 0x69, 0x20, 0x3c, 0x20, 0x6e, 0x3b, 0x20, 0x69, 0x2b,
+  0x2b, 0x29, 0x0a, 0x09, 0x09, 0x70, 0x4f, 0x75, 0x74, 0x70, 0x75, 0x74,
+  0x5f, 0x62, 0x75, 0x66, 0x5b, 0x73, 0x68, 0x61, 0x72, 0x64, 0x5f, 0x6f,
+  0x66, 0x73, 0x20, 0x2b, 0x20, 0x69, 0x5d, 0x20, 0x3d, 0x20, 0x70, 0x49,
+  0x6e, 0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x5b, 0x73, 0x68, 0x61,
+  0x72, 0x64, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b, 0x20, 0x69, 0x5d, 0x20,
+  0x5e, 0x20, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x5f, 0x74, 0x29, 0x28,
+  0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b,
+  0x20, 0x69, 0x29, 0x3b, 0x0a, 0x23, 0x65, 0x6e, 0x64, 0x69, 0x66, 0x0a,
+  0x7d, 0x0a, 0x0a, 0x2f, 0x2f, 0x20, 0x49, 0x6e, 0x20, 0x70, 0x6c, 0x61,
+  0x63, 0x65, 0x20, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x6f,
+  0x66, 0x20, 0x70, 0x72, 0x6f, 0x63, 0x65, 0x73, 0x73, 0x5f, 0x62, 0x75,
+  0x66, 0x66, 0x65, 0x72, 0x3a, 0x20, 0x61, 0x20, 0x73, 0x69, 0x6e, 0x67,
+  0x6c, 0x65, 0x20, 0x72, 0x65, 0x61, 0x64, 0x2f, 0x77, 0x72, 0x69, 0x74,
+  0x65, 0x20, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x2c, 0x20, 0x73, 0x6f,
+  0x20, 0x65, 0x61, 0x63, 0x68, 0x20, 0x73, 0x68, 0x61, 0x72, 0x64, 0x20,
+  0x6e, 0x65, 0x65, 0x64, 0x73, 0x20, 0x68, 0x61, 0x6c, 0x66, 0x20, 0x74,
+  0x68, 0x65, 0x20, 0x64, 0x65, 0x76, 0x69, 0x63, 0x65, 0x20, 0x6d, 0x65,
+  0x6d, 0x6f, 0x72, 0x79, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6f, 0x6e, 0x65,
+  0x20, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 0x69, 0x6e, 0x73, 0x74,
+  0x65, 0x61, 0x64, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x77, 0x6f, 0x2e, 0x0a,
+  0x6b, 0x65, 0x72, 0x6e, 0x65, 0x6c, 0x20, 0x76, 0x6f, 0x69, 0x64, 0x20,
+  0x70, 0x72, 0x6f, 0x63, 0x65, 0x73, 0x73, 0x5f, 0x62, 0x75, 0x66, 0x66,
+  0x65, 0x72, 0x5f, 0x69, 0x6e, 0x70, 0x6c, 0x61, 0x63, 0x65, 0x28, 0x0a,
+  0x09, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x20, 0x75, 0x69, 0x6e, 0x74,
+  0x38, 0x5f, 0x74, 0x20, 0x2a, 0x70, 0x42, 0x75, 0x66, 0x2c, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20,
+  0x62, 0x75, 0x66, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x2c, 0x0a, 0x09, 0x75,
+  0x69, 0x6e, 0x74, 0x36, 0x34, 0x5f, 0x74, 0x20, 0x62, 0x61, 0x73, 0x65,
+  0x5f, 0x6f, 0x66, 0x73, 0x29, 0x0a, 0x7b, 0x0a, 0x09, 0x63, 0x6f, 0x6e,
+  0x73, 0x74, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20,
+  0x62, 0x75, 0x66, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3d, 0x20, 0x67, 0x65,
+  0x74, 0x5f, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x5f, 0x69, 0x64, 0x28,
+  0x30, 0x29, 0x20, 0x2a, 0x20, 0x56, 0x45, 0x43, 0x5f, 0x57, 0x49, 0x44,
+  0x54, 0x48, 0x3b, 0x0a, 0x09, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75,
+  0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20, 0x73, 0x68, 0x61, 0x72,
+  0x64, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3d, 0x20, 0x28, 0x67, 0x65, 0x74,
+  0x5f, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x5f, 0x69, 0x64, 0x28, 0x30,
+  0x29, 0x20, 0x2d, 0x20, 0x67, 0x65, 0x74, 0x5f, 0x67, 0x6c, 0x6f, 0x62,
+  0x61, 0x6c, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x28, 0x30, 0x29,
+  0x29, 0x20, 0x2a, 0x20, 0x56, 0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54,
+  0x48, 0x3b, 0x0a, 0x09, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75, 0x69,
+  0x6e, 0x74, 0x36, 0x34, 0x5f, 0x74, 0x20, 0x73, 0x74, 0x72, 0x65, 0x61,
+  0x6d, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3d, 0x20, 0x62, 0x61, 0x73, 0x65,
+  0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b, 0x20, 0x62, 0x75, 0x66, 0x5f, 0x6f,
+  0x66, 0x73, 0x3b, 0x0a, 0x0a, 0x09, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74,
+  0x28, 0x62, 0x75, 0x66, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3c, 0x20, 0x62,
+  0x75, 0x66, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x29, 0x3b, 0x0a, 0x09, 0x0a,
+  0x23, 0x69, 0x66, 0x20, 0x28, 0x42, 0x55, 0x46, 0x5f, 0x53, 0x49, 0x5a,
+  0x45, 0x5f, 0x4d, 0x55, 0x4c, 0x54, 0x49, 0x50, 0x4c, 0x45, 0x20, 0x25,
+  0x20, 0x56, 0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x29, 0x20,
+  0x3d, 0x3d, 0x20, 0x30, 0x0a, 0x09, 0x23, 0x70, 0x72, 0x61, 0x67, 0x6d,
+  0x61, 0x20, 0x75, 0x6e, 0x72, 0x6f, 0x6c, 0x6c, 0x0a, 0x09, 0x66, 0x6f,
+  0x72, 0x20, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20,
+  0x69, 0x20, 0x3d, 0x20, 0x30, 0x3b, 0x20, 0x69, 0x20, 0x3c, 0x20, 0x56,
+  0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x3b, 0x20, 0x69, 0x2b,
+  0x2b, 0x29, 0x0a, 0x09, 0x09, 0x70, 0x42, 0x75, 0x66, 0x5b, 0x73, 0x68,
+  0x61, 0x72, 0x64, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b, 0x20, 0x69, 0x5d,
+  0x20, 0x5e, 0x3d, 0x20, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x5f, 0x74,
+  0x29, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x5f, 0x6f, 0x66, 0x73,
+  0x20, 0x2b, 0x20, 0x69, 0x29, 0x3b, 0x0a, 0x23, 0x65, 0x6c, 0x73, 0x65,
+  0x0a, 0x09, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75, 0x69, 0x6e, 0x74,
+  0x33, 0x32, 0x5f, 0x74, 0x20, 0x6e, 0x20, 0x3d, 0x20, 0x6d, 0x69, 0x6e,
+  0x28, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x29, 0x56,
+  0x45, 0x43, 0x5f, 0x57, 0x49, 0x44, 0x54, 0x48, 0x2c, 0x20, 0x62, 0x75,
+  0x66, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x20, 0x2d, 0x20, 0x62, 0x75, 0x66,
+  0x5f, 0x6f, 0x66, 0x73, 0x29, 0x3b, 0x0a, 0x09, 0x66, 0x6f, 0x72, 0x20,
+  0x28, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20, 0x69, 0x20,
+  0x3d, 0x20, 0x30, 0x3b, 0x20, 0x69, 0x20, 0x3c, 0x20, 0x6e, 0x3b, 0x20,
+  0x69, 0x2b, 0x2b, 0x29, 0x0a, 0x09, 0x09, 0x70, 0x42, 0x75, 0x66, 0x5b,
+  0x73, 0x68, 0x61, 0x72, 0x64, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b, 0x20,
+  0x69, 0x5d, 0x20, 0x5e, 0x3d, 0x20, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x38,
+  0x5f, 0x74, 0x29, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x5f, 0x6f,
+  0x66, 0x73, 0x20, 0x2b, 0x20, 0x69, 0x29, 0x3b, 0x0a, 0x23, 0x65, 0x6e,
+  0x64, 0x69, 0x66, 0x0a, 0x7d, 0x0a, 0x0a, 0x2f, 0x2f, 0x20, 0x42, 0x61,
+  0x74, 0x63, 0x68, 0x65, 0x64, 0x20, 0x70, 0x72, 0x6f, 0x63, 0x65, 0x73,
+  0x73, 0x5f, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 0x66, 0x6f, 0x72,
+  0x20, 0x6d, 0x61, 0x6e, 0x79, 0x20, 0x73, 0x6d, 0x61, 0x6c, 0x6c, 0x20,
+  0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x73, 0x20, 0x69, 0x6e, 0x20, 0x6f,
+  0x6e, 0x65, 0x20, 0x6c, 0x61, 0x75, 0x6e, 0x63, 0x68, 0x2e, 0x20, 0x70,
+  0x49, 0x6e, 0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x20, 0x73, 0x74,
+  0x61, 0x72, 0x74, 0x73, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x61, 0x6e,
+  0x20, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x74, 0x61, 0x62, 0x6c,
+  0x65, 0x20, 0x6f, 0x66, 0x20, 0x6e, 0x75, 0x6d, 0x5f, 0x69, 0x74, 0x65,
+  0x6d, 0x73, 0x20, 0x2b, 0x20, 0x31, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x33,
+  0x32, 0x5f, 0x74, 0x27, 0x73, 0x2c, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x74,
+  0x68, 0x65, 0x20, 0x69, 0x74, 0x65, 0x6d, 0x73, 0x20, 0x66, 0x6f, 0x6c,
+  0x6c, 0x6f, 0x77, 0x20, 0x61, 0x74, 0x20, 0x64, 0x61, 0x74, 0x61, 0x5f,
+  0x6f, 0x66, 0x73, 0x2c, 0x20, 0x0a, 0x2f, 0x2f, 0x20, 0x70, 0x61, 0x63,
+  0x6b, 0x65, 0x64, 0x20, 0x62, 0x61, 0x63, 0x6b, 0x20, 0x74, 0x6f, 0x20,
+  0x62, 0x61, 0x63, 0x6b, 0x2e, 0x20, 0x49, 0x74, 0x65, 0x6d, 0x20, 0x69,
+  0x20, 0x69, 0x73, 0x20, 0x5b, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x73,
+  0x5b, 0x69, 0x5d, 0x2c, 0x20, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x73,
+  0x5b, 0x69, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0x29, 0x20, 0x6f, 0x66, 0x20,
+  0x74, 0x68, 0x65, 0x20, 0x70, 0x61, 0x63, 0x6b, 0x65, 0x64, 0x20, 0x64,
+  0x61, 0x74, 0x61, 0x20, 0x28, 0x69, 0x6e, 0x20, 0x70, 0x4f, 0x75, 0x74,
+  0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x20, 0x74, 0x6f, 0x6f, 0x29,
+  0x2c, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x69, 0x73, 0x20, 0x70, 0x72, 0x6f,
+  0x63, 0x65, 0x73, 0x73, 0x65, 0x64, 0x20, 0x61, 0x73, 0x20, 0x69, 0x66,
+  0x20, 0x69, 0x74, 0x20, 0x77, 0x65, 0x72, 0x65, 0x20, 0x61, 0x20, 0x62,
+  0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 0x6f, 0x66, 0x20, 0x69, 0x74, 0x73,
+  0x20, 0x6f, 0x77, 0x6e, 0x2e, 0x0a, 0x2f, 0x2f, 0x20, 0x4f, 0x6e, 0x65,
+  0x20, 0x77, 0x6f, 0x72, 0x6b, 0x20, 0x69, 0x74, 0x65, 0x6d, 0x20, 0x70,
+  0x65, 0x72, 0x20, 0x62, 0x79, 0x74, 0x65, 0x20, 0x6f, 0x66, 0x20, 0x70,
+  0x61, 0x63, 0x6b, 0x65, 0x64, 0x20, 0x64, 0x61, 0x74, 0x61, 0x2e, 0x0a,
+  0x6b, 0x65, 0x72, 0x6e, 0x65, 0x6c, 0x20, 0x76, 0x6f, 0x69, 0x64, 0x20,
+  0x70, 0x72, 0x6f, 0x63, 0x65, 0x73, 0x73, 0x5f, 0x62, 0x75, 0x66, 0x66,
+  0x65, 0x72, 0x5f, 0x62, 0x61, 0x74, 0x63, 0x68, 0x28, 0x0a, 0x09, 0x63,
   0x6f, 0x6e, 0x73, 0x74, 0x20, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x20,
   0x75, 0x69, 0x6e, 0x74, 0x38, 0x5f, 0x74, 0x20, 0x2a, 0x70, 0x49, 0x6e,
   0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x2c, 0x0a, 0x09, 0x67, 0x6c,
   0x6f, 0x62, 0x61, 0x6c, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x5f, 0x74,
   0x20, 0x2a, 0x70, 0x4f, 0x75, 0x74, 0x70, 0x75, 0x74, 0x5f, 0x62, 0x75,
-  0x66, 0x2c, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x33,
-  0x32, 0x5f, 0x74, 0x20, 0x62, 0x75, 0x66, 0x5f, 0x73, 0x69, 0x7a, 0x65,
-  0x29, 0x0a, 0x7b, 0x0a, 0x09, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75,
-  0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20, 0x62, 0x75, 0x66, 0x5f,
-  0x6f, 0x66, 0x73, 0x20, 0x3d, 0x20, 0x67, 0x65, 0x74, 0x5f, 0x67, 0x6c,
-  0x6f, 0x62, 0x61, 0x6c, 0x5f, 0x69, 0x64, 0x28, 0x30, 0x29, 0x3b, 0x0a,
-  0x0a, 0x09, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x62, 0x75, 0x66,
-  0x5f, 0x6f, 0x66, 0x73, 0x20, 0x3c, 0x20, 0x62, 0x75, 0x66, 0x5f, 0x73,
-  0x69, 0x7a, 0x65, 0x29, 0x3b, 0x0a, 0x09, 0x0a, 0x09, 0x70, 0x4f, 0x75,
-  0x74, 0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x5b, 0x62, 0x75, 0x66,
-  0x5f, 0x6f, 0x66, 0x73, 0x5d, 0x20, 0x3d, 0x20, 0x70, 0x49, 0x6e, 0x70,
-  0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x5b, 0x62, 0x75, 0x66, 0x5f, 0x6f,
-  0x66, 0x73, 0x5d, 0x20, 0x5e, 0x20, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x38,
-  0x5f, 0x74, 0x29, 0x62, 0x75, 0x66, 0x5f, 0x6f, 0x66, 0x73, 0x3b, 0x0a,
+  0x66, 0x2c, 0x0a, 0x09, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74,
+  0x20, 0x6e, 0x75, 0x6d, 0x5f, 0x69, 0x74, 0x65, 0x6d, 0x73, 0x2c, 0x0a,
+  0x09, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20, 0x64, 0x61,
+  0x74, 0x61, 0x5f, 0x6f, 0x66, 0x73, 0x29, 0x0a, 0x7b, 0x0a, 0x09, 0x63,
+  0x6f, 0x6e, 0x73, 0x74, 0x20, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x20,
+  0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20, 0x2a, 0x70, 0x4f,
+  0x66, 0x66, 0x73, 0x65, 0x74, 0x73, 0x20, 0x3d, 0x20, 0x28, 0x63, 0x6f,
+  0x6e, 0x73, 0x74, 0x20, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x20, 0x75,
+  0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20, 0x2a, 0x29, 0x70, 0x49,
+  0x6e, 0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x3b, 0x0a, 0x09, 0x63,
+  0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f,
+  0x74, 0x20, 0x6f, 0x66, 0x73, 0x20, 0x3d, 0x20, 0x67, 0x65, 0x74, 0x5f,
+  0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x5f, 0x69, 0x64, 0x28, 0x30, 0x29,
+  0x3b, 0x0a, 0x0a, 0x09, 0x2f, 0x2f, 0x20, 0x46, 0x69, 0x6e, 0x64, 0x20,
+  0x74, 0x68, 0x65, 0x20, 0x6c, 0x61, 0x73, 0x74, 0x20, 0x69, 0x74, 0x65,
+  0x6d, 0x20, 0x73, 0x74, 0x61, 0x72, 0x74, 0x69, 0x6e, 0x67, 0x20, 0x61,
+  0x74, 0x20, 0x6f, 0x72, 0x20, 0x62, 0x65, 0x66, 0x6f, 0x72, 0x65, 0x20,
+  0x6f, 0x66, 0x73, 0x2e, 0x20, 0x45, 0x6d, 0x70, 0x74, 0x79, 0x20, 0x69,
+  0x74, 0x65, 0x6d, 0x73, 0x20, 0x73, 0x68, 0x61, 0x72, 0x65, 0x20, 0x74,
+  0x68, 0x65, 0x69, 0x72, 0x20, 0x73, 0x74, 0x61, 0x72, 0x74, 0x20, 0x77,
+  0x69, 0x74, 0x68, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6e, 0x65, 0x78, 0x74,
+  0x20, 0x6f, 0x6e, 0x65, 0x2c, 0x20, 0x73, 0x6f, 0x20, 0x74, 0x68, 0x65,
+  0x79, 0x27, 0x72, 0x65, 0x20, 0x73, 0x6b, 0x69, 0x70, 0x70, 0x65, 0x64,
+  0x2e, 0x0a, 0x09, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x5f, 0x74, 0x20,
+  0x6c, 0x6f, 0x20, 0x3d, 0x20, 0x30, 0x2c, 0x20, 0x68, 0x69, 0x20, 0x3d,
+  0x20, 0x6e, 0x75, 0x6d, 0x5f, 0x69, 0x74, 0x65, 0x6d, 0x73, 0x20, 0x2d,
+  0x20, 0x31, 0x3b, 0x0a, 0x09, 0x77, 0x68, 0x69, 0x6c, 0x65, 0x20, 0x28,
+  0x6c, 0x6f, 0x20, 0x3c, 0x20, 0x68, 0x69, 0x29, 0x0a, 0x09, 0x7b, 0x0a,
+  0x09, 0x09, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x75, 0x69, 0x6e, 0x74,
+  0x33, 0x32, 0x5f, 0x74, 0x20, 0x6d, 0x69, 0x64, 0x20, 0x3d, 0x20, 0x28,
+  0x6c, 0x6f, 0x20, 0x2b, 0x20, 0x68, 0x69, 0x20, 0x2b, 0x20, 0x31, 0x29,
+  0x20, 0x3e, 0x3e, 0x20, 0x31, 0x3b, 0x0a, 0x09, 0x09, 0x69, 0x66, 0x20,
+  0x28, 0x70, 0x4f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x73, 0x5b, 0x6d, 0x69,
+  0x64, 0x5d, 0x20, 0x3c, 0x3d, 0x20, 0x6f, 0x66, 0x73, 0x29, 0x0a, 0x09,
+  0x09, 0x09, 0x6c, 0x6f, 0x20, 0x3d, 0x20, 0x6d, 0x69, 0x64, 0x3b, 0x0a,
+  0x09, 0x09, 0x65, 0x6c, 0x73, 0x65, 0x0a, 0x09, 0x09, 0x09, 0x68, 0x69,
+  0x20, 0x3d, 0x20, 0x6d, 0x69, 0x64, 0x20, 0x2d, 0x20, 0x31, 0x3b, 0x0a,
+  0x09, 0x7d, 0x0a, 0x0a, 0x09, 0x70, 0x4f, 0x75, 0x74, 0x70, 0x75, 0x74,
+  0x5f, 0x62, 0x75, 0x66, 0x5b, 0x6f, 0x66, 0x73, 0x5d, 0x20, 0x3d, 0x20,
+  0x70, 0x49, 0x6e, 0x70, 0x75, 0x74, 0x5f, 0x62, 0x75, 0x66, 0x5b, 0x64,
+  0x61, 0x74, 0x61, 0x5f, 0x6f, 0x66, 0x73, 0x20, 0x2b, 0x20, 0x6f, 0x66,
+  0x73, 0x5d, 0x20, 0x5e, 0x20, 0x28, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x5f,
+  0x74, 0x29, 0x28, 0x6f, 0x66, 0x73, 0x20, 0x2d, 0x20, 0x70, 0x4f, 0x66,
+  0x66, 0x73, 0x65, 0x74, 0x73, 0x5b, 0x6c, 0x6f, 0x5d, 0x29, 0x3b, 0x0a,
   0x7d, 0x0a
 };
-unsigned int ocl_kernels_cl_len = 926;
\ No newline at end of file
+unsigned int ocl_kernels_cl_len = 3962;
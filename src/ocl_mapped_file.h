@@ -0,0 +1,227 @@
+// ocl_mapped_file.h
+// Memory mapped file windows, so files of any size can be streamed through a few fixed size views instead of being read into memory.
+// Pages of an unmapped window no longer count towards the process's RSS: clean ones are simply dropped, dirty ones are written back by the OS in the background.
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+class ocl_mapped_file
+{
+public:
+	ocl_mapped_file() { }
+	~ocl_mapped_file() { close(); }
+
+	bool is_open() const { return m_open; }
+	uint64_t get_size() const { return m_size; }
+
+	// Window offsets must be multiples of this: the page size, or the allocation granularity (64KB) on Windows.
+	static size_t get_granularity()
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwAllocationGranularity;
+#else
+		const long page_size = sysconf(_SC_PAGESIZE);
+		return (page_size > 0) ? (size_t)page_size : 4096;
+#endif
+	}
+
+	bool open_read(const char* pFilename)
+	{
+		close();
+
+#ifdef _WIN32
+		m_file = CreateFileA(pFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size))
+		{
+			close();
+			return false;
+		}
+		m_size = (uint64_t)size.QuadPart;
+
+		// Empty files can't be mapped.
+		if ((m_size) && (!(m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr))))
+		{
+			close();
+			return false;
+		}
+#else
+		m_fd = ::open(pFilename, O_RDONLY);
+		if (m_fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(m_fd, &st) != 0)
+		{
+			close();
+			return false;
+		}
+		m_size = (uint64_t)st.st_size;
+#endif
+
+		m_open = true;
+		m_writable = false;
+		return true;
+	}
+
+	// Creates (or truncates) the file with the given size. Its space is allocated up front, so writing to mapped windows can't fail later because the disk is full.
+	bool create(const char* pFilename, uint64_t size)
+	{
+		close();
+
+#ifdef _WIN32
+		m_file = CreateFileA(pFilename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER end;
+		end.QuadPart = (LONGLONG)size;
+		if ((!SetFilePointerEx(m_file, end, nullptr, FILE_BEGIN)) || (!SetEndOfFile(m_file)))
+		{
+			close();
+			return false;
+		}
+
+		if ((size) && (!(m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, 0, 0, nullptr))))
+		{
+			close();
+			return false;
+		}
+#else
+		m_fd = ::open(pFilename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (m_fd < 0)
+			return false;
+
+		bool allocated = false;
+#if defined(__linux__)
+		allocated = (!size) || (posix_fallocate(m_fd, 0, (off_t)size) == 0);
+#endif
+		// Not every file system supports fallocate(): fall back to a sparse file.
+		if ((!allocated) && (ftruncate(m_fd, (off_t)size) != 0))
+		{
+			close();
+			return false;
+		}
+#endif
+
+		m_size = size;
+		m_open = true;
+		m_writable = true;
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (m_mapping)
+		{
+			CloseHandle(m_mapping);
+			m_mapping = nullptr;
+		}
+
+		if (m_file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_file);
+			m_file = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (m_fd >= 0)
+		{
+			::close(m_fd);
+			m_fd = -1;
+		}
+#endif
+
+		m_size = 0;
+		m_open = false;
+		m_writable = false;
+	}
+
+	// Maps [ofs, ofs + size) of the file, read only or read/write depending on how it was opened. ofs must be a multiple of get_granularity().
+	// Returns nullptr on failure. Windows stay valid after close(), until unmap_window().
+	uint8_t* map_window(uint64_t ofs, size_t size)
+	{
+		if ((!m_open) || (!size) || (ofs + size > m_size))
+			return nullptr;
+
+#ifdef _WIN32
+		void* p = MapViewOfFile(m_mapping, m_writable ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD)(ofs >> 32), (DWORD)ofs, size);
+		return static_cast<uint8_t*>(p);
+#else
+		void* p = mmap(nullptr, size, m_writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, m_fd, (off_t)ofs);
+		if (p == MAP_FAILED)
+			return nullptr;
+
+		if (!m_writable)
+			madvise(p, size, MADV_SEQUENTIAL);
+
+		return static_cast<uint8_t*>(p);
+#endif
+	}
+
+	static void unmap_window(uint8_t* p, size_t size)
+	{
+		if (!p)
+			return;
+
+#ifdef _WIN32
+		(void)size;
+		UnmapViewOfFile(p);
+#else
+		munmap(p, size);
+#endif
+	}
+
+	// Asks the OS to start reading the window's pages in the background, so they're resident by the time they're touched.
+	static void prefetch_window(uint8_t* p, size_t size)
+	{
+		if (!p)
+			return;
+
+#ifdef _WIN32
+#if defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0602)
+		WIN32_MEMORY_RANGE_ENTRY range;
+		range.VirtualAddress = p;
+		range.NumberOfBytes = size;
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+		(void)size;
+#endif
+#else
+		madvise(p, size, MADV_WILLNEED);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+#else
+	int m_fd = -1;
+#endif
+	uint64_t m_size = 0;
+	bool m_open = false;
+	bool m_writable = false;
+
+	ocl_mapped_file(const ocl_mapped_file&);
+	ocl_mapped_file& operator= (const ocl_mapped_file&);
+};
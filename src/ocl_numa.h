@@ -0,0 +1,192 @@
+// ocl_numa.h
+// Minimal host CPU topology helpers: which NUMA node/L3 cache domain the calling thread is running on, and node local host memory allocation.
+// No libnuma dependency. On platforms without support everything maps to domain 0 and allocations fall back to malloc().
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+class ocl_cpu_topology
+{
+public:
+	// If l3_domains is true, get_current_domain() returns the calling CPU's L3 cache domain index, otherwise its NUMA node.
+	// Domain indices are dense and ordered by the OS's node/cache ID's, which is the order CPU OpenCL runtimes create affinity domain sub-devices in.
+	void init(bool l3_domains)
+	{
+		m_cpu_to_node.resize(0);
+		m_cpu_to_domain.resize(0);
+		m_num_domains = 1;
+		m_l3_domains = l3_domains;
+
+#if defined(__linux__)
+		const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+		if (num_cpus <= 0)
+			return;
+
+		m_cpu_to_node.resize(num_cpus, 0);
+		m_cpu_to_domain.resize(num_cpus, 0);
+
+		std::vector<int> domain_ids(num_cpus, 0);
+
+		for (long cpu = 0; cpu < num_cpus; cpu++)
+		{
+			char path[256];
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%li", cpu);
+
+			// The CPU's directory contains a "node<n>" link for its NUMA node.
+			DIR* pDir = opendir(path);
+			if (pDir)
+			{
+				while (struct dirent* pEntry = readdir(pDir))
+				{
+					unsigned int node;
+					if (sscanf(pEntry->d_name, "node%u", &node) == 1)
+					{
+						m_cpu_to_node[cpu] = (int)node;
+						break;
+					}
+				}
+				closedir(pDir);
+			}
+
+			domain_ids[cpu] = m_cpu_to_node[cpu];
+
+			if (l3_domains)
+			{
+				snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%li/cache/index3/id", cpu);
+				FILE* pFile = fopen(path, "r");
+				if (pFile)
+				{
+					int id;
+					if (fscanf(pFile, "%i", &id) == 1)
+						domain_ids[cpu] = id;
+					fclose(pFile);
+				}
+			}
+		}
+
+		std::vector<int> unique_ids(domain_ids);
+		std::sort(unique_ids.begin(), unique_ids.end());
+		unique_ids.erase(std::unique(unique_ids.begin(), unique_ids.end()), unique_ids.end());
+
+		for (long cpu = 0; cpu < num_cpus; cpu++)
+			m_cpu_to_domain[cpu] = (int)(std::lower_bound(unique_ids.begin(), unique_ids.end(), domain_ids[cpu]) - unique_ids.begin());
+
+		m_num_domains = (uint32_t)unique_ids.size();
+#else
+		(void)l3_domains;
+#endif
+	}
+
+	uint32_t get_num_domains() const { return m_num_domains; }
+
+	uint32_t get_current_domain() const
+	{
+#ifdef _WIN32
+		if (!m_l3_domains)
+			return get_current_node();
+#endif
+		const int cpu = get_current_cpu();
+		if ((cpu < 0) || (cpu >= (int)m_cpu_to_domain.size()))
+			return 0;
+		return m_cpu_to_domain[cpu];
+	}
+
+	uint32_t get_current_node() const
+	{
+#ifdef _WIN32
+		PROCESSOR_NUMBER proc_num;
+		GetCurrentProcessorNumberEx(&proc_num);
+		USHORT node = 0;
+		if (!GetNumaProcessorNodeEx(&proc_num, &node))
+			return 0;
+		return node;
+#else
+		const int cpu = get_current_cpu();
+		if ((cpu < 0) || (cpu >= (int)m_cpu_to_node.size()))
+			return 0;
+		return m_cpu_to_node[cpu];
+#endif
+	}
+
+	// Allocates page aligned host memory whose pages live on the given NUMA node. Free it with free_on_node().
+	static void* alloc_on_node(size_t size, uint32_t node)
+	{
+		if (!size)
+			return nullptr;
+
+#ifdef _WIN32
+		return VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+#elif defined(__linux__)
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return nullptr;
+
+#ifdef SYS_mbind
+		// MPOL_PREFERRED (not MPOL_BIND), so allocation still succeeds if the node is full.
+		const int MPOL_PREFERRED_MODE = 1;
+		unsigned long node_mask[4] = { 0, 0, 0, 0 };
+		if (node < sizeof(node_mask) * 8)
+		{
+			node_mask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+			syscall(SYS_mbind, p, size, MPOL_PREFERRED_MODE, node_mask, (unsigned long)(sizeof(node_mask) * 8), 0);
+		}
+#endif
+		// Touch the pages from this thread, so even without mbind() the first touch policy places them on the caller's node.
+		memset(p, 0, size);
+		return p;
+#else
+		(void)node;
+		return calloc(size, 1);
+#endif
+	}
+
+	static void free_on_node(void* p, size_t size)
+	{
+		if (!p)
+			return;
+
+#ifdef _WIN32
+		(void)size;
+		VirtualFree(p, 0, MEM_RELEASE);
+#elif defined(__linux__)
+		munmap(p, size);
+#else
+		(void)size;
+		free(p);
+#endif
+	}
+
+private:
+	std::vector<int> m_cpu_to_node;
+	std::vector<int> m_cpu_to_domain;
+	uint32_t m_num_domains = 1;
+	bool m_l3_domains = false;
+
+	static int get_current_cpu()
+	{
+#if defined(__linux__)
+		return sched_getcpu();
+#elif defined(_WIN32)
+		return (int)GetCurrentProcessorNumber();
+#else
+		return -1;
+#endif
+	}
+};
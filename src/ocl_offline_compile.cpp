@@ -0,0 +1,147 @@
+// ocl_offline_compile.cpp
+// Build time tool: compiles a kernel source file for each of the given devices present on this machine, and writes the binaries as a C header
+// of ocl_embedded_binary entries (see simple_ocl_wrapper.h). At runtime a binary is only used on the same device and driver, with the same source.
+// Devices which can't be found or fail to compile are skipped with a warning, so the build itself never fails because of them.
+// Usage: ocl_offline_compile <kernel source file> <output header> [device name or index]...
+#define OPENCL_ASSERT_ON_ANY_ERRORS (0)
+#include "simple_ocl_wrapper.h"
+
+struct offline_binary
+{
+	uint64_t m_key;
+	std::string m_device_name;
+	std::vector<uint8_t> m_data;
+};
+
+static bool read_file(const char* pFilename, std::string& data)
+{
+	FILE* pFile = fopen(pFilename, "rb");
+	if (!pFile)
+		return false;
+
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), pFile)) > 0)
+		data.append(buf, n);
+
+	fclose(pFile);
+	return true;
+}
+
+// Only rewrites the file if its contents changed, so the build doesn't recompile dependent sources needlessly.
+static bool write_file_if_different(const char* pFilename, const std::string& data)
+{
+	std::string existing;
+	if ((read_file(pFilename, existing)) && (existing == data))
+		return true;
+
+	FILE* pFile = fopen(pFilename, "wb");
+	if (!pFile)
+		return false;
+
+	const bool success = fwrite(data.data(), 1, data.size(), pFile) == data.size();
+	return (fclose(pFile) == 0) && success;
+}
+
+static std::string make_header(const std::vector<offline_binary>& binaries)
+{
+	std::string h("// Generated by ocl_offline_compile, do not edit.\n");
+
+	char buf[256];
+
+	for (uint32_t i = 0; i < binaries.size(); i++)
+	{
+		snprintf(buf, sizeof(buf), "static const unsigned char ocl_kernel_binary_%u[] = {", i);
+		h += buf;
+
+		const std::vector<uint8_t>& data = binaries[i].m_data;
+		for (size_t j = 0; j < data.size(); j++)
+		{
+			snprintf(buf, sizeof(buf), "%s0x%02x", (j % 12) ? ", " : (j ? ",\n  " : "\n  "), data[j]);
+			h += buf;
+		}
+		h += "\n};\n";
+	}
+
+	h += "static const ocl_embedded_binary ocl_kernel_binaries[] = {\n";
+	for (uint32_t i = 0; i < binaries.size(); i++)
+	{
+		std::string name(binaries[i].m_device_name);
+		for (size_t j = 0; j < name.size(); j++)
+			if ((name[j] == '"') || (name[j] == '\\') || ((uint8_t)name[j] < 32))
+				name[j] = '_';
+
+		snprintf(buf, sizeof(buf), "  { 0x%016llxULL, \"", (unsigned long long)binaries[i].m_key);
+		h += buf;
+		h += name;
+		snprintf(buf, sizeof(buf), "\", ocl_kernel_binary_%u, sizeof(ocl_kernel_binary_%u) },\n", i, i);
+		h += buf;
+	}
+
+	// Keep the array non-empty.
+	h += "  { 0, nullptr, nullptr, 0 }\n};\n";
+
+	snprintf(buf, sizeof(buf), "static const uint32_t ocl_num_kernel_binaries = %u;\n", (uint32_t)binaries.size());
+	h += buf;
+
+	return h;
+}
+
+int main(int arg_c, char** arg_v)
+{
+	if (arg_c < 3)
+	{
+		fprintf(stderr, "Usage: ocl_offline_compile <kernel source file> <output header> [device name or index]...\n");
+		return EXIT_FAILURE;
+	}
+
+	std::string src;
+	if ((!read_file(arg_v[1], src)) || (src.empty()))
+	{
+		fprintf(stderr, "ocl_offline_compile: Failed reading kernel source file \"%s\"\n", arg_v[1]);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<offline_binary> binaries;
+
+	for (int i = 3; i < arg_c; i++)
+	{
+		ocl_init_params params;
+		params.m_pDevice_override = arg_v[i];
+
+		ocl o;
+		if (!o.init(params))
+		{
+			fprintf(stderr, "ocl_offline_compile: Warning: No usable device matches \"%s\", skipping\n", arg_v[i]);
+			continue;
+		}
+
+		offline_binary b;
+		if ((!o.init_program(src.c_str(), src.size())) || (!o.get_embeddable_program_binary(0, b.m_data, b.m_key)))
+		{
+			fprintf(stderr, "ocl_offline_compile: Warning: Failed compiling \"%s\" for device \"%s\", skipping\n", arg_v[1], arg_v[i]);
+			continue;
+		}
+
+		b.m_device_name = o.get_device_caps(0).m_device_name;
+
+		bool duplicate = false;
+		for (uint32_t j = 0; j < binaries.size(); j++)
+			if (binaries[j].m_key == b.m_key)
+				duplicate = true;
+
+		if (!duplicate)
+		{
+			printf("ocl_offline_compile: Compiled \"%s\" for \"%s\", %u bytes\n", arg_v[1], b.m_device_name.c_str(), (uint32_t)b.m_data.size());
+			binaries.push_back(b);
+		}
+	}
+
+	if (!write_file_if_different(arg_v[2], make_header(binaries)))
+	{
+		fprintf(stderr, "ocl_offline_compile: Failed writing \"%s\"\n", arg_v[2]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -3,16 +3,118 @@
 #include "ocl_device.h"
 #include <stdio.h>
 #include <vector>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
 
 int main(int arg_c, char **arg_v)
 {
+	opencl_init_params params;
+	uint32_t buf_size = 8192, bench_iterations = 0, async_depth = 0, stream_chunk_size = 0, batch_item_size = 0;
+	bool print_caps_json = false, bench_pinned = false, bench_inplace = false;
+	const char* pInput_filename = nullptr;
+	const char* pOutput_filename = nullptr;
+
+	for (int i = 1; i < arg_c; i++)
+	{
+		const bool has_value = (i + 1 < arg_c);
+
+		// "-device <index or name>" selects a specific device, otherwise the highest scoring device is used.
+		if ((strcmp(arg_v[i], "-device") == 0) && has_value)
+			params.m_pDevice_override = arg_v[++i];
+		// "-devices <n>" shards the buffer across up to n devices on the selected device's platform.
+		else if ((strcmp(arg_v[i], "-devices") == 0) && has_value)
+			params.m_max_devices = atoi(arg_v[++i]);
+		// "-cpu_sub_devices <n>" splits a CPU device into n sub-devices and shards across them.
+		else if ((strcmp(arg_v[i], "-cpu_sub_devices") == 0) && has_value)
+			params.m_cpu_sub_devices = atoi(arg_v[++i]);
+		else if ((strcmp(arg_v[i], "-size") == 0) && has_value)
+			buf_size = atoi(arg_v[++i]);
+		// "-cpu_partition numa|l3" splits a CPU device into one sub-device per NUMA node or L3 cache, and binds each context to its thread's local sub-device.
+		else if ((strcmp(arg_v[i], "-cpu_partition") == 0) && (has_value) && (strcmp(arg_v[i + 1], "numa") == 0))
+		{
+			params.m_cpu_partition = cOpenCLCPUPartitionNUMA;
+			i++;
+		}
+		else if ((strcmp(arg_v[i], "-cpu_partition") == 0) && (has_value) && (strcmp(arg_v[i + 1], "l3") == 0))
+		{
+			params.m_cpu_partition = cOpenCLCPUPartitionL3Cache;
+			i++;
+		}
+		// "-coexec" splits each buffer between the device(s) and the host's cores.
+		else if (strcmp(arg_v[i], "-coexec") == 0)
+			params.m_coexec = true;
+		// "-async_build" builds the program on a background thread, so opencl_init() returns immediately.
+		else if (strcmp(arg_v[i], "-async_build") == 0)
+			params.m_async_build = true;
+		// "-watch" rebuilds the program when ocl_kernels.cl changes (only when the source is loaded from disk).
+		else if (strcmp(arg_v[i], "-watch") == 0)
+			params.m_watch_kernel_source = true;
+		// "-binary_cache <dir>" caches compiled program binaries in dir, so later runs skip the compiler.
+		else if ((strcmp(arg_v[i], "-binary_cache") == 0) && has_value)
+			params.m_pBinary_cache_dir = arg_v[++i];
+		// "-vec_width <n>" uses kernel variants specialized for processing n bytes per work item.
+		else if ((strcmp(arg_v[i], "-vec_width") == 0) && has_value)
+			params.m_vec_width = atoi(arg_v[++i]);
+		// "-no_staging" transfers directly from/to pageable memory, instead of through pinned staging buffers on discrete GPUs.
+		else if (strcmp(arg_v[i], "-no_staging") == 0)
+			params.m_staging_buffer_size = 0;
+		// "-no_zero_copy" always copies from/to the device, even if it shares memory with the host.
+		else if (strcmp(arg_v[i], "-no_zero_copy") == 0)
+			params.m_zero_copy = false;
+		// "-pinned" runs the benchmark on buffers from opencl_alloc_pinned_buffer().
+		else if (strcmp(arg_v[i], "-pinned") == 0)
+			bench_pinned = true;
+		// "-scratch_arena <bytes>" takes small device buffers from a per-context sub-buffer arena with slabs of this size.
+		else if ((strcmp(arg_v[i], "-scratch_arena") == 0) && has_value)
+			params.m_scratch_arena_size = atoi(arg_v[++i]);
+		// "-mem_budget <bytes>" caps the engine's device memory. Free pooled buffers are evicted, least recently used first, to stay under it.
+		else if ((strcmp(arg_v[i], "-mem_budget") == 0) && has_value)
+			params.m_mem_budget = strtoull(arg_v[++i], nullptr, 10);
+		// "-file <input> <output>" streams the input file through the kernel into the output file, memory mapped one window at a time.
+		else if ((strcmp(arg_v[i], "-file") == 0) && (i + 2 < arg_c))
+		{
+			pInput_filename = arg_v[++i];
+			pOutput_filename = arg_v[++i];
+		}
+		// "-async <n>" benchmarks opencl_process_buffer_async() instead, keeping up to n requests in flight from this one thread.
+		else if ((strcmp(arg_v[i], "-async") == 0) && has_value)
+			async_depth = atoi(arg_v[++i]);
+		// "-stream <chunk bytes>" benchmarks opencl_process_buffer_stream() instead, which pipelines the buffer through the device in chunks of this size.
+		else if ((strcmp(arg_v[i], "-stream") == 0) && has_value)
+			stream_chunk_size = atoi(arg_v[++i]);
+		// "-batch <item bytes>" benchmarks opencl_process_buffer_batch() instead, with the buffer split into items of this size.
+		else if ((strcmp(arg_v[i], "-batch") == 0) && has_value)
+			batch_item_size = atoi(arg_v[++i]);
+		// "-inplace" benchmarks opencl_process_buffer_inplace(), which transforms the buffer in place.
+		else if (strcmp(arg_v[i], "-inplace") == 0)
+			bench_inplace = true;
+		// "-caps_json" prints the device capabilities as JSON.
+		else if (strcmp(arg_v[i], "-caps_json") == 0)
+			print_caps_json = true;
+		// "-bench <n>" times n extra calls to opencl_process_buffer() and prints the throughput.
+		else if ((strcmp(arg_v[i], "-bench") == 0) && has_value)
+			bench_iterations = atoi(arg_v[++i]);
+		else
+		{
+			fprintf(stderr, "Usage: simple_ocl [-device <index or name>] [-devices <n>] [-cpu_sub_devices <n>] [-cpu_partition numa|l3] [-coexec] [-async_build] [-watch] [-binary_cache <dir>] [-vec_width <n>] [-no_staging] [-no_zero_copy] [-pinned] [-inplace] [-async <n>] [-stream <chunk bytes>] [-batch <item bytes>] [-scratch_arena <bytes>] [-mem_budget <bytes>] [-file <input> <output>] [-caps_json] [-size <bytes>] [-bench <iterations>]\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (buf_size < 16)
+		buf_size = 16;
+
 	// Create the OpenCL device.
-	if (!opencl_init(false))
+	if (!opencl_init(params))
 	{
 		fprintf(stderr, "Failed initializing OpenCL!\n");
 		return EXIT_FAILURE;
 	}
 
+	if (print_caps_json)
+		printf("%s\n", opencl_get_device_caps_json());
+
 	// Create our thread-local OpenCL context. Each thread will need its own context.
 	opencl_context_ptr pContext = opencl_create_context();
 	if (!pContext)
@@ -27,7 +129,7 @@ int main(int arg_c, char **arg_v)
 	// Now create some data to process, and an output buffer.
 	printf("Running \"process_buffer\" kernel\n");
 	
-	const uint32_t BUF_SIZE = 8192;
+	const uint32_t BUF_SIZE = buf_size;
 	std::vector<uint8_t> in_buf(BUF_SIZE);
 	for (uint32_t i = 0; i < BUF_SIZE; i++)
 		in_buf[i] = (uint8_t)rand();
@@ -45,6 +147,193 @@ int main(int arg_c, char **arg_v)
 		return EXIT_FAILURE;
 	}
 
+	if (pInput_filename)
+	{
+		std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+
+		if (!opencl_process_file(pContext, pInput_filename, pOutput_filename))
+			printf("Failed processing file \"%s\"!\n", pInput_filename);
+		else
+		{
+			const double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+			printf("Processed \"%s\" into \"%s\" in %3.3f secs\n", pInput_filename, pOutput_filename, secs);
+		}
+	}
+
+	if (bench_iterations)
+	{
+		// Page aligned host buffers, which devices with host unified memory can use in place (zero copy mode).
+		uint8_t* pHost_in = static_cast<uint8_t*>(opencl_alloc_host_buffer(pContext, BUF_SIZE));
+		uint8_t* pHost_out = static_cast<uint8_t*>(opencl_alloc_host_buffer(pContext, BUF_SIZE));
+
+		const uint8_t* pBench_in = pHost_in ? pHost_in : in_buf.data();
+		uint8_t* pBench_out = pHost_out ? pHost_out : out_buf.data();
+
+		if (pHost_in)
+			memcpy(pHost_in, in_buf.data(), BUF_SIZE);
+
+		uint8_t* pPinned_in = bench_pinned ? static_cast<uint8_t*>(opencl_alloc_pinned_buffer(pContext, BUF_SIZE)) : nullptr;
+		uint8_t* pPinned_out = bench_pinned ? static_cast<uint8_t*>(opencl_alloc_pinned_buffer(pContext, BUF_SIZE)) : nullptr;
+		if ((pPinned_in) && (pPinned_out))
+		{
+			memcpy(pPinned_in, in_buf.data(), BUF_SIZE);
+			pBench_in = pPinned_in;
+			pBench_out = pPinned_out;
+			printf("Benchmarking with pinned buffers\n");
+		}
+
+		if (bench_inplace)
+		{
+			// The buffer gets transformed again by every call, which doesn't matter for timing.
+			memcpy(pBench_out, pBench_in, BUF_SIZE);
+			
+			if ((!opencl_process_buffer_inplace(pContext, pBench_out, BUF_SIZE)) || (memcmp(pBench_out, out_buf.data(), BUF_SIZE) != 0))
+				printf("In place validation failed!\n");
+			else
+				printf("In place validation succeeded\n");
+		}
+
+		if (stream_chunk_size)
+		{
+			if ((!opencl_process_buffer_stream(pContext, pBench_in, pBench_out, BUF_SIZE, stream_chunk_size)) || (memcmp(pBench_out, out_buf.data(), BUF_SIZE) != 0))
+				printf("Stream validation failed!\n");
+			else
+				printf("Stream validation succeeded\n");
+
+			// Again as if the buffer sat just under 6GB into a larger stream, at an offset that isn't chunk aligned, so every byte's offset needs all 64 bits.
+			const uint64_t stream_ofs = 0x17FFFF123ULL;
+
+			bool valid = opencl_process_buffer_stream(pContext, pBench_in, pBench_out, BUF_SIZE, stream_chunk_size, stream_ofs);
+			for (uint32_t i = 0; (valid) && (i < BUF_SIZE); i++)
+				valid = pBench_out[i] == (uint8_t)(pBench_in[i] ^ (uint8_t)(stream_ofs + i));
+
+			if (!valid)
+				printf("Stream validation at a 64-bit offset failed!\n");
+			else
+				printf("Stream validation at a 64-bit offset succeeded\n");
+		}
+
+		// Each item is processed as a buffer of its own, so the expected output restarts at every item.
+		std::vector<opencl_batch_item> batch_items;
+		for (uint32_t ofs = 0; (batch_item_size) && (ofs < BUF_SIZE); ofs += batch_item_size)
+		{
+			opencl_batch_item item;
+			item.m_pInput_buf = pBench_in + ofs;
+			item.m_pOutput_buf = pBench_out + ofs;
+			item.m_size = std::min(batch_item_size, BUF_SIZE - ofs);
+			batch_items.push_back(item);
+		}
+
+		if (batch_items.size())
+		{
+			bool valid = opencl_process_buffer_batch(pContext, batch_items.data(), (uint32_t)batch_items.size());
+			for (uint32_t ofs = 0; (valid) && (ofs < BUF_SIZE); ofs++)
+				valid = pBench_out[ofs] == (uint8_t)(pBench_in[ofs] ^ (uint8_t)(ofs % batch_item_size));
+
+			if (!valid)
+				printf("Batch validation failed!\n");
+			else
+				printf("Batch validation succeeded (%u items)\n", (uint32_t)batch_items.size());
+		}
+
+		std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+
+		if (async_depth)
+		{
+			// Each request in flight needs its own output buffer. The input is only read, so they all share it.
+			std::vector<uint8_t*> async_outputs(async_depth);
+			std::vector<opencl_request_ptr> requests(async_depth, nullptr);
+			for (uint32_t i = 0; i < async_depth; i++)
+				async_outputs[i] = static_cast<uint8_t*>(opencl_alloc_host_buffer(pContext, BUF_SIZE));
+
+			bool success = true;
+			for (uint32_t i = 0; (i < bench_iterations) && (success); i++)
+			{
+				const uint32_t slot = i % async_depth;
+				if (requests[slot])
+				{
+					success = opencl_wait_request(requests[slot]);
+					opencl_release_request(requests[slot]);
+				}
+
+				requests[slot] = success ? opencl_process_buffer_async(pContext, pBench_in, async_outputs[slot], BUF_SIZE) : nullptr;
+				if (!requests[slot])
+					success = false;
+			}
+
+			for (uint32_t i = 0; i < async_depth; i++)
+			{
+				if ((requests[i]) && (!opencl_wait_request(requests[i])))
+					success = false;
+				opencl_release_request(requests[i]);
+			}
+
+			if (!success)
+				printf("Failed running OpenCL kernel!\n");
+			else if (memcmp(async_outputs[0], out_buf.data(), BUF_SIZE) != 0)
+				printf("Async validation failed!\n");
+
+			for (uint32_t i = 0; i < async_depth; i++)
+				opencl_free_host_buffer(pContext, async_outputs[i], BUF_SIZE);
+		}
+
+		for (uint32_t i = 0; (i < bench_iterations) && (!async_depth); i++)
+		{
+			bool success;
+			if (bench_inplace)
+				success = opencl_process_buffer_inplace(pContext, pBench_out, BUF_SIZE);
+			else if (stream_chunk_size)
+				success = opencl_process_buffer_stream(pContext, pBench_in, pBench_out, BUF_SIZE, stream_chunk_size);
+			else if (batch_items.size())
+				success = opencl_process_buffer_batch(pContext, batch_items.data(), (uint32_t)batch_items.size());
+			else
+				success = opencl_process_buffer(pContext, pBench_in, pBench_out, BUF_SIZE);
+
+			if (!success)
+			{
+				printf("Failed running OpenCL kernel!\n");
+				break;
+			}
+		}
+
+		opencl_free_pinned_buffer(pContext, pPinned_in);
+		opencl_free_pinned_buffer(pContext, pPinned_out);
+
+		opencl_free_host_buffer(pContext, pHost_in, BUF_SIZE);
+		opencl_free_host_buffer(pContext, pHost_out, BUF_SIZE);
+
+		const double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+		printf("Benchmark: %u calls, %3.3f secs, %3.1f MB/sec\n", bench_iterations, secs, ((double)BUF_SIZE * bench_iterations) / (1024.0 * 1024.0 * (secs > 0.0 ? secs : 1.0)));
+
+		opencl_init_timings timings;
+		if (opencl_get_init_timings(timings))
+			printf("Init timings: device select %3.3f ms, context %3.3f ms, source load %3.3f ms, opencl_init() total %3.3f ms, program build %3.3f ms, program ready after %3.3f ms, variant builds %3.3f ms\n",
+				timings.m_device_select_secs * 1000.0, timings.m_context_create_secs * 1000.0, timings.m_kernel_source_load_secs * 1000.0, timings.m_init_secs * 1000.0,
+				timings.m_program_build_secs * 1000.0, timings.m_program_ready_secs * 1000.0, timings.m_variant_build_secs * 1000.0);
+
+		opencl_kernel_pool_stats pool_stats;
+		if (opencl_get_kernel_pool_stats(pool_stats))
+			printf("Kernel pool: %u kernels, %u in use (peak %u), %llu acquires, %llu bulk creates\n", pool_stats.m_total_kernels, pool_stats.m_kernels_in_use, pool_stats.m_peak_kernels_in_use,
+				(unsigned long long)pool_stats.m_total_acquires, (unsigned long long)pool_stats.m_total_bulk_creates);
+
+		opencl_buffer_pool_stats buffer_stats;
+		if (opencl_get_buffer_pool_stats(buffer_stats))
+			printf("Buffer pool: %llu buffers, %3.1f MB (peak %3.1f MB, %3.1f MB free, %3.1f MB cached by contexts), %llu acquires, %3.1f%% hit rate\n", (unsigned long long)buffer_stats.m_total_buffers,
+				buffer_stats.m_total_bytes / (1024.0 * 1024.0), buffer_stats.m_peak_total_bytes / (1024.0 * 1024.0), buffer_stats.m_free_bytes / (1024.0 * 1024.0), buffer_stats.m_context_cached_bytes / (1024.0 * 1024.0),
+				(unsigned long long)buffer_stats.m_total_acquires, buffer_stats.m_hit_rate * 100.0f);
+
+		opencl_mem_stats mem_stats;
+		if (opencl_get_mem_stats(mem_stats))
+			printf("Device memory: %3.1f MB allocated (peak %3.1f MB) of %3.1f MB budget, %u buffers, %u sub-buffers, %llu evictions (%3.1f MB), %llu failed allocations (%llu over budget)\n",
+				mem_stats.m_allocated_bytes / (1024.0 * 1024.0), mem_stats.m_peak_allocated_bytes / (1024.0 * 1024.0), mem_stats.m_budget / (1024.0 * 1024.0),
+				mem_stats.m_num_buffers, mem_stats.m_num_sub_buffers, (unsigned long long)mem_stats.m_total_evictions, mem_stats.m_total_evicted_bytes / (1024.0 * 1024.0),
+				(unsigned long long)mem_stats.m_total_failed_allocs, (unsigned long long)mem_stats.m_total_budget_misses);
+
+		opencl_coexec_stats coexec_stats;
+		if (opencl_get_coexec_stats(coexec_stats))
+			printf("Co-execution: device fraction %3.3f, device %3.1f MB/sec, host %3.1f MB/sec\n", coexec_stats.m_device_fraction, coexec_stats.m_device_bytes_per_sec / (1024.0 * 1024.0), coexec_stats.m_host_bytes_per_sec / (1024.0 * 1024.0));
+	}
+
 	// Check the output buffer for correctness
 	uint32_t total_failures = 0;
 	for (uint32_t i = 0; i < BUF_SIZE; i++)
@@ -4,15 +4,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <vector>
+#include <algorithm>
+#include <string>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
 #include <assert.h>
 #include <stdarg.h>
 #include <string.h>
 #include <limits.h>
+#include <ctype.h>
 
 // We only use OpenCL v1.2 or less.
 #define CL_TARGET_OPENCL_VERSION 120
 
+#include "ocl_binary_cache.h"
+#include "ocl_job_pool.h"
+
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
 #else
@@ -31,103 +43,383 @@ inline void ocl_error_printf(const char* pFmt, ...)
 #endif
 }
    	
+// A program binary compiled offline (by ocl_offline_compile) for one device. m_key is ocl::get_device_program_key() of the source, build options and device
+// it was compiled for, so a binary is only ever used on the same device/driver with the same source.
+struct ocl_embedded_binary
+{
+	uint64_t m_key;
+	const char* m_pDevice_name;
+	const unsigned char* m_pData;
+	size_t m_size;
+};
+
+struct ocl_init_params
+{
+	bool m_force_serialization = false;
+
+	// nullptr, a device table index, or a case insensitive substring of the device/platform name.
+	const char* m_pDevice_override = nullptr;
+
+	// If not nullptr/empty, built program binaries are cached in this directory and reused by later runs.
+	const char* m_pBinary_cache_dir = nullptr;
+
+	// Maximum number of devices to place in the context. Extra devices come from the primary device's platform.
+	uint32_t m_max_devices = 1;
+
+	// If >= 2 and the primary device is a CPU, partition it into this many equal sub-devices and use them as the context's devices.
+	uint32_t m_cpu_sub_devices = 0;
+
+	// If non-zero (CL_DEVICE_AFFINITY_DOMAIN_NUMA or CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE) and the primary device is a CPU, partition it into one sub-device per affinity domain.
+	// Takes precedence over m_cpu_sub_devices.
+	cl_device_affinity_domain m_cpu_affinity_domain = 0;
+
+	// Optional table of precompiled program binaries. If every device in the context has a matching binary, programs are created from them instead of being compiled.
+	const ocl_embedded_binary* m_pEmbedded_binaries = nullptr;
+	uint32_t m_num_embedded_binaries = 0;
+
+	// Device buffer pool size classes are the powers of 2 from m_buffer_pool_min_size to m_buffer_pool_max_size. Larger buffers aren't pooled. 
+	// Returning a buffer to the pool releases it instead if the pool's free buffers would exceed m_buffer_pool_max_free_bytes (0 = no limit).
+	size_t m_buffer_pool_min_size = 4096;
+	size_t m_buffer_pool_max_size = 256 * 1024 * 1024;
+	uint64_t m_buffer_pool_max_free_bytes = 512ULL * 1024 * 1024;
+
+	// Device memory budget for the buffers and images created through ocl. An allocation which would exceed it first evicts the buffer pool's least recently used free buffers,
+	// and fails (quietly, counted in ocl_mem_stats) if that isn't enough. Only the shared free list can be evicted: buffers kept elsewhere, e.g. by callers' own caches, can't. 0 = 90% of the smallest CL_DEVICE_GLOBAL_MEM_SIZE of the context's devices, UINT64_MAX = no limit.
+	uint64_t m_mem_budget = 0;
+};
+
+// Device limits and capabilities, queried once per device at init time so hot paths never need to call clGetDeviceInfo().
+struct ocl_device_caps
+{
+	std::string m_platform_name;
+	std::string m_platform_version;
+	std::string m_device_name;
+	std::string m_device_vendor;
+	std::string m_device_version;
+	std::string m_driver_version;
+	std::string m_extensions;
+
+	cl_device_type m_type = 0;
+	cl_uint m_compute_units = 0;
+	cl_uint m_clock_mhz = 0;
+	bool m_available = false;
+	bool m_compiler_available = false;
+
+	size_t m_max_work_group_size = 0;
+	cl_uint m_max_work_item_dimensions = 0;
+	size_t m_max_work_item_sizes[3] = { 0, 0, 0 };
+
+	cl_ulong m_global_mem_size = 0;
+	cl_ulong m_global_mem_cache_size = 0;
+	cl_uint m_global_mem_cacheline_size = 0;
+	cl_ulong m_local_mem_size = 0;
+	bool m_local_mem_is_dedicated = false;
+	cl_ulong m_max_mem_alloc_size = 0;
+	cl_ulong m_max_constant_buffer_size = 0;
+	cl_uint m_mem_base_addr_align = 0; // in bytes (the CL query returns bits)
+	bool m_host_unified_memory = false;
+
+	// char, short, int, long, float, double, half
+	enum { cVecChar, cVecShort, cVecInt, cVecLong, cVecFloat, cVecDouble, cVecHalf, cTotalVecTypes };
+	cl_uint m_preferred_vector_width[cTotalVecTypes] = { 0, 0, 0, 0, 0, 0, 0 };
+	cl_uint m_native_vector_width[cTotalVecTypes] = { 0, 0, 0, 0, 0, 0, 0 };
+
+	bool m_image_support = false;
+	size_t m_image2d_max_width = 0;
+	size_t m_image2d_max_height = 0;
+	size_t m_image3d_max_width = 0;
+	size_t m_image3d_max_height = 0;
+	size_t m_image3d_max_depth = 0;
+	size_t m_image_max_buffer_size = 0;
+	size_t m_image_max_array_size = 0;
+	cl_uint m_max_read_image_args = 0;
+	cl_uint m_max_write_image_args = 0;
+
+	cl_device_fp_config m_single_fp_config = 0;
+
+	bool has_extension(const char* pName) const
+	{
+		const size_t len = strlen(pName);
+		for (const char* p = strstr(m_extensions.c_str(), pName); p; p = strstr(p + 1, pName))
+		{
+			if (((p == m_extensions.c_str()) || (p[-1] == ' ')) && ((p[len] == ' ') || (p[len] == '\0')))
+				return true;
+		}
+		return false;
+	}
+
+	// Single line JSON object, for fleet inventory.
+	std::string to_json() const
+	{
+		std::string j("{");
+
+		add_json_string(j, "platform_name", m_platform_name);
+		add_json_string(j, "platform_version", m_platform_version);
+		add_json_string(j, "device_name", m_device_name);
+		add_json_string(j, "device_vendor", m_device_vendor);
+		add_json_string(j, "device_version", m_device_version);
+		add_json_string(j, "driver_version", m_driver_version);
+		add_json_string(j, "type", (m_type & CL_DEVICE_TYPE_GPU) ? "GPU" : ((m_type & CL_DEVICE_TYPE_CPU) ? "CPU" : ((m_type & CL_DEVICE_TYPE_ACCELERATOR) ? "ACCELERATOR" : "OTHER")));
+		add_json_uint(j, "compute_units", m_compute_units);
+		add_json_uint(j, "clock_mhz", m_clock_mhz);
+		add_json_bool(j, "available", m_available);
+		add_json_bool(j, "compiler_available", m_compiler_available);
+		add_json_uint(j, "max_work_group_size", m_max_work_group_size);
+		add_json_uint(j, "max_work_item_dimensions", m_max_work_item_dimensions);
+		add_json_uint_array(j, "max_work_item_sizes", m_max_work_item_sizes, 3);
+		add_json_uint(j, "global_mem_size", m_global_mem_size);
+		add_json_uint(j, "global_mem_cache_size", m_global_mem_cache_size);
+		add_json_uint(j, "global_mem_cacheline_size", m_global_mem_cacheline_size);
+		add_json_uint(j, "local_mem_size", m_local_mem_size);
+		add_json_bool(j, "local_mem_is_dedicated", m_local_mem_is_dedicated);
+		add_json_uint(j, "max_mem_alloc_size", m_max_mem_alloc_size);
+		add_json_uint(j, "max_constant_buffer_size", m_max_constant_buffer_size);
+		add_json_uint(j, "mem_base_addr_align", m_mem_base_addr_align);
+		add_json_bool(j, "host_unified_memory", m_host_unified_memory);
+		add_json_uint_array(j, "preferred_vector_width", m_preferred_vector_width, cTotalVecTypes);
+		add_json_uint_array(j, "native_vector_width", m_native_vector_width, cTotalVecTypes);
+		add_json_bool(j, "image_support", m_image_support);
+		add_json_uint(j, "image2d_max_width", m_image2d_max_width);
+		add_json_uint(j, "image2d_max_height", m_image2d_max_height);
+		add_json_uint(j, "image3d_max_width", m_image3d_max_width);
+		add_json_uint(j, "image3d_max_height", m_image3d_max_height);
+		add_json_uint(j, "image3d_max_depth", m_image3d_max_depth);
+		add_json_uint(j, "image_max_buffer_size", m_image_max_buffer_size);
+		add_json_uint(j, "image_max_array_size", m_image_max_array_size);
+		add_json_uint(j, "max_read_image_args", m_max_read_image_args);
+		add_json_uint(j, "max_write_image_args", m_max_write_image_args);
+		add_json_uint(j, "single_fp_config", m_single_fp_config);
+		add_json_string(j, "extensions", m_extensions);
+
+		j.back() = '}';
+		return j;
+	}
+
+private:
+	static void add_json_key(std::string& j, const char* pKey)
+	{
+		j += '"';
+		j += pKey;
+		j += "\":";
+	}
+
+	static void add_json_string(std::string& j, const char* pKey, const std::string& val)
+	{
+		add_json_key(j, pKey);
+		j += '"';
+		for (size_t i = 0; i < val.size(); i++)
+		{
+			const uint8_t c = (uint8_t)val[i];
+			if ((c == '"') || (c == '\\'))
+			{
+				j += '\\';
+				j += (char)c;
+			}
+			else if (c < 32)
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				j += buf;
+			}
+			else
+				j += (char)c;
+		}
+		j += "\",";
+	}
+
+	static void add_json_uint(std::string& j, const char* pKey, uint64_t val)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%llu,", (unsigned long long)val);
+		add_json_key(j, pKey);
+		j += buf;
+	}
+
+	static void add_json_bool(std::string& j, const char* pKey, bool val)
+	{
+		add_json_key(j, pKey);
+		j += val ? "true," : "false,";
+	}
+
+	template<typename T>
+	static void add_json_uint_array(std::string& j, const char* pKey, const T* pVals, uint32_t n)
+	{
+		add_json_key(j, pKey);
+		j += '[';
+		for (uint32_t i = 0; i < n; i++)
+		{
+			char buf[32];
+			snprintf(buf, sizeof(buf), (i + 1 < n) ? "%llu," : "%llu", (unsigned long long)pVals[i]);
+			j += buf;
+		}
+		j += "],";
+	}
+};
+
+// Describes one device found while enumerating every platform at init time.
+struct ocl_device_candidate
+{
+	cl_platform_id m_platform_id = nullptr;
+	cl_device_id m_device_id = nullptr;
+	uint32_t m_platform_index = 0;
+
+	ocl_device_caps m_caps;
+	bool m_usable = false;
+
+	float m_score = 0.0f;
+};
+
+// One separately compiled source file of a program. Header modules aren't compiled on their own: the other modules can #include them by m_name.
+struct ocl_program_module
+{
+	std::string m_name;
+	std::string m_src;
+	bool m_is_header = false;
+};
+
+typedef std::vector<ocl_program_module> ocl_program_module_vec;
+
+struct ocl_kernel_pool_stats
+{
+	uint32_t m_total_kernels;		// Kernels owned by the pool (free + in use)
+	uint32_t m_kernels_in_use;
+	uint32_t m_peak_kernels_in_use;
+	uint64_t m_total_acquires;
+	uint64_t m_total_bulk_creates;	// clCreateKernelsInProgram() calls
+};
+
+// A device buffer from the buffer pool. m_size is the buffer's size class, which can be larger than the size asked for.
+struct ocl_pooled_buffer
+{
+	cl_mem m_buf;
+	cl_mem_flags m_flags;
+	size_t m_size;
+};
+
+// Host memory backed by a CL_MEM_ALLOC_HOST_PTR buffer, mapped at m_pPtr until free_pinned_buffer().
+struct ocl_pinned_buffer
+{
+	cl_mem m_buf;
+	uint8_t* m_pPtr;
+	size_t m_size;
+};
+
+// A pinned buffer used as two halves for chunked transfers. m_events[i] is the pending transfer from/to half i, or nullptr.
+struct ocl_staging_buffer
+{
+	ocl_pinned_buffer m_pinned;
+	cl_event m_events[2];
+};
+
+struct ocl_buffer_pool_stats
+{
+	uint64_t m_total_bytes;			// Device memory of the pool's buffers, free or in use
+	uint64_t m_peak_total_bytes;	// High water mark of m_total_bytes
+	uint64_t m_free_bytes;			// Free buffers in the shared free list
+	uint32_t m_total_buffers;
+	uint32_t m_free_buffers;
+	uint64_t m_total_acquires;
+	uint64_t m_total_hits;			// Acquires served from the free list instead of clCreateBuffer()
+	uint64_t m_total_trimmed_bytes;	// Released by trim_buffer_pool() or because of m_buffer_pool_max_free_bytes
+};
+
+// Memory objects created through ocl. Objects wrapping host memory (CL_MEM_USE_HOST_PTR, CL_MEM_ALLOC_HOST_PTR) and sub-buffers are counted, but don't use any of the budget.
+struct ocl_mem_stats
+{
+	uint64_t m_budget;
+	uint64_t m_allocated_bytes;		// Includes the buffer pool's free buffers
+	uint64_t m_peak_allocated_bytes;
+	uint32_t m_num_buffers;
+	uint32_t m_num_images;
+	uint32_t m_num_sub_buffers;
+	uint64_t m_total_evictions;		// Free pool buffers released to stay within the budget
+	uint64_t m_total_evicted_bytes;
+	uint64_t m_total_failed_allocs;	// Over budget with nothing left to evict, or failed by the driver
+	uint64_t m_total_budget_misses;	// The part of m_total_failed_allocs refused by the budget (the caller may have retried successfully)
+};
+
 class ocl
 {
 public:
 	ocl() 
 	{
-		memset(&m_dev_fp_config, 0, sizeof(m_dev_fp_config));
-		
 		m_ocl_mutex.lock();
 		m_ocl_mutex.unlock();
 	}
 
 	~ocl()
 	{
+		deinit();
 	}
 
 	bool is_initialized() const { return m_device_id != nullptr; }
 
+	cl_platform_id get_platform_id() const { return m_platform_id; }
 	cl_device_id get_device_id() const { return m_device_id; }
 	cl_context get_context() const { return m_context; }
 	cl_command_queue get_command_queue() { return m_command_queue; }
 	cl_program get_program() const { return m_program; }
 
-	bool init(bool force_serialization)
+	bool init(bool force_serialization, const char* pDevice_override = nullptr)
+	{
+		ocl_init_params params;
+		params.m_force_serialization = force_serialization;
+		params.m_pDevice_override = pDevice_override;
+		return init(params);
+	}
+
+	bool init(const ocl_init_params& params)
 	{
 		deinit();
 
-		cl_uint num_platforms = 0;
-		cl_int ret = clGetPlatformIDs(0, NULL, &num_platforms);
-		if (ret != CL_SUCCESS)
-		{
-			ocl_error_printf("ocl::init: clGetPlatformIDs() failed with %i\n", ret);
-			return false;
-		}
+		const std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
 
-		if ((!num_platforms) || (num_platforms > INT_MAX))
-		{
-			ocl_error_printf("ocl::init: clGetPlatformIDs() returned an invalid number of num_platforms\n");
+		std::vector<ocl_device_candidate> candidates;
+		if (!enumerate_devices(candidates))
 			return false;
-		}
-
-		std::vector<cl_platform_id> platforms(num_platforms);
 
-		ret = clGetPlatformIDs(num_platforms, platforms.data(), NULL);
-		if (ret != CL_SUCCESS)
-		{
-			ocl_error_printf("ocl::init: clGetPlatformIDs() failed\n");
-			return false;
-		}
+		int best_index = select_device(candidates, params.m_pDevice_override);
 
-		cl_uint num_devices = 0;
-		ret = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 1, &m_device_id, &num_devices);
+		print_device_table(candidates, best_index);
 
-		if (ret == CL_DEVICE_NOT_FOUND)
+		if (best_index < 0)
 		{
-			ocl_error_printf("ocl::init: Couldn't get any GPU device ID's, trying CL_DEVICE_TYPE_CPU\n");
-
-			ret = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_CPU, 1, &m_device_id, &num_devices);
+			ocl_error_printf("ocl::init: Unable to find a usable device\n");
+			return false;
 		}
 
-		if (ret != CL_SUCCESS)
-		{
-			ocl_error_printf("ocl::init: Unable to get any device ID's\n");
+		const ocl_device_candidate& best = candidates[best_index];
 
-			m_device_id = nullptr;
-			return false;
-		}
+		m_platform_id = best.m_platform_id;
 
-		ret = clGetDeviceInfo(m_device_id,
-			CL_DEVICE_SINGLE_FP_CONFIG,
-			sizeof(m_dev_fp_config),
-			&m_dev_fp_config,
-			nullptr);
-		if (ret != CL_SUCCESS)
+		if (!select_context_devices(candidates, best_index, params))
 		{
-			ocl_error_printf("ocl::init: clGetDeviceInfo() failed\n");
+			deinit();
 			return false;
 		}
 
-		char plat_vers[256] = { 0 };
+		m_device_id = m_device_ids[0];
 
-		size_t rv = 0;
-		ret = clGetPlatformInfo(platforms[0], CL_PLATFORM_VERSION, sizeof(plat_vers), plat_vers, &rv);
-		if (ret == CL_SUCCESS)
-			printf("OpenCL platform version: \"%s\"\n", plat_vers);
+		printf("OpenCL platform version: \"%s\"\n", best.m_caps.m_platform_version.c_str());
+		printf("OpenCL device: \"%s\", driver version: \"%s\"\n", best.m_caps.m_device_name.c_str(), best.m_caps.m_driver_version.c_str());
+		printf("OpenCL devices in context: %u\n", (uint32_t)m_device_ids.size());
 
 		// Serialize CL calls with the AMD driver to avoid lockups when multiple command queues per thread are used. This sucks, but what can we do?
-		m_use_mutex = (strstr(plat_vers, "AMD") != nullptr) || force_serialization;
+		m_use_mutex = (strstr(best.m_caps.m_platform_version.c_str(), "AMD") != nullptr) || params.m_force_serialization;
 
 		printf("Serializing OpenCL calls across threads: %u\n", (uint32_t)m_use_mutex);
 
-		m_context = clCreateContext(nullptr, 1, &m_device_id, nullptr, nullptr, &ret);
+		const std::chrono::high_resolution_clock::time_point context_start_time = std::chrono::high_resolution_clock::now();
+		m_device_select_secs = std::chrono::duration<double>(context_start_time - start_time).count();
+
+		cl_int ret;
+		m_context = clCreateContext(nullptr, (cl_uint)m_device_ids.size(), m_device_ids.data(), nullptr, nullptr, &ret);
 		if (ret != CL_SUCCESS)
 		{
 			ocl_error_printf("ocl::init: clCreateContext() failed\n");
 
-			m_device_id = nullptr;
 			m_context = nullptr;
+			deinit();
 			return false;
 		}
 
@@ -140,6 +432,32 @@ public:
 			return false;
 		}
 					
+		m_context_create_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - context_start_time).count();
+
+		m_binary_cache.set_dir(params.m_pBinary_cache_dir);
+
+		m_pEmbedded_binaries = params.m_pEmbedded_binaries;
+		m_num_embedded_binaries = params.m_pEmbedded_binaries ? params.m_num_embedded_binaries : 0;
+
+		m_buffer_pool_min_size = 1;
+		while (m_buffer_pool_min_size < params.m_buffer_pool_min_size)
+			m_buffer_pool_min_size <<= 1;
+		m_buffer_pool_max_size = params.m_buffer_pool_max_size;
+		m_buffer_pool_max_free_bytes = params.m_buffer_pool_max_free_bytes;
+
+		uint64_t mem_budget = params.m_mem_budget;
+		if (!mem_budget)
+		{
+			mem_budget = UINT64_MAX;
+			for (uint32_t i = 0; i < m_device_caps.size(); i++)
+				if (m_device_caps[i].m_global_mem_size)
+					mem_budget = std::min<uint64_t>(mem_budget, m_device_caps[i].m_global_mem_size / 10 * 9);
+		}
+		m_mem_stats.m_budget = mem_budget;
+
+		if (m_binary_cache.is_enabled())
+			printf("OpenCL program binary cache directory: \"%s\"\n", m_binary_cache.get_dir().c_str());
+
 		printf("OpenCL device initialized successfully\n");
 
 		return true;
@@ -147,11 +465,34 @@ public:
 			
 	bool deinit()
 	{
+		if (m_build_thread.joinable())
+			m_build_thread.join();
+
+		m_build_job_pool.deinit();
+
+		release_kernel_pool();
+		m_kernel_pool_bulk_creates = 0;
+		m_kernel_pool_peak_kernels_in_use = 0;
+
+		m_program_state = cProgramNone;
+
+		release_program_variants();
+
 		if (m_program)
 		{
 			clReleaseProgram(m_program);
 			m_program = nullptr;
 		}
+		m_program_modules.clear();
+
+		for (uint32_t i = 0; i < m_compiled_modules.size(); i++)
+			clReleaseProgram(m_compiled_modules[i].m_program);
+		m_compiled_modules.resize(0);
+
+		release_buffer_pool();
+
+		m_mem_objects.clear();
+		memset(&m_mem_stats, 0, sizeof(m_mem_stats));
 
 		if (m_command_queue)
 		{
@@ -165,17 +506,42 @@ public:
 			m_context = nullptr;
 		}
 
+		for (uint32_t i = 0; i < m_sub_device_ids.size(); i++)
+			clReleaseDevice(m_sub_device_ids[i]);
+		m_sub_device_ids.resize(0);
+
+		m_device_ids.resize(0);
+		m_device_scores.resize(0);
+		m_device_caps.resize(0);
+		m_affinity_domain = 0;
+
 		m_device_id = nullptr;
+		m_platform_id = nullptr;
 
 		return true;
 	}
 
-	cl_command_queue create_command_queue()
+	// Devices in the context. Device 0 is the primary (highest scoring) device, and there's more than 1 only in multi-device mode.
+	uint32_t get_num_devices() const { return (uint32_t)m_device_ids.size(); }
+	cl_device_id get_device_id(uint32_t device_index) const { return m_device_ids[device_index]; }
+	float get_device_score(uint32_t device_index) const { return m_device_scores[device_index]; }
+	const ocl_device_caps& get_device_caps(uint32_t device_index = 0) const { return m_device_caps[device_index]; }
+
+	// Non-zero if the context's devices are the affinity domain sub-devices of a CPU device, in domain order.
+	cl_device_affinity_domain get_affinity_domain() const { return m_affinity_domain; }
+
+	cl_command_queue create_command_queue(uint32_t device_index = 0)
 	{
+		if (device_index >= m_device_ids.size())
+		{
+			assert(0);
+			return nullptr;
+		}
+
 		cl_serializer serializer(this);
 
 		cl_int ret = 0;
-		cl_command_queue p = clCreateCommandQueue(m_context, m_device_id, 0, &ret);
+		cl_command_queue p = clCreateCommandQueue(m_context, m_device_ids[device_index], 0, &ret);
 		if (ret != CL_SUCCESS)
 			return nullptr;
 
@@ -192,370 +558,1871 @@ public:
 		}
 	}
 
-	bool init_program(const char* pSrc, size_t src_size)
+	typedef void (*program_built_callback)(bool success, void* pUser_data);
+
+	// Builds the program on a background thread and returns immediately. pCallback (optional) is called from the build thread when the build finishes.
+	// Use wait_for_program() before creating kernels.
+	bool init_program_async(const char* pSrc, size_t src_size, program_built_callback pCallback = nullptr, void* pCallback_data = nullptr)
 	{
-		cl_int ret;
+		return init_program_async(make_single_module(pSrc, src_size), pCallback, pCallback_data);
+	}
 
-		if (m_program != nullptr)
-		{
-			clReleaseProgram(m_program);
-			m_program = nullptr;
-		}
+	bool init_program_async(const ocl_program_module_vec& modules, program_built_callback pCallback = nullptr, void* pCallback_data = nullptr)
+	{
+		if (m_build_thread.joinable())
+			m_build_thread.join();
 
-		m_program = clCreateProgramWithSource(m_context, 1, (const char**)&pSrc, (const size_t*)&src_size, &ret);
-		if (ret != CL_SUCCESS)
 		{
-			ocl_error_printf("ocl::init_program: clCreateProgramWithSource() failed!\n");
-			return false;
+			std::lock_guard<std::mutex> lock(m_program_mutex);
+			m_program_state = cProgramBuilding;
 		}
 
-		std::string options;
-		if (m_dev_fp_config & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT)
+		m_build_thread = std::thread([this, modules, pCallback, pCallback_data]
 		{
-			options += "-cl-fp32-correctly-rounded-divide-sqrt";
-		}
+			const bool success = build_program(modules, true);
+			if (!success)
+				set_program_failed();
 
-		options += " -cl-std=CL1.2";
-		//options += " -cl-opt-disable";
-		//options += " -cl-mad-enable";
-		//options += " -cl-fast-relaxed-math";
+			if (pCallback)
+				pCallback(success, pCallback_data);
+		});
 
-		ret = clBuildProgram(m_program, 1, &m_device_id,
-			options.size() ? options.c_str() : nullptr,  // options
-			nullptr,  // notify
-			nullptr); // user_data
+		return true;
+	}
 
-		if (ret != CL_SUCCESS)
-		{
-			const cl_int build_program_result = ret;
+	bool init_program(const char* pSrc, size_t src_size)
+	{
+		return init_program(make_single_module(pSrc, src_size));
+	}
 
-			size_t ret_val_size;
-			ret = clGetProgramBuildInfo(m_program, m_device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &ret_val_size);
-			if (ret != CL_SUCCESS)
-			{
-				ocl_error_printf("ocl::init_program: clGetProgramBuildInfo() failed!\n");
-				return false;
-			}
+	// With more than one module (or any header modules), each module is compiled separately with clCompileProgram() and the results linked with clLinkProgram().
+	// Compiled modules are cached in memory, keyed by their source, the headers and build options, so a rebuild only recompiles the modules that changed.
+	bool init_program(const ocl_program_module_vec& modules)
+	{
+		const bool success = build_program(modules, true);
+		if (!success)
+			set_program_failed();
 
-			std::vector<char> build_log(ret_val_size + 1);
+		return success;
+	}
 
-			ret = clGetProgramBuildInfo(m_program, m_device_id, CL_PROGRAM_BUILD_LOG, ret_val_size, build_log.data(), NULL);
+	// Builds a new program without disturbing the current one, then atomically swaps it in. On failure the current program stays.
+	// Kernels created from the old program keep it alive, so work using them finishes normally. get_program_generation() changes on every swap,
+	// which tells callers to recreate their kernels. Command queues aren't affected.
+	bool rebuild_program(const char* pSrc, size_t src_size)
+	{
+		return rebuild_program(make_single_module(pSrc, src_size));
+	}
+
+	bool rebuild_program(const ocl_program_module_vec& modules)
+	{
+		// Don't race the initial (possibly async) build.
+		wait_for_program();
 
-			ocl_error_printf("\nclBuildProgram() failed with error %i:\n%s", build_program_result, build_log.data());
+		return build_program(modules, false);
+	}
+
+	// Returns the current program's binary for one device, and the key it should be embedded under (see ocl_embedded_binary). Used by the offline compiler.
+	bool get_embeddable_program_binary(uint32_t device_index, std::vector<uint8_t>& binary, uint64_t& key)
+	{
+		std::lock_guard<std::mutex> lock(m_program_mutex);
 
+		if ((!m_program) || (!is_single_module(m_program_modules)) || (device_index >= m_device_ids.size()))
 			return false;
+
+		std::vector< std::vector<uint8_t> > binaries;
+		{
+			cl_serializer serializer(this);
+			if (!get_program_binaries(m_program, binaries))
+				return false;
 		}
 
+		binary.swap(binaries[device_index]);
+		key = get_device_program_key(m_program_modules[0].m_src.c_str(), m_program_modules[0].m_src.size(), get_build_options(), device_index);
 		return true;
 	}
 
-	cl_kernel create_kernel(const char* pName)
+	uint32_t get_num_compiled_modules()
 	{
-		if (!m_program)
-			return nullptr;
-
-		cl_serializer serializer(this);
+		std::lock_guard<std::mutex> lock(m_module_mutex);
+		return (uint32_t)m_compiled_modules.size();
+	}
 
-		cl_int ret;
-		cl_kernel kernel = clCreateKernel(m_program, pName, &ret);
-		if (ret != CL_SUCCESS)
-		{
-			ocl_error_printf("ocl::create_kernel: clCreateKernel() failed!\n");
-			return nullptr;
-		}
+	// Incremented each time a new program is swapped in. Cheap enough to check on every dispatch.
+	uint32_t get_program_generation() const { return m_program_generation.load(std::memory_order_acquire); }
 
-		return kernel;
+	// Doesn't block.
+	bool is_program_ready()
+	{
+		std::lock_guard<std::mutex> lock(m_program_mutex);
+		return m_program_state == cProgramReady;
 	}
 
-	bool destroy_kernel(cl_kernel k)
+	// Blocks only while a background build is in progress. Returns true if the program was built successfully.
+	bool wait_for_program()
 	{
-		if (k)
-		{
-			cl_serializer serializer(this);
+		std::unique_lock<std::mutex> lock(m_program_mutex);
+		m_program_cv.wait(lock, [this] { return m_program_state != cProgramBuilding; });
+		return m_program_state == cProgramReady;
+	}
 
-			cl_int ret = clReleaseKernel(k);
-			if (ret != CL_SUCCESS)
-			{
-				ocl_error_printf("ocl::destroy_kernel: clReleaseKernel() failed!\n");
-				return false;
-			}
-		}
-		return true;
+	// Timings of the last init() and its program build, in seconds. The build time is written before the program becomes ready, so read it after is_program_ready().
+	double get_device_select_secs() const { return m_device_select_secs; }
+	double get_context_create_secs() const { return m_context_create_secs; }
+	double get_program_build_secs() const { return m_program_build_secs; }
+
+	// Build time of the last rebuild_program(), which may run on another thread (e.g. a file watcher).
+	double get_program_rebuild_secs() const { return m_program_rebuild_secs.load(std::memory_order_relaxed); }
+
+private:
+	static ocl_program_module_vec make_single_module(const char* pSrc, size_t src_size)
+	{
+		ocl_program_module_vec modules(1);
+		modules[0].m_src.assign(pSrc, src_size);
+		return modules;
 	}
 
-	cl_mem alloc_read_buffer(size_t size)
+	static bool is_single_module(const ocl_program_module_vec& modules)
 	{
-		cl_serializer serializer(this);
+		return (modules.size() == 1) && (!modules[0].m_is_header);
+	}
 
-		cl_int ret;
-		cl_mem obj = clCreateBuffer(m_context, CL_MEM_READ_ONLY, size, NULL, &ret);
-		if (ret != CL_SUCCESS)
-		{
-			ocl_error_printf("ocl::alloc_read_buffer: clCreateBuffer() failed!\n");
-			return nullptr;
-		}
+	// Single source programs go through clBuildProgram(), anything else is compiled and linked per module.
+	cl_program create_program(const ocl_program_module_vec& modules, const std::string& options, bool prune_compiled_modules)
+	{
+		if (is_single_module(modules))
+			return create_and_build_program(modules[0].m_src.c_str(), modules[0].m_src.size(), options);
 
-		return obj;
+		return create_and_link_program(modules, options, prune_compiled_modules);
 	}
 
-	cl_mem alloc_and_init_read_buffer(cl_command_queue command_queue, const void *pInit, size_t size)
+	// initial is true for the init_program()/init_program_async() build, whose time is reported separately from later rebuilds.
+	bool build_program(const ocl_program_module_vec& modules, bool initial)
 	{
-		cl_serializer serializer(this);
+		const std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+		
+		cl_program program = create_program(modules, get_build_options(), true);
+		
+		const double build_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+		if (initial)
+			m_program_build_secs = build_secs;
+		else
+			m_program_rebuild_secs.store(build_secs, std::memory_order_relaxed);
 
-		cl_int ret;
-		cl_mem obj = clCreateBuffer(m_context, CL_MEM_READ_ONLY, size, NULL, &ret);
-		if (ret != CL_SUCCESS)
+		if (!program)
+			return false;
+
+		swap_program(program, ocl_program_module_vec(modules));
+		return true;
+	}
+
+	void swap_program(cl_program new_program, ocl_program_module_vec&& modules)
+	{
+		cl_program old_program;
 		{
-			ocl_error_printf("ocl::alloc_and_init_read_buffer: clCreateBuffer() failed!\n");
-			return nullptr;
+			std::lock_guard<std::mutex> lock(m_program_mutex);
+			old_program = m_program;
+			m_program = new_program;
+			m_program_modules.swap(modules);
+			m_program_state = cProgramReady;
+			m_program_generation.fetch_add(1, std::memory_order_release);
 		}
+		m_program_cv.notify_all();
 
-		ret = clEnqueueWriteBuffer(command_queue, obj, CL_TRUE, 0, size, pInit, 0, NULL, NULL);
-		if (ret != CL_SUCCESS)
+		if (old_program)
 		{
-			ocl_error_printf("ocl::alloc_and_init_read_buffer: clEnqueueWriteBuffer() failed!\n");
-			return nullptr;
+			cl_serializer serializer(this);
+			clReleaseProgram(old_program);
 		}
+	}
 
-		return obj;
+	void set_program_failed()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_program_mutex);
+			m_program_state = cProgramFailed;
+		}
+		m_program_cv.notify_all();
 	}
 
-	cl_mem alloc_write_buffer(size_t size)
+	std::string get_build_options() const
 	{
-		cl_serializer serializer(this);
+		std::string options;
+		// All devices in the context build with the same options, so only use this if every device supports it.
+		bool correctly_rounded_divide_sqrt = true;
+		for (uint32_t i = 0; i < m_device_caps.size(); i++)
+			if (!(m_device_caps[i].m_single_fp_config & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT))
+				correctly_rounded_divide_sqrt = false;
+
+		if (correctly_rounded_divide_sqrt)
+		{
+			options += "-cl-fp32-correctly-rounded-divide-sqrt";
+		}
+
+		options += " -cl-std=CL1.2";
+		//options += " -cl-opt-disable";
+		//options += " -cl-mad-enable";
+		//options += " -cl-fast-relaxed-math";
+
+		return options;
+	}
+
+	// Builds a program for every device in the context, loading it from the binary cache if possible. Returns nullptr on failure.
+	// Builds may run on background threads (async init, rebuilds, variants), so they're serialized with the other driver calls like everything else.
+	cl_program create_and_build_program(const char* pSrc, size_t src_size, const std::string& options)
+	{
+		cl_serializer serializer(this);
+
+		if (m_num_embedded_binaries)
+		{
+			cl_program program = load_embedded_program(pSrc, src_size, options);
+			if (program)
+			{
+				printf("Using embedded OpenCL program binaries\n");
+				return program;
+			}
+		}
+
+		uint64_t cache_key = 0;
+		if (m_binary_cache.is_enabled())
+		{
+			cache_key = get_program_cache_key(pSrc, src_size, options);
+
+			cl_program program = load_cached_program(cache_key, options);
+			if (program)
+			{
+				printf("Loaded OpenCL program binary %016llx from cache\n", (unsigned long long)cache_key);
+				return program;
+			}
+		}
 
 		cl_int ret;
-		cl_mem obj = clCreateBuffer(m_context, CL_MEM_WRITE_ONLY, size, NULL, &ret);
+		cl_program program = clCreateProgramWithSource(m_context, 1, (const char**)&pSrc, (const size_t*)&src_size, &ret);
 		if (ret != CL_SUCCESS)
 		{
-			ocl_error_printf("ocl::alloc_write_buffer: clCreateBuffer() failed!\n");
+			ocl_error_printf("ocl::init_program: clCreateProgramWithSource() failed!\n");
 			return nullptr;
 		}
 
-		return obj;
+		ret = clBuildProgram(program, (cl_uint)m_device_ids.size(), m_device_ids.data(),
+			options.size() ? options.c_str() : nullptr,  // options
+			nullptr,  // notify
+			nullptr); // user_data
+
+		if (ret != CL_SUCCESS)
+		{
+			print_build_log(program, ret, "clBuildProgram()");
+
+			clReleaseProgram(program);
+			return nullptr;
+		}
+
+		if (m_binary_cache.is_enabled())
+		{
+			if (store_cached_program(cache_key, program))
+				printf("Stored OpenCL program binary %016llx in cache\n", (unsigned long long)cache_key);
+		}
+
+		return program;
 	}
-			
-	bool destroy_buffer(cl_mem buf)
+
+	void print_build_log(cl_program program, cl_int build_result, const char* pWhat)
 	{
-		if (buf)
+		for (uint32_t i = 0; i < m_device_ids.size(); i++)
 		{
-			cl_serializer serializer(this);
-
-			cl_int ret = clReleaseMemObject(buf);
+			size_t ret_val_size;
+			cl_int ret = clGetProgramBuildInfo(program, m_device_ids[i], CL_PROGRAM_BUILD_LOG, 0, NULL, &ret_val_size);
 			if (ret != CL_SUCCESS)
 			{
-				ocl_error_printf("ocl::destroy_buffer: clReleaseMemObject() failed!\n");
-				return false;
+				ocl_error_printf("ocl::init_program: clGetProgramBuildInfo() failed!\n");
+				break;
 			}
-		}
 
-		return true;
+			std::vector<char> build_log(ret_val_size + 1);
+
+			ret = clGetProgramBuildInfo(program, m_device_ids[i], CL_PROGRAM_BUILD_LOG, ret_val_size, build_log.data(), NULL);
+
+			ocl_error_printf("\n%s failed with error %i on device %u:\n%s", pWhat, build_result, i, build_log.data());
+		}
 	}
 
-	bool write_to_buffer(cl_command_queue command_queue, cl_mem clmem, const void* d, const size_t m)
+	// Compiles each (non-header) module with clCompileProgram(), reusing compiled modules from earlier builds, then links them. The linked program also goes through the binary cache.
+	// If prune_compiled_modules is true, compiled modules this program doesn't use are released afterwards, so the cache only holds the current program's modules (plus variants built since).
+	cl_program create_and_link_program(const ocl_program_module_vec& modules, const std::string& options, bool prune_compiled_modules)
 	{
-		cl_serializer serializer(this);
+		std::lock_guard<std::mutex> lock(m_module_mutex);
 
-		cl_int ret = clEnqueueWriteBuffer(command_queue, clmem, CL_TRUE, 0, m, d, 0, NULL, NULL);
-		if (ret != CL_SUCCESS)
+		// Every module sees every header, so a header change recompiles all modules.
+		uint64_t headers_hash = ocl_binary_cache::cFNVOffset64;
+		std::vector<const char*> header_names;
+		for (uint32_t i = 0; i < modules.size(); i++)
 		{
-			ocl_error_printf("ocl::write_to_buffer: clEnqueueWriteBuffer() failed!\n");
-			return false;
+			if (modules[i].m_is_header)
+			{
+				headers_hash = ocl_binary_cache::hash(modules[i].m_name, headers_hash);
+				headers_hash = ocl_binary_cache::hash(modules[i].m_src, headers_hash);
+				header_names.push_back(modules[i].m_name.c_str());
+			}
 		}
 
-		return true;
-	}
+		// Header programs are only created if something needs compiling.
+		std::vector<cl_program> header_programs;
 
-	bool read_from_buffer(cl_command_queue command_queue, const cl_mem clmem, void* d, size_t m)
-	{
-		cl_serializer serializer(this);
+		std::vector<cl_program> objects;
+		std::vector<uint64_t> object_keys;
+		std::vector<uint32_t> compile_modules, compile_slots;
+		uint64_t link_key = ocl_binary_cache::hash(options, ocl_binary_cache::cFNVOffset64);
+		bool success = true;
 
-		cl_int ret = clEnqueueReadBuffer(command_queue, clmem, CL_TRUE, 0, m, d, 0, NULL, NULL);
-		if (ret != CL_SUCCESS)
+		for (uint32_t i = 0; i < modules.size(); i++)
 		{
-			ocl_error_printf("ocl::read_from_buffer: clEnqueueReadBuffer() failed!\n");
-			return false;
+			const ocl_program_module& module = modules[i];
+			if (module.m_is_header)
+				continue;
+
+			uint64_t key = get_program_cache_key(module.m_src.c_str(), module.m_src.size(), options);
+			key = ocl_binary_cache::hash(module.m_name, key);
+			key = ocl_binary_cache::hash(&headers_hash, sizeof(headers_hash), key);
+
+			link_key = ocl_binary_cache::hash(&key, sizeof(key), link_key);
+
+			cl_program object = find_compiled_module(key);
+			if (!object)
+			{
+				compile_modules.push_back(i);
+				compile_slots.push_back((uint32_t)objects.size());
+			}
+
+			object_keys.push_back(key);
+			objects.push_back(object);
 		}
 
-		return true;
-	}
+		const uint32_t num_compiled = (uint32_t)compile_modules.size();
 
-	cl_mem create_read_image_u8(uint32_t width, uint32_t height, const void* pPixels, uint32_t bytes_per_pixel, bool normalized)
-	{
-		cl_image_format fmt = get_image_format(bytes_per_pixel, normalized);
+		if ((num_compiled) && (header_names.size()))
+		{
+			cl_serializer serializer(this);
 
-		cl_image_desc desc;
-		memset(&desc, 0, sizeof(desc));
-		desc.image_type = CL_MEM_OBJECT_IMAGE2D;
-		desc.image_width = width;
-		desc.image_height = height;
-		desc.image_row_pitch = width * bytes_per_pixel;
+			for (uint32_t j = 0; j < modules.size(); j++)
+			{
+				if (!modules[j].m_is_header)
+					continue;
+
+				const char* pHeader_src = modules[j].m_src.c_str();
+				const size_t header_size = modules[j].m_src.size();
+
+				cl_int ret;
+				cl_program header = clCreateProgramWithSource(m_context, 1, &pHeader_src, &header_size, &ret);
+				if (ret != CL_SUCCESS)
+				{
+					ocl_error_printf("ocl::create_and_link_program: clCreateProgramWithSource() failed!\n");
+					success = false;
+					break;
+				}
+				header_programs.push_back(header);
+			}
+		}
+
+		if ((num_compiled) && (success))
+		{
+			// The modules are independent until the link, so compile them all at once. Each compile_module() call serializes itself, so the serializer isn't held here.
+			run_parallel_builds(num_compiled, [&](uint32_t i)
+			{
+				objects[compile_slots[i]] = compile_module(modules[compile_modules[i]], options, header_programs, header_names);
+			});
+
+			for (uint32_t i = 0; i < num_compiled; i++)
+			{
+				const uint32_t slot = compile_slots[i];
+				if (!objects[slot])
+				{
+					success = false;
+					continue;
+				}
+
+				compiled_module cm;
+				cm.m_key = object_keys[slot];
+				cm.m_program = objects[slot];
+				m_compiled_modules.push_back(cm);
+			}
+		}
 
 		cl_serializer serializer(this);
 
-		cl_int ret;
-		cl_mem img = clCreateImage(m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &fmt, &desc, (void*)pPixels, &ret);
-		if (ret != CL_SUCCESS)
-		{
-			ocl_error_printf("ocl::create_read_image_u8: clCreateImage() failed!\n");
+		for (uint32_t i = 0; i < header_programs.size(); i++)
+			clReleaseProgram(header_programs[i]);
+
+		if ((!success) || (objects.empty()))
 			return nullptr;
+
+		if (num_compiled)
+			printf("Compiled %u of %u OpenCL program modules\n", num_compiled, (uint32_t)objects.size());
+
+		cl_program program = nullptr;
+
+		if (m_binary_cache.is_enabled())
+		{
+			link_key = ocl_binary_cache::hash("linked", 6, link_key);
+
+			program = load_cached_program(link_key, options);
+			if (program)
+				printf("Loaded OpenCL program binary %016llx from cache\n", (unsigned long long)link_key);
 		}
 
-		return img;
+		if (!program)
+		{
+			// Compile options (-cl-std, -D etc.) aren't valid link options.
+			cl_int ret;
+			program = clLinkProgram(m_context, (cl_uint)m_device_ids.size(), m_device_ids.data(), nullptr, (cl_uint)objects.size(), objects.data(), nullptr, nullptr, &ret);
+			if (ret != CL_SUCCESS)
+			{
+				if (program)
+				{
+					print_build_log(program, ret, "clLinkProgram()");
+					clReleaseProgram(program);
+				}
+				else
+					ocl_error_printf("ocl::create_and_link_program: clLinkProgram() failed with error %i\n", ret);
+
+				return nullptr;
+			}
+
+			if (m_binary_cache.is_enabled())
+			{
+				if (store_cached_program(link_key, program))
+					printf("Stored OpenCL program binary %016llx in cache\n", (unsigned long long)link_key);
+			}
+		}
+
+		if (prune_compiled_modules)
+		{
+			for (uint32_t i = 0; i < m_compiled_modules.size(); )
+			{
+				if (std::find(object_keys.begin(), object_keys.end(), m_compiled_modules[i].m_key) == object_keys.end())
+				{
+					clReleaseProgram(m_compiled_modules[i].m_program);
+					m_compiled_modules.erase(m_compiled_modules.begin() + i);
+				}
+				else
+					i++;
+			}
+		}
+
+		return program;
 	}
 
-	cl_mem create_write_image_u8(uint32_t width, uint32_t height, uint32_t bytes_per_pixel, bool normalized)
+	cl_program compile_module(const ocl_program_module& module, const std::string& options, const std::vector<cl_program>& header_programs, const std::vector<const char*>& header_names)
 	{
-		cl_image_format fmt = get_image_format(bytes_per_pixel, normalized);
-
-		cl_image_desc desc;
-		memset(&desc, 0, sizeof(desc));
-		desc.image_type = CL_MEM_OBJECT_IMAGE2D;
-		desc.image_width = width;
-		desc.image_height = height;
+		const char* pSrc = module.m_src.c_str();
+		const size_t src_size = module.m_src.size();
 
 		cl_serializer serializer(this);
 
 		cl_int ret;
-		cl_mem img = clCreateImage(m_context, CL_MEM_WRITE_ONLY, &fmt, &desc, nullptr, &ret);
+		cl_program object = clCreateProgramWithSource(m_context, 1, &pSrc, &src_size, &ret);
 		if (ret != CL_SUCCESS)
 		{
-			ocl_error_printf("ocl::create_write_image_u8: clCreateImage() failed!\n");
+			ocl_error_printf("ocl::compile_module: clCreateProgramWithSource() failed!\n");
 			return nullptr;
 		}
 
-		return img;
+		ret = clCompileProgram(object, (cl_uint)m_device_ids.size(), m_device_ids.data(), options.size() ? options.c_str() : nullptr,
+			(cl_uint)header_programs.size(), header_programs.size() ? header_programs.data() : nullptr, header_names.size() ? (const char**)header_names.data() : nullptr, nullptr, nullptr);
+
+		if (ret != CL_SUCCESS)
+		{
+			std::string what("clCompileProgram() of module \"" + module.m_name + "\"");
+			print_build_log(object, ret, what.c_str());
+
+			clReleaseProgram(object);
+			return nullptr;
+		}
+
+		return object;
 	}
 
-	bool read_from_image(cl_command_queue command_queue, cl_mem img, void* pPixels, uint32_t ofs_x, uint32_t ofs_y, uint32_t width, uint32_t height)
+	// Called with m_module_mutex held.
+	cl_program find_compiled_module(uint64_t key) const
 	{
-		cl_serializer serializer(this);
+		for (uint32_t i = 0; i < m_compiled_modules.size(); i++)
+			if (m_compiled_modules[i].m_key == key)
+				return m_compiled_modules[i].m_program;
+		return nullptr;
+	}
 
-		size_t origin[3] = { ofs_x, ofs_y, 0 }, region[3] = { width, height, 1 };
+	// The key covers everything that affects the compiled binary: the source, build options, and the exact device/driver/platform versions.
+	uint64_t get_program_cache_key(const char* pSrc, size_t src_size, const std::string& options) const
+	{
+		uint64_t h = ocl_binary_cache::hash(pSrc, src_size);
+		h = ocl_binary_cache::hash(options, h);
 
-		cl_int err = clEnqueueReadImage(command_queue, img, CL_TRUE, origin, region, 0, 0, pPixels, 0, NULL, NULL);
-		if (err != CL_SUCCESS)
+		for (uint32_t i = 0; i < m_device_caps.size(); i++)
 		{
-			ocl_error_printf("ocl::read_from_image: clEnqueueReadImage() failed!\n");
-			return false;
+			h = ocl_binary_cache::hash(m_device_caps[i].m_platform_version, h);
+			h = ocl_binary_cache::hash(m_device_caps[i].m_device_name, h);
+			h = ocl_binary_cache::hash(m_device_caps[i].m_device_version, h);
+			h = ocl_binary_cache::hash(m_device_caps[i].m_driver_version, h);
+			
+			// Sub-devices have the same name as their parent, but may get different code.
+			h = ocl_binary_cache::hash(&m_device_caps[i].m_compute_units, sizeof(m_device_caps[i].m_compute_units), h);
 		}
 
-		return true;
+		return h;
 	}
 
-	bool run_1D(cl_command_queue command_queue, const cl_kernel kernel, size_t num_items)
+	// Like get_program_cache_key(), but for a single device of the context. Used to match embedded binaries, which are compiled per device.
+	uint64_t get_device_program_key(const char* pSrc, size_t src_size, const std::string& options, uint32_t device_index) const
 	{
-		cl_serializer serializer(this);
+		const ocl_device_caps& caps = m_device_caps[device_index];
 
-		cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel,
-			1,  // work_dim
-			nullptr, // global_work_offset
-			&num_items, // global_work_size
-			nullptr, // local_work_size
-			0, // num_events_in_wait_list
-			nullptr, // event_wait_list
-			nullptr // event
-		);
+		uint64_t h = ocl_binary_cache::hash(pSrc, src_size);
+		h = ocl_binary_cache::hash(options, h);
+		h = ocl_binary_cache::hash(caps.m_platform_version, h);
+		h = ocl_binary_cache::hash(caps.m_device_name, h);
+		h = ocl_binary_cache::hash(caps.m_device_version, h);
+		h = ocl_binary_cache::hash(caps.m_driver_version, h);
+		h = ocl_binary_cache::hash(&caps.m_compute_units, sizeof(caps.m_compute_units), h);
 
-		if (ret != CL_SUCCESS)
+		return h;
+	}
+
+	// Any failure (missing, corrupt or stale entry, driver rejecting the binary) silently returns nullptr, so the caller falls back to building from source.
+	cl_program load_cached_program(uint64_t cache_key, const std::string& options)
+	{
+		std::vector< std::vector<uint8_t> > binaries;
+		if (!m_binary_cache.load(cache_key, binaries))
+			return nullptr;
+
+		if (binaries.size() != m_device_ids.size())
+			return nullptr;
+
+		std::vector<size_t> sizes(binaries.size());
+		std::vector<const unsigned char*> ptrs(binaries.size());
+		for (uint32_t i = 0; i < binaries.size(); i++)
 		{
-			ocl_error_printf("ocl::run_1D: clEnqueueNDRangeKernel() failed!\n");
-			return false;
+			sizes[i] = binaries[i].size();
+			ptrs[i] = binaries[i].data();
 		}
 
-		return true;
+		return create_program_from_binaries(sizes, ptrs, options);
 	}
 
-	bool run_2D(cl_command_queue command_queue, const cl_kernel kernel, size_t width, size_t height)
+	// Like load_cached_program(), but from the embedded binary table. Every device in the context needs a matching binary.
+	cl_program load_embedded_program(const char* pSrc, size_t src_size, const std::string& options)
 	{
-		cl_serializer serializer(this);
+		std::vector<size_t> sizes(m_device_ids.size());
+		std::vector<const unsigned char*> ptrs(m_device_ids.size());
 
-		size_t num_global_items[2] = { width, height };
-		//size_t num_local_items[2] = { 1, 1 };
+		for (uint32_t i = 0; i < m_device_ids.size(); i++)
+		{
+			const uint64_t key = get_device_program_key(pSrc, src_size, options, i);
 
-		cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel,
-			2,  // work_dim
-			nullptr, // global_work_offset
-			num_global_items, // global_work_size
-			nullptr, // local_work_size
-			0, // num_events_in_wait_list
-			nullptr, // event_wait_list
-			nullptr // event
-		);
+			uint32_t j;
+			for (j = 0; j < m_num_embedded_binaries; j++)
+				if (m_pEmbedded_binaries[j].m_key == key)
+					break;
 
-		if (ret != CL_SUCCESS)
-		{
-			ocl_error_printf("ocl::run_2D: clEnqueueNDRangeKernel() failed!\n");
-			return false;
+			if (j == m_num_embedded_binaries)
+				return nullptr;
+
+			sizes[i] = m_pEmbedded_binaries[j].m_size;
+			ptrs[i] = m_pEmbedded_binaries[j].m_pData;
 		}
 
-		return true;
+		return create_program_from_binaries(sizes, ptrs, options);
 	}
 
-	bool run_2D(cl_command_queue command_queue, const cl_kernel kernel, size_t ofs_x, size_t ofs_y, size_t width, size_t height)
+	// Binaries are in m_device_ids order.
+	cl_program create_program_from_binaries(const std::vector<size_t>& sizes, const std::vector<const unsigned char*>& ptrs, const std::string& options)
 	{
-		cl_serializer serializer(this);
+		std::vector<cl_int> binary_status(ptrs.size(), CL_SUCCESS);
 
-		size_t global_ofs[2] = { ofs_x, ofs_y };
-		size_t num_global_items[2] = { width, height };
-		//size_t num_local_items[2] = { 1, 1 };
+		cl_int ret;
+		cl_program program = clCreateProgramWithBinary(m_context, (cl_uint)m_device_ids.size(), m_device_ids.data(), sizes.data(), (const unsigned char**)ptrs.data(), binary_status.data(), &ret);
+		if (ret != CL_SUCCESS)
+			return nullptr;
 
-		cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel,
-			2,  // work_dim
-			global_ofs, // global_work_offset
-			num_global_items, // global_work_size
-			nullptr, // local_work_size
-			0, // num_events_in_wait_list
-			nullptr, // event_wait_list
-			nullptr // event
-		);
+		for (uint32_t i = 0; i < binary_status.size(); i++)
+		{
+			if (binary_status[i] != CL_SUCCESS)
+			{
+				clReleaseProgram(program);
+				return nullptr;
+			}
+		}
 
+		// Programs created from binaries still need to be "built", but this doesn't invoke the compiler.
+		ret = clBuildProgram(program, (cl_uint)m_device_ids.size(), m_device_ids.data(), options.size() ? options.c_str() : nullptr, nullptr, nullptr);
 		if (ret != CL_SUCCESS)
 		{
-			ocl_error_printf("ocl::run_2D: clEnqueueNDRangeKernel() failed!\n");
-			return false;
+			clReleaseProgram(program);
+			return nullptr;
 		}
 
-		return true;
+		return program;
 	}
 
-	void flush(cl_command_queue command_queue)
+	bool store_cached_program(uint64_t cache_key, cl_program program)
 	{
-		cl_serializer serializer(this);
+		std::vector< std::vector<uint8_t> > binaries;
+		if (!get_program_binaries(program, binaries))
+			return false;
 
-		clFlush(command_queue);
-		clFinish(command_queue);
+		return m_binary_cache.store(cache_key, binaries);
 	}
 
-	template<typename T>
-	bool set_kernel_arg(cl_kernel kernel, uint32_t index, const T& obj)
+	// Returns the program's binaries in m_device_ids order.
+	bool get_program_binaries(cl_program program, std::vector< std::vector<uint8_t> >& binaries)
 	{
-		cl_serializer serializer(this);
+		cl_uint num_devices = 0;
+		if ((clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(num_devices), &num_devices, nullptr) != CL_SUCCESS) || (num_devices != m_device_ids.size()))
+			return false;
 
-		cl_int ret = clSetKernelArg(kernel, index, sizeof(T), (void*)&obj);
-		if (ret != CL_SUCCESS)
+		std::vector<cl_device_id> program_devices(num_devices);
+		std::vector<size_t> sizes(num_devices);
+		if (clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(cl_device_id) * num_devices, program_devices.data(), nullptr) != CL_SUCCESS)
+			return false;
+		if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * num_devices, sizes.data(), nullptr) != CL_SUCCESS)
+			return false;
+
+		std::vector< std::vector<uint8_t> > program_binaries(num_devices);
+		std::vector<unsigned char*> ptrs(num_devices);
+		for (uint32_t i = 0; i < num_devices; i++)
 		{
-			ocl_error_printf("ocl::set_kernel_arg: clSetKernelArg() failed!\n");
+			if (!sizes[i])
+				return false;
+			program_binaries[i].resize(sizes[i]);
+			ptrs[i] = program_binaries[i].data();
+		}
+
+		if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * num_devices, ptrs.data(), nullptr) != CL_SUCCESS)
 			return false;
+
+		binaries.resize(num_devices);
+		for (uint32_t i = 0; i < num_devices; i++)
+		{
+			const ptrdiff_t device_index = std::find(m_device_ids.begin(), m_device_ids.end(), program_devices[i]) - m_device_ids.begin();
+			if (device_index >= (ptrdiff_t)num_devices)
+				return false;
+			binaries[device_index].swap(program_binaries[i]);
 		}
+
 		return true;
 	}
 
-	template<typename T>
-	bool set_kernel_args(cl_kernel kernel, const T& obj1)
+	// Turns a define set like "VEC_WIDTH=16 BUF_SIZE_MULTIPLE=64" into build options. The defines are sorted, so the same set in any order maps to the same variant.
+	std::string get_variant_build_options(const char* pDefines) const
 	{
-		cl_serializer serializer(this);
+		std::vector<std::string> defines;
 
-		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1);
-		if (ret != CL_SUCCESS)
+		std::string cur;
+		for (const char* p = pDefines ? pDefines : ""; ; p++)
 		{
-			ocl_error_printf("ocl::set_kernel_arg: clSetKernelArg() failed!\n");
-			return false;
+			if ((!*p) || (isspace((uint8_t)*p)))
+			{
+				if (cur.size())
+					defines.push_back(cur);
+				cur.clear();
+
+				if (!*p)
+					break;
+			}
+			else
+				cur.push_back(*p);
 		}
-		return true;
-	}
 
-#define CHECK_ERR if (ret != CL_SUCCESS)	{ ocl_error_printf("ocl::set_kernel_args: clSetKernelArg() failed!\n"); return false; }
+		std::sort(defines.begin(), defines.end());
+
+		std::string options(get_build_options());
+		for (uint32_t i = 0; i < defines.size(); i++)
+			options += " -D" + defines[i];
+
+		return options;
+	}
+
+	// Releases the variants, except ones still being built, which a later call releases once their build finishes. Callers of get_program_variant() hold
+	// their own reference, so this never frees a program still in use. If all is false only variants of older program generations are released.
+	// Called with m_variant_mutex held, or from deinit().
+	void release_program_variants(bool all = true, uint32_t generation = 0)
+	{
+		for (uint32_t i = 0; i < m_program_variants.size(); )
+		{
+			program_variant* pVariant = m_program_variants[i];
+			if ((pVariant->m_building) || ((!all) && (pVariant->m_generation == generation)))
+			{
+				i++;
+				continue;
+			}
+
+			if (pVariant->m_program)
+			{
+				cl_serializer serializer(this);
+				clReleaseProgram(pVariant->m_program);
+			}
+			delete pVariant;
+
+			m_program_variants.erase(m_program_variants.begin() + i);
+		}
+	}
+
+	// Returns the program variant built with options, building it if needed. Different variants build concurrently, while threads asking for a variant
+	// that's already being built wait for it. pBuild_secs (optional) receives the build time if this call built it, or 0.
+	// The program is retained while m_variant_mutex is held, so a rebuild can't release it under the caller: release it with clReleaseProgram() when done.
+	cl_program get_program_variant(const std::string& options, uint32_t& generation, double* pBuild_secs = nullptr)
+	{
+		if (pBuild_secs)
+			*pBuild_secs = 0.0;
+
+		std::unique_lock<std::mutex> variant_lock(m_variant_mutex);
+
+		ocl_program_module_vec modules;
+		program_variant* pVariant = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_program_mutex);
+			if (!m_program)
+				return nullptr;
+			generation = m_program_generation.load(std::memory_order_relaxed);
+
+			release_program_variants(false, generation);
+
+			for (uint32_t i = 0; i < m_program_variants.size(); i++)
+			{
+				if ((m_program_variants[i]->m_generation == generation) && (m_program_variants[i]->m_options == options))
+				{
+					pVariant = m_program_variants[i];
+					break;
+				}
+			}
+
+			// Copy the source under the same lock, so the variant matches generation.
+			if (!pVariant)
+				modules = m_program_modules;
+		}
+
+		if (pVariant)
+		{
+			m_variant_cv.wait(variant_lock, [pVariant] { return !pVariant->m_building; });
+			return retain_program(pVariant->m_program);
+		}
+
+		pVariant = new program_variant;
+		pVariant->m_options = options;
+		pVariant->m_generation = generation;
+		pVariant->m_program = nullptr;
+		pVariant->m_building = true;
+		m_program_variants.push_back(pVariant);
+
+		variant_lock.unlock();
+
+		const std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+
+		cl_program program = create_program(modules, options, false);
+
+		if (pBuild_secs)
+			*pBuild_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+		variant_lock.lock();
+		pVariant->m_program = program;
+		pVariant->m_building = false;
+		program = retain_program(program);
+		variant_lock.unlock();
+
+		m_variant_cv.notify_all();
+
+		return program;
+	}
+
+	cl_program retain_program(cl_program program)
+	{
+		if (program)
+		{
+			cl_serializer serializer(this);
+			clRetainProgram(program);
+		}
+		return program;
+	}
+
+	// Runs func(0) to func(num_builds - 1) on the build job pool and the calling thread. Program builds spend nearly all their time in the driver's compiler, so they overlap well.
+	// When driver calls are serialized the builds couldn't overlap anyway, so they run one at a time on the calling thread.
+	// Nested calls (a variant build compiling its modules) are fine: a waiting thread runs the batch's remaining builds itself.
+	void run_parallel_builds(uint32_t num_builds, const std::function<void(uint32_t)>& func)
+	{
+		if ((num_builds <= 1) || (m_use_mutex))
+		{
+			for (uint32_t i = 0; i < num_builds; i++)
+				func(i);
+			return;
+		}
+
+		{
+			// The calling thread is one of the build threads, so the pool gets one thread less than the number of cores.
+			std::lock_guard<std::mutex> lock(m_build_job_pool_mutex);
+			if (!m_build_job_pool.get_num_threads())
+				m_build_job_pool.init(std::max<uint32_t>(std::thread::hardware_concurrency(), 2) - 1);
+		}
+
+		m_build_job_pool.run_parallel(num_builds, func);
+	}
+
+public:
+	// If pGeneration isn't nullptr, it receives the program generation the kernel was created from.
+	cl_kernel create_kernel(const char* pName, uint32_t* pGeneration = nullptr)
+	{
+		// Holding the program lock keeps a concurrent rebuild from releasing the program under us.
+		std::lock_guard<std::mutex> lock(m_program_mutex);
+
+		if (!m_program)
+			return nullptr;
+
+		if (pGeneration)
+			*pGeneration = m_program_generation.load(std::memory_order_relaxed);
+
+		cl_serializer serializer(this);
+
+		cl_int ret;
+		cl_kernel kernel = clCreateKernel(m_program, pName, &ret);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::create_kernel: clCreateKernel() failed!\n");
+			return nullptr;
+		}
+
+		return kernel;
+	}
+
+	// Creates a kernel from a variant of the program compiled with extra preprocessor defines, e.g. "VEC_WIDTH=16 BUF_SIZE_MULTIPLE=64" (each whitespace separated token is passed as -D<token>).
+	// Each distinct define set is compiled once from the current program's source and cached in memory (and in the binary cache, if enabled). Variants are dropped
+	// when the program is rebuilt, so check pGeneration against get_program_generation() like with create_kernel(). A variant which failed to build isn't retried.
+	cl_kernel create_kernel_variant(const char* pName, const char* pDefines, uint32_t* pGeneration = nullptr)
+	{
+		const std::string options(get_variant_build_options(pDefines));
+
+		uint32_t generation;
+		cl_program program = get_program_variant(options, generation);
+		if (!program)
+			return nullptr;
+
+		if (pGeneration)
+			*pGeneration = generation;
+
+		cl_serializer serializer(this);
+
+		cl_int ret;
+		cl_kernel kernel = clCreateKernel(program, pName, &ret);
+
+		// The kernel keeps its own reference to the program.
+		clReleaseProgram(program);
+
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::create_kernel_variant: clCreateKernel() failed!\n");
+			return nullptr;
+		}
+
+		return kernel;
+	}
+
+	// Build scheduler: builds all the given variants (see create_kernel_variant()) that aren't cached yet at the same time, so the total time is about that
+	// of the slowest build rather than the sum. Returns false if any build failed. pWall_secs/pTotal_build_secs (optional) receive the elapsed time and the sum of the build times.
+	bool build_program_variants(const char* const* ppDefines, uint32_t num_variants, double* pWall_secs = nullptr, double* pTotal_build_secs = nullptr)
+	{
+		const std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+
+		std::vector<double> build_secs(num_variants);
+		std::atomic<bool> success(true);
+
+		run_parallel_builds(num_variants, [&](uint32_t i)
+		{
+			uint32_t generation;
+			cl_program program = get_program_variant(get_variant_build_options(ppDefines[i]), generation, &build_secs[i]);
+			if (!program)
+			{
+				success = false;
+				return;
+			}
+
+			cl_serializer serializer(this);
+			clReleaseProgram(program);
+		});
+
+		if (pWall_secs)
+			*pWall_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+		if (pTotal_build_secs)
+		{
+			*pTotal_build_secs = 0.0;
+			for (uint32_t i = 0; i < num_variants; i++)
+				*pTotal_build_secs += build_secs[i];
+		}
+
+		return success;
+	}
+
+	uint32_t get_num_program_variants()
+	{
+		std::lock_guard<std::mutex> lock(m_variant_mutex);
+		return (uint32_t)m_program_variants.size();
+	}
+
+	// Kernel pool: hands out kernels created in bulk with clCreateKernelsInProgram(), so threads don't need to create their own.
+	// A pooled kernel is only used by one caller at a time, so its arguments can be set freely. Return it with release_pooled_kernel().
+	// The pool grows on demand, and kernels of an older program generation are released instead of being reused.
+	cl_kernel acquire_pooled_kernel(const char* pName, uint32_t* pGeneration = nullptr)
+	{
+		std::lock_guard<std::mutex> pool_lock(m_kernel_pool_mutex);
+
+		const uint32_t generation = m_program_generation.load(std::memory_order_acquire);
+		if (generation != m_kernel_pool_generation)
+		{
+			release_kernel_pool();
+			m_kernel_pool_generation = generation;
+		}
+
+		kernel_pool_entry* pEntry = find_kernel_pool_entry(pName);
+		if ((!pEntry) || (pEntry->m_free_kernels.empty()))
+		{
+			// Grow geometrically, so many threads starting at once don't each pay for a bulk create.
+			const uint32_t num_batches = pEntry ? std::min<uint32_t>(std::max<uint32_t>(pEntry->m_total_kernels, 1), cMaxKernelPoolBatches) : 1;
+			if (!grow_kernel_pool(num_batches, generation))
+				return nullptr;
+
+			pEntry = find_kernel_pool_entry(pName);
+			if ((!pEntry) || (pEntry->m_free_kernels.empty()))
+			{
+				ocl_error_printf("ocl::acquire_pooled_kernel: Kernel \"%s\" not found in program\n", pName);
+				return nullptr;
+			}
+		}
+
+		cl_kernel kernel = pEntry->m_free_kernels.back();
+		pEntry->m_free_kernels.pop_back();
+
+		pEntry->m_kernels_in_use++;
+		pEntry->m_peak_kernels_in_use = std::max(pEntry->m_peak_kernels_in_use, pEntry->m_kernels_in_use);
+		pEntry->m_total_acquires++;
+
+		m_kernel_pool_kernels_in_use++;
+		m_kernel_pool_peak_kernels_in_use = std::max(m_kernel_pool_peak_kernels_in_use, m_kernel_pool_kernels_in_use);
+
+		if (pGeneration)
+			*pGeneration = generation;
+
+		return kernel;
+	}
+
+	// pName and generation must be the ones passed to and returned by acquire_pooled_kernel().
+	void release_pooled_kernel(const char* pName, cl_kernel kernel, uint32_t generation)
+	{
+		if (!kernel)
+			return;
+
+		std::lock_guard<std::mutex> pool_lock(m_kernel_pool_mutex);
+
+		if (generation == m_kernel_pool_generation)
+		{
+			kernel_pool_entry* pEntry = find_kernel_pool_entry(pName);
+			if (pEntry)
+			{
+				assert(pEntry->m_kernels_in_use);
+				pEntry->m_kernels_in_use--;
+				pEntry->m_free_kernels.push_back(kernel);
+
+				assert(m_kernel_pool_kernels_in_use);
+				m_kernel_pool_kernels_in_use--;
+				return;
+			}
+		}
+
+		// Stale kernel from a previous program generation (the pool already forgot about it).
+		cl_serializer serializer(this);
+		clReleaseKernel(kernel);
+	}
+
+	// If pName is nullptr the stats of all kernels are summed, except the peak, which is the most kernels (of any function) that were in use at once.
+	void get_kernel_pool_stats(ocl_kernel_pool_stats& stats, const char* pName = nullptr)
+	{
+		memset(&stats, 0, sizeof(stats));
+
+		std::lock_guard<std::mutex> pool_lock(m_kernel_pool_mutex);
+
+		for (uint32_t i = 0; i < m_kernel_pool.size(); i++)
+		{
+			const kernel_pool_entry& e = m_kernel_pool[i];
+			if ((pName) && (e.m_name != pName))
+				continue;
+
+			stats.m_total_kernels += e.m_total_kernels;
+			stats.m_kernels_in_use += e.m_kernels_in_use;
+			stats.m_total_acquires += e.m_total_acquires;
+
+			if (pName)
+				stats.m_peak_kernels_in_use = e.m_peak_kernels_in_use;
+		}
+
+		if (!pName)
+			stats.m_peak_kernels_in_use = m_kernel_pool_peak_kernels_in_use;
+
+		stats.m_total_bulk_creates = m_kernel_pool_bulk_creates;
+	}
+
+	// Device buffer pool: buffers are rounded up to a power of 2 size class, and released buffers go on a shared free list per flags and size class,
+	// so later acquires of the same class skip clCreateBuffer()/clReleaseMemObject(). Buffers larger than the largest size class are created and released directly.
+	size_t get_buffer_size_class(size_t size) const
+	{
+		if ((!size) || (size > m_buffer_pool_max_size))
+			return size;
+
+		size_t size_class = m_buffer_pool_min_size;
+		while (size_class < size)
+			size_class <<= 1;
+		return size_class;
+	}
+
+	bool is_buffer_size_pooled(size_t size) const { return (size) && (size <= m_buffer_pool_max_size); }
+
+	// Callers which retry after freeing memory of their own pass report_errors = false for the first attempt.
+	bool acquire_pooled_buffer(cl_mem_flags flags, size_t size, ocl_pooled_buffer& buf, bool report_errors = true)
+	{
+		buf.m_buf = nullptr;
+		buf.m_flags = flags;
+		buf.m_size = get_buffer_size_class(size);
+
+		{
+			std::lock_guard<std::mutex> pool_lock(m_buffer_pool_mutex);
+
+			m_buffer_pool_stats.m_total_acquires++;
+
+			buffer_pool_class* pClass = is_buffer_size_pooled(buf.m_size) ? find_buffer_pool_class(flags, buf.m_size) : nullptr;
+			if ((pClass) && (!pClass->m_free_buffers.empty()))
+			{
+				// Most recently used first, so the least recently used buffers stay at the front for evict_lru_pooled_buffer().
+				buf.m_buf = pClass->m_free_buffers.back().m_buf;
+				pClass->m_free_buffers.pop_back();
+
+				m_buffer_pool_stats.m_free_bytes -= buf.m_size;
+				m_buffer_pool_stats.m_free_buffers--;
+				m_buffer_pool_stats.m_total_hits++;
+				return true;
+			}
+		}
+
+		cl_int ret;
+		buf.m_buf = create_tracked_buffer(flags, buf.m_size, nullptr, ret);
+		if (!buf.m_buf)
+		{
+			if (report_errors)
+				ocl_error_printf("ocl::acquire_pooled_buffer: clCreateBuffer() failed with error %i\n", ret);
+			return false;
+		}
+
+		std::lock_guard<std::mutex> pool_lock(m_buffer_pool_mutex);
+
+		m_buffer_pool_stats.m_total_bytes += buf.m_size;
+		m_buffer_pool_stats.m_peak_total_bytes = std::max(m_buffer_pool_stats.m_peak_total_bytes, m_buffer_pool_stats.m_total_bytes);
+		m_buffer_pool_stats.m_total_buffers++;
+
+		return true;
+	}
+
+	// Puts the buffer on the shared free list (or releases it, if it's too large or the free list is full), and clears buf.
+	void release_pooled_buffer(ocl_pooled_buffer& buf)
+	{
+		if (!buf.m_buf)
+			return;
+
+		{
+			std::lock_guard<std::mutex> pool_lock(m_buffer_pool_mutex);
+
+			const bool full = (m_buffer_pool_max_free_bytes) && (m_buffer_pool_stats.m_free_bytes + buf.m_size > m_buffer_pool_max_free_bytes);
+
+			if ((is_buffer_size_pooled(buf.m_size)) && (!full))
+			{
+				buffer_pool_class* pClass = find_buffer_pool_class(buf.m_flags, buf.m_size);
+				if (!pClass)
+				{
+					m_buffer_pool.push_back(buffer_pool_class());
+					pClass = &m_buffer_pool.back();
+					pClass->m_flags = buf.m_flags;
+					pClass->m_size = buf.m_size;
+				}
+
+				pooled_free_buffer free_buf;
+				free_buf.m_buf = buf.m_buf;
+				free_buf.m_last_used = ++m_buffer_pool_tick;
+				pClass->m_free_buffers.push_back(free_buf);
+
+				m_buffer_pool_stats.m_free_bytes += buf.m_size;
+				m_buffer_pool_stats.m_free_buffers++;
+
+				buf.m_buf = nullptr;
+				return;
+			}
+
+			if (full)
+				m_buffer_pool_stats.m_total_trimmed_bytes += buf.m_size;
+
+			m_buffer_pool_stats.m_total_bytes -= buf.m_size;
+			m_buffer_pool_stats.m_total_buffers--;
+		}
+
+		destroy_buffer(buf.m_buf);
+		buf.m_buf = nullptr;
+	}
+
+	// Releases free buffers, largest size classes first, until at most max_free_bytes of free buffers remain. Buffers in use are unaffected. Returns the number of bytes released.
+	uint64_t trim_buffer_pool(uint64_t max_free_bytes = 0)
+	{
+		std::vector<cl_mem> bufs;
+		uint64_t trimmed_bytes = 0;
+
+		{
+			std::lock_guard<std::mutex> pool_lock(m_buffer_pool_mutex);
+
+			std::sort(m_buffer_pool.begin(), m_buffer_pool.end(), [](const buffer_pool_class& a, const buffer_pool_class& b) { return a.m_size > b.m_size; });
+
+			for (uint32_t i = 0; (i < m_buffer_pool.size()) && (m_buffer_pool_stats.m_free_bytes > max_free_bytes); i++)
+			{
+				buffer_pool_class& c = m_buffer_pool[i];
+				while ((c.m_free_buffers.size()) && (m_buffer_pool_stats.m_free_bytes > max_free_bytes))
+				{
+					bufs.push_back(c.m_free_buffers.back().m_buf);
+					c.m_free_buffers.pop_back();
+
+					m_buffer_pool_stats.m_free_bytes -= c.m_size;
+					m_buffer_pool_stats.m_free_buffers--;
+					m_buffer_pool_stats.m_total_bytes -= c.m_size;
+					m_buffer_pool_stats.m_total_buffers--;
+					trimmed_bytes += c.m_size;
+				}
+			}
+
+			m_buffer_pool_stats.m_total_trimmed_bytes += trimmed_bytes;
+		}
+
+		for (uint32_t i = 0; i < bufs.size(); i++)
+			destroy_buffer(bufs[i]);
+
+		return trimmed_bytes;
+	}
+
+	void get_buffer_pool_stats(ocl_buffer_pool_stats& stats)
+	{
+		std::lock_guard<std::mutex> pool_lock(m_buffer_pool_mutex);
+		stats = m_buffer_pool_stats;
+	}
+
+	// Device memory accounting: every buffer, image and sub-buffer created through ocl is tracked against the budget (see ocl_init_params::m_mem_budget).
+	void get_mem_stats(ocl_mem_stats& stats)
+	{
+		std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+		stats = m_mem_stats;
+	}
+
+	uint64_t get_mem_budget()
+	{
+		std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+		return m_mem_stats.m_budget;
+	}
+
+	// Lowering the budget below what's allocated evicts free pool buffers, least recently used first, until the allocations fit or there's nothing left to evict.
+	void set_mem_budget(uint64_t budget)
+	{
+		{
+			std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+			m_mem_stats.m_budget = budget;
+		}
+
+		for ( ; ; )
+		{
+			{
+				std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+				if (m_mem_stats.m_allocated_bytes <= m_mem_stats.m_budget)
+					break;
+			}
+
+			if (!evict_pooled_buffer())
+				break;
+		}
+	}
+
+	// Returns 0 on failure.
+	uint32_t get_kernel_num_args(cl_kernel k)
+	{
+		cl_serializer serializer(this);
+
+		cl_uint num_args = 0;
+		if (clGetKernelInfo(k, CL_KERNEL_NUM_ARGS, sizeof(num_args), &num_args, nullptr) != CL_SUCCESS)
+			return 0;
+		return num_args;
+	}
+
+	bool destroy_kernel(cl_kernel k)
+	{
+		if (k)
+		{
+			cl_serializer serializer(this);
+
+			cl_int ret = clReleaseKernel(k);
+			if (ret != CL_SUCCESS)
+			{
+				ocl_error_printf("ocl::destroy_kernel: clReleaseKernel() failed!\n");
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Callers with a fallback pass report_errors = false, so failures don't print (and assert, with OPENCL_ASSERT_ON_ANY_ERRORS). The same goes for the functions below.
+	cl_mem alloc_buffer(cl_mem_flags flags, size_t size, bool report_errors = true)
+	{
+		cl_int ret;
+		cl_mem obj = create_tracked_buffer(flags, size, NULL, ret);
+		if (!obj)
+		{
+			if (report_errors)
+				ocl_error_printf("ocl::alloc_buffer: clCreateBuffer() failed with error %i\n", ret);
+			return nullptr;
+		}
+
+		return obj;
+	}
+
+	// Creates a buffer aliasing [ofs, ofs + size) of parent. ofs must be a multiple of get_sub_buffer_alignment(). The parent stays alive until its sub-buffers are released.
+	cl_mem create_sub_buffer(cl_mem parent, cl_mem_flags flags, size_t ofs, size_t size, bool report_errors = true)
+	{
+		cl_buffer_region region;
+		region.origin = ofs;
+		region.size = size;
+
+		// Sub-buffers alias their parent's memory, so they're counted but use none of the budget.
+		cl_int ret;
+		cl_mem obj = create_tracked_mem_object(cMemSubBuffer, 0, ret, [&](cl_int& r) { return clCreateSubBuffer(parent, flags, CL_BUFFER_CREATE_TYPE_REGION, &region, &r); });
+		if (!obj)
+		{
+			if (report_errors)
+				ocl_error_printf("ocl::create_sub_buffer: clCreateSubBuffer() failed with error %i\n", ret);
+			return nullptr;
+		}
+
+		return obj;
+	}
+
+	// Sub-buffer origins must be aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN of every device in the context.
+	size_t get_sub_buffer_alignment() const
+	{
+		size_t alignment = 1;
+		for (uint32_t i = 0; i < m_device_caps.size(); i++)
+			alignment = std::max<size_t>(alignment, m_device_caps[i].m_mem_base_addr_align);
+		return alignment;
+	}
+
+	cl_mem alloc_read_buffer(size_t size)
+	{
+		cl_int ret;
+		cl_mem obj = create_tracked_buffer(CL_MEM_READ_ONLY, size, NULL, ret);
+		if (!obj)
+		{
+			ocl_error_printf("ocl::alloc_read_buffer: clCreateBuffer() failed!\n");
+			return nullptr;
+		}
+
+		return obj;
+	}
+
+	cl_mem alloc_and_init_read_buffer(cl_command_queue command_queue, const void *pInit, size_t size)
+	{
+		cl_int ret;
+		cl_mem obj = create_tracked_buffer(CL_MEM_READ_ONLY, size, NULL, ret);
+		if (!obj)
+		{
+			ocl_error_printf("ocl::alloc_and_init_read_buffer: clCreateBuffer() failed!\n");
+			return nullptr;
+		}
+
+		cl_serializer serializer(this);
+
+		ret = clEnqueueWriteBuffer(command_queue, obj, CL_TRUE, 0, size, pInit, 0, NULL, NULL);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::alloc_and_init_read_buffer: clEnqueueWriteBuffer() failed!\n");
+			return nullptr;
+		}
+
+		return obj;
+	}
+
+	cl_mem alloc_write_buffer(size_t size)
+	{
+		cl_int ret;
+		cl_mem obj = create_tracked_buffer(CL_MEM_WRITE_ONLY, size, NULL, ret);
+		if (!obj)
+		{
+			ocl_error_printf("ocl::alloc_write_buffer: clCreateBuffer() failed!\n");
+			return nullptr;
+		}
+
+		return obj;
+	}
+			
+	// Wraps existing host memory in a buffer (CL_MEM_USE_HOST_PTR). On devices with host unified memory, kernels then access p directly, with no copies,
+	// as long as p meets the device's alignment requirement (otherwise the driver may copy behind the scenes). p must stay valid until the buffer is destroyed.
+	cl_mem alloc_host_ptr_buffer(cl_mem_flags flags, void* p, size_t size, bool report_errors = true)
+	{
+		cl_int ret;
+		cl_mem obj = create_tracked_buffer(flags | CL_MEM_USE_HOST_PTR, size, p, ret);
+		if (!obj)
+		{
+			if (report_errors)
+				ocl_error_printf("ocl::alloc_host_ptr_buffer: clCreateBuffer() failed with error %i\n", ret);
+			return nullptr;
+		}
+
+		return obj;
+	}
+
+	// Queues a map and unmap of a CL_MEM_USE_HOST_PTR buffer, which makes what earlier commands wrote to it visible in its host memory once the queue is flushed.
+	// On zero copy devices this is practically free.
+	bool sync_host_ptr_buffer(cl_command_queue command_queue, cl_mem clmem, size_t size)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret;
+		void* p = clEnqueueMapBuffer(command_queue, clmem, CL_FALSE, CL_MAP_READ, 0, size, 0, nullptr, nullptr, &ret);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::sync_host_ptr_buffer: clEnqueueMapBuffer() failed with error %i\n", ret);
+			return false;
+		}
+
+		ret = clEnqueueUnmapMemObject(command_queue, clmem, p, 0, nullptr, nullptr);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::sync_host_ptr_buffer: clEnqueueUnmapMemObject() failed with error %i\n", ret);
+			return false;
+		}
+
+		return true;
+	}
+
+	bool destroy_buffer(cl_mem buf)
+	{
+		if (buf)
+		{
+			untrack_mem_object(buf);
+
+			cl_serializer serializer(this);
+
+			cl_int ret = clReleaseMemObject(buf);
+			if (ret != CL_SUCCESS)
+			{
+				ocl_error_printf("ocl::destroy_buffer: clReleaseMemObject() failed!\n");
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// If blocking is false, d must stay valid until the command queue is flushed.
+	bool write_to_buffer(cl_command_queue command_queue, cl_mem clmem, const void* d, const size_t m, bool blocking = true)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clEnqueueWriteBuffer(command_queue, clmem, blocking ? CL_TRUE : CL_FALSE, 0, m, d, 0, NULL, NULL);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::write_to_buffer: clEnqueueWriteBuffer() failed!\n");
+			return false;
+		}
+
+		return true;
+	}
+
+	// If blocking is false, d isn't valid until the command queue is flushed.
+	bool read_from_buffer(cl_command_queue command_queue, const cl_mem clmem, void* d, size_t m, bool blocking = true)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clEnqueueReadBuffer(command_queue, clmem, blocking ? CL_TRUE : CL_FALSE, 0, m, d, 0, NULL, NULL);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::read_from_buffer: clEnqueueReadBuffer() failed!\n");
+			return false;
+		}
+
+		return true;
+	}
+
+	// Event chained commands for asynchronous work. Each one also waits for the num_wait_events events at pWait_events (needed across queues, or with out of order queues),
+	// and if pEvent isn't nullptr returns an event which completes with the command. The caller releases it with release_event().
+	// Host memory passed to a write mustn't change, and memory passed to a read isn't valid, until the command's event completes.
+	bool enqueue_write_buffer(cl_command_queue command_queue, cl_mem clmem, size_t ofs, const void* pSrc, size_t size, uint32_t num_wait_events, const cl_event* pWait_events, cl_event* pEvent)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clEnqueueWriteBuffer(command_queue, clmem, CL_FALSE, ofs, size, pSrc, num_wait_events, num_wait_events ? pWait_events : nullptr, pEvent);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::enqueue_write_buffer: clEnqueueWriteBuffer() failed with error %i\n", ret);
+			return false;
+		}
+
+		return true;
+	}
+
+	bool enqueue_read_buffer(cl_command_queue command_queue, const cl_mem clmem, size_t ofs, void* pDst, size_t size, uint32_t num_wait_events, const cl_event* pWait_events, cl_event* pEvent)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clEnqueueReadBuffer(command_queue, clmem, CL_FALSE, ofs, size, pDst, num_wait_events, num_wait_events ? pWait_events : nullptr, pEvent);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::enqueue_read_buffer: clEnqueueReadBuffer() failed with error %i\n", ret);
+			return false;
+		}
+
+		return true;
+	}
+
+	bool enqueue_run_1D(cl_command_queue command_queue, const cl_kernel kernel, size_t ofs, size_t num_items, uint32_t num_wait_events, const cl_event* pWait_events, cl_event* pEvent)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel, 1, &ofs, &num_items, nullptr, num_wait_events, num_wait_events ? pWait_events : nullptr, pEvent);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::enqueue_run_1D: clEnqueueNDRangeKernel() failed with error %i\n", ret);
+			return false;
+		}
+
+		return true;
+	}
+
+	// Event chained version of sync_host_ptr_buffer(). *pEvent completes once the buffer's host memory is up to date.
+	bool enqueue_sync_host_ptr_buffer(cl_command_queue command_queue, cl_mem clmem, size_t size, uint32_t num_wait_events, const cl_event* pWait_events, cl_event* pEvent)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret;
+		void* p = clEnqueueMapBuffer(command_queue, clmem, CL_FALSE, CL_MAP_READ, 0, size, num_wait_events, num_wait_events ? pWait_events : nullptr, nullptr, &ret);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::enqueue_sync_host_ptr_buffer: clEnqueueMapBuffer() failed with error %i\n", ret);
+			return false;
+		}
+
+		ret = clEnqueueUnmapMemObject(command_queue, clmem, p, 0, nullptr, pEvent);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::enqueue_sync_host_ptr_buffer: clEnqueueUnmapMemObject() failed with error %i\n", ret);
+			return false;
+		}
+
+		return true;
+	}
+
+	typedef void (CL_CALLBACK* event_callback)(cl_event event, cl_int status, void* pData);
+
+	// Calls pCallback(event, status, pData) once the event completes (status is CL_COMPLETE) or its command fails (status is a negative error code).
+	// The callback runs on a runtime thread, may run before this returns, and must not call blocking OpenCL functions.
+	bool set_event_callback(cl_event event, event_callback pCallback, void* pData)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clSetEventCallback(event, CL_COMPLETE, pCallback, pData);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::set_event_callback: clSetEventCallback() failed with error %i\n", ret);
+			return false;
+		}
+
+		return true;
+	}
+
+	// Not serialized, so other threads can keep using the driver while this one blocks.
+	bool wait_for_event(cl_event event)
+	{
+		if (!event)
+			return true;
+
+		cl_int ret = clWaitForEvents(1, &event);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::wait_for_event: clWaitForEvents() failed with error %i\n", ret);
+			return false;
+		}
+
+		return true;
+	}
+
+	void release_event(cl_event event)
+	{
+		if (event)
+		{
+			cl_serializer serializer(this);
+
+			clReleaseEvent(event);
+		}
+	}
+
+	// Drivers back CL_MEM_ALLOC_HOST_PTR buffers with page locked memory, so transfers from/to pb.m_pPtr can DMA directly instead of first being copied
+	// into the driver's own pinned bounce buffer, as pageable memory is. The buffer stays mapped until free_pinned_buffer().
+	bool alloc_pinned_buffer(cl_command_queue command_queue, size_t size, ocl_pinned_buffer& pb, bool report_errors = true)
+	{
+		memset(&pb, 0, sizeof(pb));
+
+		cl_int ret;
+		pb.m_buf = create_tracked_buffer(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, nullptr, ret);
+		if (!pb.m_buf)
+		{
+			if (report_errors)
+				ocl_error_printf("ocl::alloc_pinned_buffer: clCreateBuffer() failed with error %i\n", ret);
+			return false;
+		}
+
+		cl_serializer serializer(this);
+
+		pb.m_pPtr = static_cast<uint8_t*>(clEnqueueMapBuffer(command_queue, pb.m_buf, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, nullptr, nullptr, &ret));
+		if (ret != CL_SUCCESS)
+		{
+			if (report_errors)
+				ocl_error_printf("ocl::alloc_pinned_buffer: clEnqueueMapBuffer() failed with error %i\n", ret);
+			untrack_mem_object(pb.m_buf);
+			clReleaseMemObject(pb.m_buf);
+			memset(&pb, 0, sizeof(pb));
+			return false;
+		}
+
+		pb.m_size = size;
+		return true;
+	}
+
+	// No transfers from/to the buffer may still be pending.
+	void free_pinned_buffer(cl_command_queue command_queue, ocl_pinned_buffer& pb)
+	{
+		if (!pb.m_buf)
+			return;
+
+		untrack_mem_object(pb.m_buf);
+
+		{
+			cl_serializer serializer(this);
+
+			// The release is deferred until the unmap completes.
+			clEnqueueUnmapMemObject(command_queue, pb.m_buf, pb.m_pPtr, 0, nullptr, nullptr);
+			clReleaseMemObject(pb.m_buf);
+		}
+
+		memset(&pb, 0, sizeof(pb));
+	}
+
+	// Failures aren't reported: callers fall back to unstaged transfers.
+	bool init_staging_buffer(cl_command_queue command_queue, size_t size, ocl_staging_buffer& sb)
+	{
+		memset(&sb, 0, sizeof(sb));
+		return alloc_pinned_buffer(command_queue, size & ~(size_t)1, sb.m_pinned, false);
+	}
+
+	void deinit_staging_buffer(cl_command_queue command_queue, ocl_staging_buffer& sb)
+	{
+		wait_staging_half(sb, 0);
+		wait_staging_half(sb, 1);
+		free_pinned_buffer(command_queue, sb.m_pinned);
+	}
+
+	// Uploads size bytes from pSrc to clmem at ofs through the staging buffer, in chunks of half its size: while one chunk is DMA'd, the next is copied into the other half.
+	// Returns once the last chunk is queued. Like a non-blocking write_to_buffer(), except pSrc may be reused immediately.
+	bool write_to_buffer_staged(cl_command_queue command_queue, cl_mem clmem, size_t ofs, const void* pSrc, size_t size, ocl_staging_buffer& sb)
+	{
+		const size_t chunk_size = sb.m_pinned.m_size / 2;
+		if (!chunk_size)
+			return false;
+
+		for (size_t chunk_ofs = 0, chunk = 0; chunk_ofs < size; chunk_ofs += chunk_size, chunk++)
+		{
+			const uint32_t half = (uint32_t)(chunk & 1);
+			if (!wait_staging_half(sb, half))
+				return false;
+
+			const size_t n = std::min(chunk_size, size - chunk_ofs);
+			uint8_t* pStaging = sb.m_pinned.m_pPtr + half * chunk_size;
+
+			memcpy(pStaging, static_cast<const uint8_t*>(pSrc) + chunk_ofs, n);
+
+			cl_serializer serializer(this);
+
+			cl_int ret = clEnqueueWriteBuffer(command_queue, clmem, CL_FALSE, ofs + chunk_ofs, n, pStaging, 0, nullptr, &sb.m_events[half]);
+			if (ret != CL_SUCCESS)
+			{
+				ocl_error_printf("ocl::write_to_buffer_staged: clEnqueueWriteBuffer() failed with error %i\n", ret);
+				sb.m_events[half] = nullptr;
+				return false;
+			}
+
+			// Start the DMA now, while the next chunk is copied.
+			clFlush(command_queue);
+		}
+
+		return true;
+	}
+
+	// Downloads size bytes from clmem at ofs to pDst through the staging buffer. Two chunks are in flight at a time, and each is copied out as soon as it lands.
+	// Blocks until all the data is in pDst. Anything queued before on command_queue (e.g. the kernel producing clmem) runs first.
+	bool read_from_buffer_staged(cl_command_queue command_queue, const cl_mem clmem, size_t ofs, void* pDst, size_t size, ocl_staging_buffer& sb)
+	{
+		const size_t chunk_size = sb.m_pinned.m_size / 2;
+		if (!chunk_size)
+			return false;
+
+		const size_t num_chunks = (size + chunk_size - 1) / chunk_size;
+
+		auto enqueue_chunk = [&](size_t chunk) -> bool
+		{
+			const uint32_t half = (uint32_t)(chunk & 1);
+			if (!wait_staging_half(sb, half))
+				return false;
+
+			const size_t chunk_ofs = chunk * chunk_size;
+
+			cl_serializer serializer(this);
+
+			cl_int ret = clEnqueueReadBuffer(command_queue, clmem, CL_FALSE, ofs + chunk_ofs, std::min(chunk_size, size - chunk_ofs), sb.m_pinned.m_pPtr + half * chunk_size, 0, nullptr, &sb.m_events[half]);
+			if (ret != CL_SUCCESS)
+			{
+				ocl_error_printf("ocl::read_from_buffer_staged: clEnqueueReadBuffer() failed with error %i\n", ret);
+				sb.m_events[half] = nullptr;
+				return false;
+			}
+
+			clFlush(command_queue);
+			return true;
+		};
+
+		for (size_t chunk = 0; (chunk < 2) && (chunk < num_chunks); chunk++)
+			if (!enqueue_chunk(chunk))
+				return false;
+
+		for (size_t chunk = 0; chunk < num_chunks; chunk++)
+		{
+			const uint32_t half = (uint32_t)(chunk & 1);
+			if (!wait_staging_half(sb, half))
+				return false;
+
+			const size_t chunk_ofs = chunk * chunk_size;
+			memcpy(static_cast<uint8_t*>(pDst) + chunk_ofs, sb.m_pinned.m_pPtr + half * chunk_size, std::min(chunk_size, size - chunk_ofs));
+
+			if ((chunk + 2 < num_chunks) && (!enqueue_chunk(chunk + 2)))
+				return false;
+		}
+
+		return true;
+	}
+
+	cl_mem create_read_image_u8(uint32_t width, uint32_t height, const void* pPixels, uint32_t bytes_per_pixel, bool normalized)
+	{
+		cl_image_format fmt = get_image_format(bytes_per_pixel, normalized);
+
+		cl_image_desc desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+		desc.image_width = width;
+		desc.image_height = height;
+		desc.image_row_pitch = width * bytes_per_pixel;
+
+		cl_int ret;
+		cl_mem img = create_tracked_mem_object(cMemImage, (uint64_t)width * height * bytes_per_pixel, ret,
+			[&](cl_int& r) { return clCreateImage(m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &fmt, &desc, (void*)pPixels, &r); });
+		if (!img)
+		{
+			ocl_error_printf("ocl::create_read_image_u8: clCreateImage() failed!\n");
+			return nullptr;
+		}
+
+		return img;
+	}
+
+	cl_mem create_write_image_u8(uint32_t width, uint32_t height, uint32_t bytes_per_pixel, bool normalized)
+	{
+		cl_image_format fmt = get_image_format(bytes_per_pixel, normalized);
+
+		cl_image_desc desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+		desc.image_width = width;
+		desc.image_height = height;
+
+		cl_int ret;
+		cl_mem img = create_tracked_mem_object(cMemImage, (uint64_t)width * height * bytes_per_pixel, ret,
+			[&](cl_int& r) { return clCreateImage(m_context, CL_MEM_WRITE_ONLY, &fmt, &desc, nullptr, &r); });
+		if (!img)
+		{
+			ocl_error_printf("ocl::create_write_image_u8: clCreateImage() failed!\n");
+			return nullptr;
+		}
+
+		return img;
+	}
+
+	bool read_from_image(cl_command_queue command_queue, cl_mem img, void* pPixels, uint32_t ofs_x, uint32_t ofs_y, uint32_t width, uint32_t height)
+	{
+		cl_serializer serializer(this);
+
+		size_t origin[3] = { ofs_x, ofs_y, 0 }, region[3] = { width, height, 1 };
+
+		cl_int err = clEnqueueReadImage(command_queue, img, CL_TRUE, origin, region, 0, 0, pPixels, 0, NULL, NULL);
+		if (err != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::read_from_image: clEnqueueReadImage() failed!\n");
+			return false;
+		}
+
+		return true;
+	}
+
+	bool run_1D(cl_command_queue command_queue, const cl_kernel kernel, size_t num_items)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel,
+			1,  // work_dim
+			nullptr, // global_work_offset
+			&num_items, // global_work_size
+			nullptr, // local_work_size
+			0, // num_events_in_wait_list
+			nullptr, // event_wait_list
+			nullptr // event
+		);
+
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::run_1D: clEnqueueNDRangeKernel() failed!\n");
+			return false;
+		}
+
+		return true;
+	}
+
+	bool run_1D(cl_command_queue command_queue, const cl_kernel kernel, size_t ofs, size_t num_items)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel,
+			1,  // work_dim
+			&ofs, // global_work_offset
+			&num_items, // global_work_size
+			nullptr, // local_work_size
+			0, // num_events_in_wait_list
+			nullptr, // event_wait_list
+			nullptr // event
+		);
+
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::run_1D: clEnqueueNDRangeKernel() failed!\n");
+			return false;
+		}
+
+		return true;
+	}
+
+	bool run_2D(cl_command_queue command_queue, const cl_kernel kernel, size_t width, size_t height)
+	{
+		cl_serializer serializer(this);
+
+		size_t num_global_items[2] = { width, height };
+		//size_t num_local_items[2] = { 1, 1 };
+
+		cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel,
+			2,  // work_dim
+			nullptr, // global_work_offset
+			num_global_items, // global_work_size
+			nullptr, // local_work_size
+			0, // num_events_in_wait_list
+			nullptr, // event_wait_list
+			nullptr // event
+		);
+
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::run_2D: clEnqueueNDRangeKernel() failed!\n");
+			return false;
+		}
+
+		return true;
+	}
+
+	bool run_2D(cl_command_queue command_queue, const cl_kernel kernel, size_t ofs_x, size_t ofs_y, size_t width, size_t height)
+	{
+		cl_serializer serializer(this);
+
+		size_t global_ofs[2] = { ofs_x, ofs_y };
+		size_t num_global_items[2] = { width, height };
+		//size_t num_local_items[2] = { 1, 1 };
+
+		cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel,
+			2,  // work_dim
+			global_ofs, // global_work_offset
+			num_global_items, // global_work_size
+			nullptr, // local_work_size
+			0, // num_events_in_wait_list
+			nullptr, // event_wait_list
+			nullptr // event
+		);
+
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::run_2D: clEnqueueNDRangeKernel() failed!\n");
+			return false;
+		}
+
+		return true;
+	}
+
+	// Submits the queued commands to the device without waiting for them to complete.
+	void submit(cl_command_queue command_queue)
+	{
+		cl_serializer serializer(this);
+
+		clFlush(command_queue);
+	}
+
+	void flush(cl_command_queue command_queue)
+	{
+		cl_serializer serializer(this);
+
+		clFlush(command_queue);
+		clFinish(command_queue);
+	}
+
+	template<typename T>
+	bool set_kernel_arg(cl_kernel kernel, uint32_t index, const T& obj)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clSetKernelArg(kernel, index, sizeof(T), (void*)&obj);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::set_kernel_arg: clSetKernelArg() failed!\n");
+			return false;
+		}
+		return true;
+	}
+
+	template<typename T>
+	bool set_kernel_args(cl_kernel kernel, const T& obj1)
+	{
+		cl_serializer serializer(this);
+
+		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::set_kernel_arg: clSetKernelArg() failed!\n");
+			return false;
+		}
+		return true;
+	}
+
+#define CHECK_ERR if (ret != CL_SUCCESS)	{ ocl_error_printf("ocl::set_kernel_args: clSetKernelArg() failed!\n"); return false; }
 
 	template<typename T, typename U>
 	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2)
@@ -566,115 +2433,916 @@ public:
 		return true;
 	}
 
-	template<typename T, typename U, typename V>
-	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3)
+	template<typename T, typename U, typename V>
+	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3)
+	{
+		cl_serializer serializer(this);
+		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
+		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
+		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
+		return true;
+	}
+
+	template<typename T, typename U, typename V, typename W>
+	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4)
+	{
+		cl_serializer serializer(this);
+		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
+		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
+		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
+		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
+		return true;
+	}
+
+	template<typename T, typename U, typename V, typename W, typename X>
+	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4, const X& obj5)
+	{
+		cl_serializer serializer(this);
+		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
+		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
+		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
+		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
+		ret = clSetKernelArg(kernel, 4, sizeof(X), (void*)&obj5); CHECK_ERR
+		return true;
+	}
+
+	template<typename T, typename U, typename V, typename W, typename X, typename Y>
+	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4, const X& obj5, const Y& obj6)
+	{
+		cl_serializer serializer(this);
+		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
+		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
+		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
+		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
+		ret = clSetKernelArg(kernel, 4, sizeof(X), (void*)&obj5); CHECK_ERR
+		ret = clSetKernelArg(kernel, 5, sizeof(Y), (void*)&obj6); CHECK_ERR
+		return true;
+	}
+
+	template<typename T, typename U, typename V, typename W, typename X, typename Y, typename Z>
+	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4, const X& obj5, const Y& obj6, const Z& obj7)
+	{
+		cl_serializer serializer(this);
+		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
+		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
+		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
+		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
+		ret = clSetKernelArg(kernel, 4, sizeof(X), (void*)&obj5); CHECK_ERR
+		ret = clSetKernelArg(kernel, 5, sizeof(Y), (void*)&obj6); CHECK_ERR
+		ret = clSetKernelArg(kernel, 6, sizeof(Z), (void*)&obj7); CHECK_ERR
+		return true;
+	}
+
+	template<typename T, typename U, typename V, typename W, typename X, typename Y, typename Z, typename A>
+	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4, const X& obj5, const Y& obj6, const Z& obj7, const A& obj8)
 	{
 		cl_serializer serializer(this);
 		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
 		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
 		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
+		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
+		ret = clSetKernelArg(kernel, 4, sizeof(X), (void*)&obj5); CHECK_ERR
+		ret = clSetKernelArg(kernel, 5, sizeof(Y), (void*)&obj6); CHECK_ERR
+		ret = clSetKernelArg(kernel, 6, sizeof(Z), (void*)&obj7); CHECK_ERR
+		ret = clSetKernelArg(kernel, 7, sizeof(A), (void*)&obj8); CHECK_ERR
+		return true;
+	}
+#undef CHECK_ERR
+
+private:
+	cl_platform_id m_platform_id = nullptr;
+	cl_device_id m_device_id = nullptr;
+	cl_context m_context = nullptr;
+	cl_command_queue m_command_queue = nullptr;
+	cl_program m_program = nullptr;
+
+	std::vector<cl_device_id> m_device_ids;
+	std::vector<float> m_device_scores;
+	std::vector<ocl_device_caps> m_device_caps;
+	std::vector<cl_device_id> m_sub_device_ids;
+	cl_device_affinity_domain m_affinity_domain = 0;
+
+	enum program_state
+	{
+		cProgramNone,
+		cProgramBuilding,
+		cProgramReady,
+		cProgramFailed
+	};
+
+	// Protects m_program and m_program_state.
+	std::mutex m_program_mutex;
+	std::atomic<uint32_t> m_program_generation { 0 };
+	std::condition_variable m_program_cv;
+	program_state m_program_state = cProgramNone;
+	std::thread m_build_thread;
+
+	// Source of the current program, used to build its variants.
+	ocl_program_module_vec m_program_modules;
+
+	// Compiled (not linked) modules of multi-module programs, keyed by a hash of everything that went into compiling them. Protected by m_module_mutex,
+	// which is locked after m_variant_mutex.
+	struct compiled_module
+	{
+		uint64_t m_key;
+		cl_program m_program;
+	};
+	std::mutex m_module_mutex;
+	std::vector<compiled_module> m_compiled_modules;
+
+	// Specialized builds of the current program, keyed by their build options and the program generation they were built from. 
+	// Protected by m_variant_mutex, which is always locked before m_program_mutex. m_variant_cv is signaled when a variant finishes building.
+	struct program_variant
+	{
+		std::string m_options;
+		uint32_t m_generation;
+		cl_program m_program;
+		bool m_building;
+	};
+	std::mutex m_variant_mutex;
+	std::condition_variable m_variant_cv;
+	std::vector<program_variant*> m_program_variants;
+
+	// Threads for run_parallel_builds(), started by the first parallel build and kept until deinit(). m_build_job_pool_mutex only guards starting them.
+	std::mutex m_build_job_pool_mutex;
+	ocl_job_pool m_build_job_pool;
+
+	enum { cMaxKernelPoolBatches = 16 };
+
+	// Pooled kernels of one kernel function, all from program generation m_kernel_pool_generation. Protected by m_kernel_pool_mutex, which is always locked before m_program_mutex.
+	struct kernel_pool_entry
+	{
+		std::string m_name;
+		std::vector<cl_kernel> m_free_kernels;
+		uint32_t m_total_kernels = 0;
+		uint32_t m_kernels_in_use = 0;
+		uint32_t m_peak_kernels_in_use = 0;
+		uint64_t m_total_acquires = 0;
+	};
+	std::mutex m_kernel_pool_mutex;
+	std::vector<kernel_pool_entry> m_kernel_pool;
+	uint32_t m_kernel_pool_generation = 0;
+	uint64_t m_kernel_pool_bulk_creates = 0;
+	uint32_t m_kernel_pool_kernels_in_use = 0;
+	uint32_t m_kernel_pool_peak_kernels_in_use = 0;
+
+	kernel_pool_entry* find_kernel_pool_entry(const char* pName)
+	{
+		for (uint32_t i = 0; i < m_kernel_pool.size(); i++)
+			if (m_kernel_pool[i].m_name == pName)
+				return &m_kernel_pool[i];
+		return nullptr;
+	}
+
+	// Creates num_batches kernels of every kernel function in the program and adds them to the pool. Called with m_kernel_pool_mutex held.
+	bool grow_kernel_pool(uint32_t num_batches, uint32_t generation)
+	{
+		// Holding the program lock keeps a concurrent rebuild from releasing the program under us.
+		std::lock_guard<std::mutex> lock(m_program_mutex);
+
+		if ((!m_program) || (m_program_generation.load(std::memory_order_relaxed) != generation))
+			return false;
+
+		// The pool lock already serializes this. Some drivers aren't thread safe here:
+		// https://community.intel.com/t5/OpenCL-for-CPU/Bug-report-clCreateKernelsInProgram-is-not-thread-safe/td-p/1159771
+		cl_serializer serializer(this);
+
+		cl_uint num_kernels = 0;
+		if ((clCreateKernelsInProgram(m_program, 0, nullptr, &num_kernels) != CL_SUCCESS) || (!num_kernels))
+		{
+			ocl_error_printf("ocl::grow_kernel_pool: clCreateKernelsInProgram() failed!\n");
+			return false;
+		}
+
+		std::vector<cl_kernel> kernels(num_kernels);
+
+		for (uint32_t batch = 0; batch < num_batches; batch++)
+		{
+			if (clCreateKernelsInProgram(m_program, num_kernels, kernels.data(), nullptr) != CL_SUCCESS)
+			{
+				ocl_error_printf("ocl::grow_kernel_pool: clCreateKernelsInProgram() failed!\n");
+				return batch > 0;
+			}
+
+			m_kernel_pool_bulk_creates++;
+
+			for (uint32_t i = 0; i < num_kernels; i++)
+			{
+				char name[256];
+				if (clGetKernelInfo(kernels[i], CL_KERNEL_FUNCTION_NAME, sizeof(name), name, nullptr) != CL_SUCCESS)
+				{
+					clReleaseKernel(kernels[i]);
+					continue;
+				}
+
+				kernel_pool_entry* pEntry = find_kernel_pool_entry(name);
+				if (!pEntry)
+				{
+					m_kernel_pool.push_back(kernel_pool_entry());
+					pEntry = &m_kernel_pool.back();
+					pEntry->m_name = name;
+				}
+
+				pEntry->m_free_kernels.push_back(kernels[i]);
+				pEntry->m_total_kernels++;
+			}
+		}
+
+		return true;
+	}
+
+	// Releases the free kernels and forgets about the ones in use (release_pooled_kernel() releases those once their generation is stale).
+	// Called with m_kernel_pool_mutex held, or from deinit().
+	void release_kernel_pool()
+	{
+		cl_serializer serializer(this);
+
+		for (uint32_t i = 0; i < m_kernel_pool.size(); i++)
+			for (uint32_t j = 0; j < m_kernel_pool[i].m_free_kernels.size(); j++)
+				clReleaseKernel(m_kernel_pool[i].m_free_kernels[j]);
+		m_kernel_pool.resize(0);
+		m_kernel_pool_kernels_in_use = 0;
+	}
+
+	// Waits for the pending transfer of one half of the staging buffer, if any.
+	bool wait_staging_half(ocl_staging_buffer& sb, uint32_t half)
+	{
+		cl_event e = sb.m_events[half];
+		if (!e)
+			return true;
+
+		sb.m_events[half] = nullptr;
+
+		cl_int ret = clWaitForEvents(1, &e);
+
+		cl_serializer serializer(this);
+		clReleaseEvent(e);
+
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::wait_staging_half: clWaitForEvents() failed with error %i\n", ret);
+			return false;
+		}
+
+		return true;
+	}
+
+	struct pooled_free_buffer
+	{
+		cl_mem m_buf;
+		uint64_t m_last_used;	// m_buffer_pool_tick when it was released
+	};
+
+	// Free buffers of one flags/size class, in release order. Protected by m_buffer_pool_mutex, which is never held while calling the driver.
+	struct buffer_pool_class
+	{
+		cl_mem_flags m_flags = 0;
+		size_t m_size = 0;
+		std::vector<pooled_free_buffer> m_free_buffers;
+	};
+	std::mutex m_buffer_pool_mutex;
+	std::vector<buffer_pool_class> m_buffer_pool;
+	ocl_buffer_pool_stats m_buffer_pool_stats = { };
+	uint64_t m_buffer_pool_tick = 0;
+	size_t m_buffer_pool_min_size = 4096;
+	size_t m_buffer_pool_max_size = 0;
+	uint64_t m_buffer_pool_max_free_bytes = 0;
+
+	buffer_pool_class* find_buffer_pool_class(cl_mem_flags flags, size_t size)
+	{
+		for (uint32_t i = 0; i < m_buffer_pool.size(); i++)
+			if ((m_buffer_pool[i].m_flags == flags) && (m_buffer_pool[i].m_size == size))
+				return &m_buffer_pool[i];
+		return nullptr;
+	}
+
+	// Releases the free buffers and resets the stats. Buffers still in use are the caller's responsibility.
+	void release_buffer_pool()
+	{
+		for (uint32_t i = 0; i < m_buffer_pool.size(); i++)
+			for (uint32_t j = 0; j < m_buffer_pool[i].m_free_buffers.size(); j++)
+				clReleaseMemObject(m_buffer_pool[i].m_free_buffers[j].m_buf);
+		m_buffer_pool.resize(0);
+
+		memset(&m_buffer_pool_stats, 0, sizeof(m_buffer_pool_stats));
+		m_buffer_pool_tick = 0;
+	}
+
+	// Removes the least recently released free buffer from the pool and returns it, or nullptr if the pool has no free buffers. The caller releases it.
+	cl_mem evict_lru_pooled_buffer(uint64_t& size)
+	{
+		std::lock_guard<std::mutex> pool_lock(m_buffer_pool_mutex);
+
+		buffer_pool_class* pOldest = nullptr;
+		for (uint32_t i = 0; i < m_buffer_pool.size(); i++)
+		{
+			buffer_pool_class& c = m_buffer_pool[i];
+			if ((c.m_free_buffers.size()) && ((!pOldest) || (c.m_free_buffers.front().m_last_used < pOldest->m_free_buffers.front().m_last_used)))
+				pOldest = &c;
+		}
+
+		if (!pOldest)
+			return nullptr;
+
+		cl_mem buf = pOldest->m_free_buffers.front().m_buf;
+		pOldest->m_free_buffers.erase(pOldest->m_free_buffers.begin());
+
+		size = pOldest->m_size;
+
+		m_buffer_pool_stats.m_free_bytes -= size;
+		m_buffer_pool_stats.m_free_buffers--;
+		m_buffer_pool_stats.m_total_bytes -= size;
+		m_buffer_pool_stats.m_total_buffers--;
+
+		return buf;
+	}
+
+	enum mem_object_type
+	{
+		cMemBuffer,
+		cMemImage,
+		cMemSubBuffer
+	};
+
+	struct mem_object_info
+	{
+		uint64_t m_size;	// Bytes counted against the budget
+		mem_object_type m_type;
+	};
+
+	// Every live memory object created through ocl. Protected by m_mem_mutex, which is never held while calling the driver or taking m_buffer_pool_mutex.
+	std::mutex m_mem_mutex;
+	std::unordered_map<cl_mem, mem_object_info> m_mem_objects;
+	ocl_mem_stats m_mem_stats = { };
+
+	// Releases the buffer pool's least recently used free buffer and counts the eviction. Returns false if there was nothing to evict.
+	bool evict_pooled_buffer()
+	{
+		uint64_t evicted_size = 0;
+		cl_mem buf = evict_lru_pooled_buffer(evicted_size);
+		if (!buf)
+			return false;
+
+		destroy_buffer(buf);
+
+		std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+		m_mem_stats.m_total_evictions++;
+		m_mem_stats.m_total_evicted_bytes += evicted_size;
 		return true;
 	}
 
-	template<typename T, typename U, typename V, typename W>
-	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4)
+	// Counts size bytes against the budget, evicting free pool buffers (least recently used first) until they fit. Returns false if they can't.
+	bool reserve_device_memory(uint64_t size)
+	{
+		if (!size)
+			return true;
+
+		for ( ; ; )
+		{
+			{
+				std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+
+				if ((size <= m_mem_stats.m_budget) && (m_mem_stats.m_allocated_bytes <= m_mem_stats.m_budget - size))
+				{
+					m_mem_stats.m_allocated_bytes += size;
+					m_mem_stats.m_peak_allocated_bytes = std::max(m_mem_stats.m_peak_allocated_bytes, m_mem_stats.m_allocated_bytes);
+					return true;
+				}
+			}
+
+			if (!evict_pooled_buffer())
+				break;
+		}
+
+		// Not an error by itself: callers may free memory of their own and retry. Whoever gives up reports it.
+		std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+		m_mem_stats.m_total_failed_allocs++;
+		m_mem_stats.m_total_budget_misses++;
+		return false;
+	}
+
+	// Creates a memory object with create_func(ret) through the budget. If the driver runs out of memory anyway (the budget is only an estimate of what's available,
+	// and other processes share the device), the pool's free buffers are evicted one at a time, least recently used first, retrying after each until it succeeds.
+	template<typename F>
+	cl_mem create_tracked_mem_object(mem_object_type type, uint64_t budget_size, cl_int& ret, F create_func)
+	{
+		if (!reserve_device_memory(budget_size))
+		{
+			ret = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+			return nullptr;
+		}
+
+		cl_mem obj;
+		{
+			cl_serializer serializer(this);
+			obj = create_func(ret);
+		}
+
+		while (((ret == CL_MEM_OBJECT_ALLOCATION_FAILURE) || (ret == CL_OUT_OF_RESOURCES)) && (evict_pooled_buffer()))
+		{
+			cl_serializer serializer(this);
+			obj = create_func(ret);
+		}
+
+		std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+
+		if (ret != CL_SUCCESS)
+		{
+			m_mem_stats.m_allocated_bytes -= budget_size;
+			m_mem_stats.m_total_failed_allocs++;
+			return nullptr;
+		}
+
+		mem_object_info info;
+		info.m_size = budget_size;
+		info.m_type = type;
+		m_mem_objects[obj] = info;
+
+		switch (type)
+		{
+		case cMemBuffer: m_mem_stats.m_num_buffers++; break;
+		case cMemImage: m_mem_stats.m_num_images++; break;
+		case cMemSubBuffer: m_mem_stats.m_num_sub_buffers++; break;
+		}
+
+		return obj;
+	}
+
+	cl_mem create_tracked_buffer(cl_mem_flags flags, size_t size, void* pHost_ptr, cl_int& ret)
+	{
+		const bool host_memory = (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR)) != 0;
+
+		return create_tracked_mem_object(cMemBuffer, host_memory ? 0 : size, ret, [&](cl_int& r) { return clCreateBuffer(m_context, flags, size, pHost_ptr, &r); });
+	}
+
+	// Must be called before the object is released, since the driver may reuse its handle right after.
+	void untrack_mem_object(cl_mem obj)
+	{
+		std::lock_guard<std::mutex> mem_lock(m_mem_mutex);
+
+		auto it = m_mem_objects.find(obj);
+		if (it == m_mem_objects.end())
+			return;
+
+		m_mem_stats.m_allocated_bytes -= it->second.m_size;
+
+		switch (it->second.m_type)
+		{
+		case cMemBuffer: m_mem_stats.m_num_buffers--; break;
+		case cMemImage: m_mem_stats.m_num_images--; break;
+		case cMemSubBuffer: m_mem_stats.m_num_sub_buffers--; break;
+		}
+
+		m_mem_objects.erase(it);
+	}
+
+	ocl_binary_cache m_binary_cache;
+
+	const ocl_embedded_binary* m_pEmbedded_binaries = nullptr;
+	uint32_t m_num_embedded_binaries = 0;
+
+	double m_device_select_secs = 0.0;
+	double m_context_create_secs = 0.0;
+	double m_program_build_secs = 0.0;
+	std::atomic<double> m_program_rebuild_secs { 0.0 };
+	
+	bool m_use_mutex = false;
+	std::mutex m_ocl_mutex;
+
+	// This helper object is used to optionally serialize all calls to the CL driver after initialization.
+	// Currently this is only used to work around race conditions in the Windows AMD driver.
+	// m_ocl_mutex is always the innermost lock: it may be taken with m_program_mutex, m_variant_mutex or m_module_mutex held, never the other way around.
+	struct cl_serializer
+	{
+		inline cl_serializer(const cl_serializer&);
+		cl_serializer& operator= (const cl_serializer&);
+
+		inline cl_serializer(ocl *p) : m_p(p)
+		{
+			if (m_p->m_use_mutex)
+				m_p->m_ocl_mutex.lock();
+		}
+
+		inline ~cl_serializer()
+		{
+			if (m_p->m_use_mutex)
+				m_p->m_ocl_mutex.unlock();
+		}
+
+	private:
+		ocl* m_p;
+	};
+	
+	// Partitions the candidate device and adds up to max_sub_devices of the resulting sub-devices to the context's devices.
+	bool create_sub_devices(const ocl_device_candidate& parent, const cl_device_partition_property* pProps, uint32_t max_sub_devices = UINT32_MAX, bool report_unsupported = true)
+	{
+		cl_uint num_sub_devices = 0;
+		cl_int ret = clCreateSubDevices(parent.m_device_id, pProps, 0, nullptr, &num_sub_devices);
+		if ((ret != CL_SUCCESS) || (!num_sub_devices))
+		{
+			if (report_unsupported)
+				ocl_error_printf("ocl::init: clCreateSubDevices() failed with %i\n", ret);
+			return false;
+		}
+
+		m_sub_device_ids.resize(num_sub_devices);
+		ret = clCreateSubDevices(parent.m_device_id, pProps, num_sub_devices, m_sub_device_ids.data(), nullptr);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::init: clCreateSubDevices() failed with %i\n", ret);
+			m_sub_device_ids.resize(0);
+			return false;
+		}
+
+		const uint32_t num_used = (num_sub_devices < max_sub_devices) ? num_sub_devices : max_sub_devices;
+
+		for (uint32_t i = 0; i < num_used; i++)
+		{
+			// Sub-devices have their own limits (compute units etc.)
+			ocl_device_caps caps;
+			query_device_caps(parent.m_caps.m_platform_name, parent.m_caps.m_platform_version, m_sub_device_ids[i], caps);
+
+			m_device_ids.push_back(m_sub_device_ids[i]);
+			m_device_scores.push_back(parent.m_score * (float)caps.m_compute_units / (float)(parent.m_caps.m_compute_units ? parent.m_caps.m_compute_units : 1));
+			m_device_caps.push_back(caps);
+		}
+
+		return true;
+	}
+
+	// Fills in m_device_ids/m_device_scores. In multi-device mode the other usable devices on the primary device's platform are added in score order (a context can't span platforms).
+	// If requested, a primary CPU device is instead split into equally sized sub-devices.
+	bool select_context_devices(const std::vector<ocl_device_candidate>& candidates, int best_index, const ocl_init_params& params)
+	{
+		const ocl_device_candidate& best = candidates[best_index];
+
+		if ((params.m_cpu_affinity_domain) && (best.m_caps.m_type & CL_DEVICE_TYPE_CPU))
+		{
+			const cl_device_partition_property props[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, (cl_device_partition_property)params.m_cpu_affinity_domain, 0 };
+			if (create_sub_devices(best, props, UINT32_MAX, false))
+			{
+				m_affinity_domain = params.m_cpu_affinity_domain;
+
+				printf("Partitioned CPU device into %u %s affinity domain sub-devices\n", (uint32_t)m_device_ids.size(), (params.m_cpu_affinity_domain == CL_DEVICE_AFFINITY_DOMAIN_NUMA) ? "NUMA" : "cache");
+				return true;
+			}
+
+			// Single socket machines usually can't be partitioned by NUMA node, which isn't an error.
+			printf("Couldn't partition CPU device by affinity domain, using the whole device\n");
+		}
+
+		if ((params.m_cpu_sub_devices >= 2) && (best.m_caps.m_type & CL_DEVICE_TYPE_CPU))
+		{
+			const cl_uint units_per_sub_device = best.m_caps.m_compute_units / params.m_cpu_sub_devices;
+			if (!units_per_sub_device)
+			{
+				ocl_error_printf("ocl::init: Device only has %u compute units, can't create %u sub-devices\n", best.m_caps.m_compute_units, params.m_cpu_sub_devices);
+				return false;
+			}
+
+			const cl_device_partition_property props[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)units_per_sub_device, 0 };
+			if (!create_sub_devices(best, props, params.m_cpu_sub_devices))
+				return false;
+
+			printf("Partitioned CPU device into %u sub-devices of %u compute units\n", (uint32_t)m_device_ids.size(), units_per_sub_device);
+			return true;
+		}
+
+		m_device_ids.push_back(best.m_device_id);
+		m_device_scores.push_back(best.m_score);
+		m_device_caps.push_back(best.m_caps);
+
+		while (m_device_ids.size() < params.m_max_devices)
+		{
+			int next_index = -1;
+			for (uint32_t i = 0; i < candidates.size(); i++)
+			{
+				const ocl_device_candidate& c = candidates[i];
+				if ((!c.m_usable) || (c.m_platform_id != best.m_platform_id))
+					continue;
+				if (std::find(m_device_ids.begin(), m_device_ids.end(), c.m_device_id) != m_device_ids.end())
+					continue;
+				if ((next_index < 0) || (c.m_score > candidates[next_index].m_score))
+					next_index = i;
+			}
+
+			if (next_index < 0)
+				break;
+
+			m_device_ids.push_back(candidates[next_index].m_device_id);
+			m_device_scores.push_back(candidates[next_index].m_score);
+			m_device_caps.push_back(candidates[next_index].m_caps);
+		}
+
+		return true;
+	}
+
+	// String values can be several KB (CL_DEVICE_EXTENSIONS), so the size is queried first.
+	static std::string get_platform_string(cl_platform_id platform_id, cl_platform_info param)
+	{
+		size_t size = 0;
+		if ((clGetPlatformInfo(platform_id, param, 0, nullptr, &size) != CL_SUCCESS) || (!size))
+			return std::string();
+
+		std::vector<char> buf(size + 1, 0);
+		if (clGetPlatformInfo(platform_id, param, size, buf.data(), nullptr) != CL_SUCCESS)
+			return std::string();
+		return std::string(buf.data());
+	}
+
+	static std::string get_device_string(cl_device_id device_id, cl_device_info param)
 	{
-		cl_serializer serializer(this);
-		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
-		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
-		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
-		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
-		return true;
+		size_t size = 0;
+		if ((clGetDeviceInfo(device_id, param, 0, nullptr, &size) != CL_SUCCESS) || (!size))
+			return std::string();
+
+		std::vector<char> buf(size + 1, 0);
+		if (clGetDeviceInfo(device_id, param, size, buf.data(), nullptr) != CL_SUCCESS)
+			return std::string();
+		return std::string(buf.data());
 	}
 
-	template<typename T, typename U, typename V, typename W, typename X>
-	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4, const X& obj5)
+	template<typename T>
+	static T get_device_value(cl_device_id device_id, cl_device_info param)
 	{
-		cl_serializer serializer(this);
-		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
-		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
-		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
-		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
-		ret = clSetKernelArg(kernel, 4, sizeof(X), (void*)&obj5); CHECK_ERR
-		return true;
+		T val;
+		memset(&val, 0, sizeof(val));
+		if (clGetDeviceInfo(device_id, param, sizeof(val), &val, nullptr) != CL_SUCCESS)
+			memset(&val, 0, sizeof(val));
+		return val;
 	}
 
-	template<typename T, typename U, typename V, typename W, typename X, typename Y>
-	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4, const X& obj5, const Y& obj6)
+	static void query_device_caps(const std::string& platform_name, const std::string& platform_version, cl_device_id device_id, ocl_device_caps& caps)
 	{
-		cl_serializer serializer(this);
-		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
-		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
-		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
-		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
-		ret = clSetKernelArg(kernel, 4, sizeof(X), (void*)&obj5); CHECK_ERR
-		ret = clSetKernelArg(kernel, 5, sizeof(Y), (void*)&obj6); CHECK_ERR
-		return true;
+		caps.m_platform_name = platform_name;
+		caps.m_platform_version = platform_version;
+		caps.m_device_name = get_device_string(device_id, CL_DEVICE_NAME);
+		caps.m_device_vendor = get_device_string(device_id, CL_DEVICE_VENDOR);
+		caps.m_device_version = get_device_string(device_id, CL_DEVICE_VERSION);
+		caps.m_driver_version = get_device_string(device_id, CL_DRIVER_VERSION);
+		caps.m_extensions = get_device_string(device_id, CL_DEVICE_EXTENSIONS);
+
+		caps.m_type = get_device_value<cl_device_type>(device_id, CL_DEVICE_TYPE);
+		caps.m_compute_units = get_device_value<cl_uint>(device_id, CL_DEVICE_MAX_COMPUTE_UNITS);
+		caps.m_clock_mhz = get_device_value<cl_uint>(device_id, CL_DEVICE_MAX_CLOCK_FREQUENCY);
+		caps.m_available = get_device_value<cl_bool>(device_id, CL_DEVICE_AVAILABLE) != CL_FALSE;
+		caps.m_compiler_available = get_device_value<cl_bool>(device_id, CL_DEVICE_COMPILER_AVAILABLE) != CL_FALSE;
+
+		caps.m_max_work_group_size = get_device_value<size_t>(device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE);
+		caps.m_max_work_item_dimensions = get_device_value<cl_uint>(device_id, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS);
+		if (caps.m_max_work_item_dimensions >= 3)
+		{
+			std::vector<size_t> sizes(caps.m_max_work_item_dimensions);
+			if (clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t) * sizes.size(), sizes.data(), nullptr) == CL_SUCCESS)
+				memcpy(caps.m_max_work_item_sizes, sizes.data(), sizeof(caps.m_max_work_item_sizes));
+		}
+
+		caps.m_global_mem_size = get_device_value<cl_ulong>(device_id, CL_DEVICE_GLOBAL_MEM_SIZE);
+		caps.m_global_mem_cache_size = get_device_value<cl_ulong>(device_id, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE);
+		caps.m_global_mem_cacheline_size = get_device_value<cl_uint>(device_id, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE);
+		caps.m_local_mem_size = get_device_value<cl_ulong>(device_id, CL_DEVICE_LOCAL_MEM_SIZE);
+		caps.m_local_mem_is_dedicated = get_device_value<cl_device_local_mem_type>(device_id, CL_DEVICE_LOCAL_MEM_TYPE) == CL_LOCAL;
+		caps.m_max_mem_alloc_size = get_device_value<cl_ulong>(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+		caps.m_max_constant_buffer_size = get_device_value<cl_ulong>(device_id, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE);
+		caps.m_mem_base_addr_align = get_device_value<cl_uint>(device_id, CL_DEVICE_MEM_BASE_ADDR_ALIGN) / 8;
+		caps.m_host_unified_memory = get_device_value<cl_bool>(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY) != CL_FALSE;
+
+		const cl_device_info preferred_vec_params[ocl_device_caps::cTotalVecTypes] = 
+		{
+			CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT, CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG,
+			CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF
+		};
+		const cl_device_info native_vec_params[ocl_device_caps::cTotalVecTypes] =
+		{
+			CL_DEVICE_NATIVE_VECTOR_WIDTH_CHAR, CL_DEVICE_NATIVE_VECTOR_WIDTH_SHORT, CL_DEVICE_NATIVE_VECTOR_WIDTH_INT, CL_DEVICE_NATIVE_VECTOR_WIDTH_LONG,
+			CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT, CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE, CL_DEVICE_NATIVE_VECTOR_WIDTH_HALF
+		};
+		for (uint32_t i = 0; i < ocl_device_caps::cTotalVecTypes; i++)
+		{
+			caps.m_preferred_vector_width[i] = get_device_value<cl_uint>(device_id, preferred_vec_params[i]);
+			caps.m_native_vector_width[i] = get_device_value<cl_uint>(device_id, native_vec_params[i]);
+		}
+
+		caps.m_image_support = get_device_value<cl_bool>(device_id, CL_DEVICE_IMAGE_SUPPORT) != CL_FALSE;
+		if (caps.m_image_support)
+		{
+			caps.m_image2d_max_width = get_device_value<size_t>(device_id, CL_DEVICE_IMAGE2D_MAX_WIDTH);
+			caps.m_image2d_max_height = get_device_value<size_t>(device_id, CL_DEVICE_IMAGE2D_MAX_HEIGHT);
+			caps.m_image3d_max_width = get_device_value<size_t>(device_id, CL_DEVICE_IMAGE3D_MAX_WIDTH);
+			caps.m_image3d_max_height = get_device_value<size_t>(device_id, CL_DEVICE_IMAGE3D_MAX_HEIGHT);
+			caps.m_image3d_max_depth = get_device_value<size_t>(device_id, CL_DEVICE_IMAGE3D_MAX_DEPTH);
+			caps.m_image_max_buffer_size = get_device_value<size_t>(device_id, CL_DEVICE_IMAGE_MAX_BUFFER_SIZE);
+			caps.m_image_max_array_size = get_device_value<size_t>(device_id, CL_DEVICE_IMAGE_MAX_ARRAY_SIZE);
+			caps.m_max_read_image_args = get_device_value<cl_uint>(device_id, CL_DEVICE_MAX_READ_IMAGE_ARGS);
+			caps.m_max_write_image_args = get_device_value<cl_uint>(device_id, CL_DEVICE_MAX_WRITE_IMAGE_ARGS);
+		}
+
+		caps.m_single_fp_config = get_device_value<cl_device_fp_config>(device_id, CL_DEVICE_SINGLE_FP_CONFIG);
 	}
 
-	template<typename T, typename U, typename V, typename W, typename X, typename Y, typename Z>
-	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4, const X& obj5, const Y& obj6, const Z& obj7)
+	// Lists every device on every platform, and computes each device's throughput score.
+	static bool enumerate_devices(std::vector<ocl_device_candidate>& candidates)
 	{
-		cl_serializer serializer(this);
-		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
-		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
-		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
-		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
-		ret = clSetKernelArg(kernel, 4, sizeof(X), (void*)&obj5); CHECK_ERR
-		ret = clSetKernelArg(kernel, 5, sizeof(Y), (void*)&obj6); CHECK_ERR
-		ret = clSetKernelArg(kernel, 6, sizeof(Z), (void*)&obj7); CHECK_ERR
+		candidates.resize(0);
+
+		cl_uint num_platforms = 0;
+		cl_int ret = clGetPlatformIDs(0, NULL, &num_platforms);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::init: clGetPlatformIDs() failed with %i\n", ret);
+			return false;
+		}
+
+		if ((!num_platforms) || (num_platforms > INT_MAX))
+		{
+			ocl_error_printf("ocl::init: clGetPlatformIDs() returned an invalid number of num_platforms\n");
+			return false;
+		}
+
+		std::vector<cl_platform_id> platforms(num_platforms);
+
+		ret = clGetPlatformIDs(num_platforms, platforms.data(), NULL);
+		if (ret != CL_SUCCESS)
+		{
+			ocl_error_printf("ocl::init: clGetPlatformIDs() failed\n");
+			return false;
+		}
+
+		for (uint32_t platform_index = 0; platform_index < num_platforms; platform_index++)
+		{
+			cl_platform_id platform_id = platforms[platform_index];
+
+			cl_uint num_devices = 0;
+			ret = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 0, nullptr, &num_devices);
+			if ((ret != CL_SUCCESS) || (!num_devices))
+			{
+				// Some ICD's return CL_DEVICE_NOT_FOUND for platforms without devices, this isn't an error.
+				continue;
+			}
+
+			std::vector<cl_device_id> devices(num_devices);
+			ret = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, num_devices, devices.data(), nullptr);
+			if (ret != CL_SUCCESS)
+				continue;
+
+			const std::string platform_name(get_platform_string(platform_id, CL_PLATFORM_NAME));
+			const std::string platform_version(get_platform_string(platform_id, CL_PLATFORM_VERSION));
+
+			for (uint32_t device_index = 0; device_index < num_devices; device_index++)
+			{
+				ocl_device_candidate c;
+				c.m_platform_id = platform_id;
+				c.m_device_id = devices[device_index];
+				c.m_platform_index = platform_index;
+				query_device_caps(platform_name, platform_version, c.m_device_id, c.m_caps);
+				c.m_usable = c.m_caps.m_available && c.m_caps.m_compiler_available;
+				c.m_score = c.m_usable ? compute_device_score(c) : 0.0f;
+
+				candidates.push_back(c);
+			}
+		}
+
 		return true;
 	}
 
-	template<typename T, typename U, typename V, typename W, typename X, typename Y, typename Z, typename A>
-	bool set_kernel_args(cl_kernel kernel, const T& obj1, const U& obj2, const V& obj3, const W& obj4, const X& obj5, const Y& obj6, const Z& obj7, const A& obj8)
+	// Rough relative throughput estimate. A GPU compute unit is a SIMD core with many lanes, while a CPU compute unit is a single hardware thread, so GPU's get a fixed lane multiplier.
+	// Discrete GPU's (no host unified memory) are assumed to be faster than integrated GPU's with the same CU count/clock. More global memory is a small bonus.
+	static float compute_device_score(const ocl_device_candidate& c)
 	{
-		cl_serializer serializer(this);
-		cl_int ret = clSetKernelArg(kernel, 0, sizeof(T), (void*)&obj1); CHECK_ERR
-		ret = clSetKernelArg(kernel, 1, sizeof(U), (void*)&obj2); CHECK_ERR
-		ret = clSetKernelArg(kernel, 2, sizeof(V), (void*)&obj3); CHECK_ERR
-		ret = clSetKernelArg(kernel, 3, sizeof(W), (void*)&obj4); CHECK_ERR
-		ret = clSetKernelArg(kernel, 4, sizeof(X), (void*)&obj5); CHECK_ERR
-		ret = clSetKernelArg(kernel, 5, sizeof(Y), (void*)&obj6); CHECK_ERR
-		ret = clSetKernelArg(kernel, 6, sizeof(Z), (void*)&obj7); CHECK_ERR
-		ret = clSetKernelArg(kernel, 7, sizeof(A), (void*)&obj8); CHECK_ERR
-		return true;
+		const float OCL_GPU_LANES_PER_CU = 8.0f, OCL_ACCEL_LANES_PER_CU = 4.0f;
+
+		float lanes = 1.0f;
+		if (c.m_caps.m_type & CL_DEVICE_TYPE_GPU)
+			lanes = c.m_caps.m_host_unified_memory ? (OCL_GPU_LANES_PER_CU * .5f) : OCL_GPU_LANES_PER_CU;
+		else if (c.m_caps.m_type & CL_DEVICE_TYPE_ACCELERATOR)
+			lanes = OCL_ACCEL_LANES_PER_CU;
+
+		const float clock_mhz = c.m_caps.m_clock_mhz ? (float)c.m_caps.m_clock_mhz : 1000.0f;
+		const float mem_gb = (float)((double)c.m_caps.m_global_mem_size / (1024.0 * 1024.0 * 1024.0));
+		const float mem_factor = 1.0f + (mem_gb < 64.0f ? mem_gb : 64.0f) / 64.0f;
+
+		return (float)c.m_caps.m_compute_units * clock_mhz * lanes * mem_factor;
 	}
-#undef CHECK_ERR
 
-private:
-	cl_device_id m_device_id = nullptr;
-	cl_context m_context = nullptr;
-	cl_command_queue m_command_queue = nullptr;
-	cl_program m_program = nullptr;
-	cl_device_fp_config m_dev_fp_config;
-	
-	bool m_use_mutex = false;
-	std::mutex m_ocl_mutex;
+	// Parses the first run of digits of each version component ("31.0.101.4502", "OpenCL 3.0 CUDA 11.4.94") and compares them. Returns <0, 0, or >0.
+	static int compare_driver_versions(const std::string& a, const std::string& b)
+	{
+		const char* pA = a.c_str(), * pB = b.c_str();
+		for ( ; ; )
+		{
+			while (*pA && !isdigit((uint8_t)*pA)) pA++;
+			while (*pB && !isdigit((uint8_t)*pB)) pB++;
+			if (!*pA || !*pB)
+				return (*pA ? 1 : 0) - (*pB ? 1 : 0);
+
+			const unsigned long va = strtoul(pA, (char**)&pA, 10), vb = strtoul(pB, (char**)&pB, 10);
+			if (va != vb)
+				return (va < vb) ? -1 : 1;
+		}
+	}
 
-	// This helper object is used to optionally serialize all calls to the CL driver after initialization.
-	// Currently this is only used to work around race conditions in the Windows AMD driver.
-	struct cl_serializer
+	static bool string_contains_nocase(const std::string& str, const char* pFind)
 	{
-		inline cl_serializer(const cl_serializer&);
-		cl_serializer& operator= (const cl_serializer&);
+		const size_t find_len = strlen(pFind);
+		if (find_len > str.size())
+			return false;
 
-		inline cl_serializer(ocl *p) : m_p(p)
+		for (size_t i = 0; i + find_len <= str.size(); i++)
 		{
-			if (m_p->m_use_mutex)
-				m_p->m_ocl_mutex.lock();
+			size_t j;
+			for (j = 0; j < find_len; j++)
+				if (tolower((uint8_t)str[i + j]) != tolower((uint8_t)pFind[j]))
+					break;
+			if (j == find_len)
+				return true;
 		}
 
-		inline ~cl_serializer()
+		return false;
+	}
+
+	// Returns the index of the highest scoring usable device, or the device matching pOverride (an index into the device table, or a case insensitive substring of the platform/device name).
+	static int select_device(const std::vector<ocl_device_candidate>& candidates, const char* pOverride)
+	{
+		if ((pOverride) && (*pOverride))
 		{
-			if (m_p->m_use_mutex)
-				m_p->m_ocl_mutex.unlock();
+			bool is_index = true;
+			for (const char* p = pOverride; *p; p++)
+				if (!isdigit((uint8_t)*p))
+					is_index = false;
+
+			if (is_index)
+			{
+				const unsigned long index = strtoul(pOverride, nullptr, 10);
+				if ((index < candidates.size()) && (candidates[index].m_usable))
+					return (int)index;
+
+				ocl_error_printf("ocl::init: Device override index %lu is invalid or the device is unusable\n", index);
+				return -1;
+			}
+
+			int best_index = -1;
+			for (uint32_t i = 0; i < candidates.size(); i++)
+			{
+				const ocl_device_candidate& c = candidates[i];
+				if ((!c.m_usable) || ((!string_contains_nocase(c.m_caps.m_device_name, pOverride)) && (!string_contains_nocase(c.m_caps.m_platform_name, pOverride))))
+					continue;
+
+				if ((best_index < 0) || (c.m_score > candidates[best_index].m_score))
+					best_index = i;
+			}
+
+			if (best_index < 0)
+				ocl_error_printf("ocl::init: No usable device matches override \"%s\"\n", pOverride);
+
+			return best_index;
 		}
 
-	private:
-		ocl* m_p;
-	};
-	
+		int best_index = -1;
+		for (uint32_t i = 0; i < candidates.size(); i++)
+		{
+			const ocl_device_candidate& c = candidates[i];
+			if (!c.m_usable)
+				continue;
+
+			if (best_index >= 0)
+			{
+				const ocl_device_candidate& b = candidates[best_index];
+				if (c.m_score < b.m_score)
+					continue;
+
+				// Same score: prefer the newer driver on the assumption it's the better maintained one.
+				if ((c.m_score == b.m_score) && (compare_driver_versions(c.m_caps.m_driver_version, b.m_caps.m_driver_version) <= 0))
+					continue;
+			}
+
+			best_index = i;
+		}
+
+		return best_index;
+	}
+
+	static void print_device_table(const std::vector<ocl_device_candidate>& candidates, int selected_index)
+	{
+		printf("OpenCL devices:\n");
+		printf("   # Plat Type CUs  MHz   MemMB Unified        Score Device (driver)\n");
+
+		for (uint32_t i = 0; i < candidates.size(); i++)
+		{
+			const ocl_device_candidate& c = candidates[i];
+
+			const char* pType = (c.m_caps.m_type & CL_DEVICE_TYPE_GPU) ? "GPU" : ((c.m_caps.m_type & CL_DEVICE_TYPE_CPU) ? "CPU" : ((c.m_caps.m_type & CL_DEVICE_TYPE_ACCELERATOR) ? "ACC" : "???"));
+
+			printf("%c%3u %4u %4s %3u %4u %7u %7s %12.0f %s (%s)%s\n",
+				((int)i == selected_index) ? '*' : ' ',
+				i, c.m_platform_index, pType, c.m_caps.m_compute_units, c.m_caps.m_clock_mhz,
+				(uint32_t)(c.m_caps.m_global_mem_size / (1024U * 1024U)),
+				c.m_caps.m_host_unified_memory ? "yes" : "no",
+				c.m_score,
+				c.m_caps.m_device_name.c_str(), c.m_caps.m_driver_version.c_str(),
+				c.m_usable ? "" : " [unavailable]");
+		}
+	}
+
 	cl_image_format get_image_format(uint32_t bytes_per_pixel, bool normalized)
 	{
 		cl_image_format fmt;
@@ -691,3 +3359,276 @@ private:
 		return fmt;
 	}
 };
+
+// Carves sub-buffers (clCreateSubBuffer()) out of a few large slabs, so many small allocations don't each go through the driver's allocator or fragment device memory.
+// In bump mode, allocations are only released together by reset(), e.g. at the end of each request. In free list mode free() returns each one to its slab's free list, 
+// which coalesces neighbors. Not thread safe: use one arena per thread (or per opencl_context). All sub-buffers must be released before deinit().
+class ocl_buffer_arena
+{
+public:
+	enum arena_mode
+	{
+		cModeBump,
+		cModeFreeList
+	};
+
+	ocl_buffer_arena() { }
+	~ocl_buffer_arena() { deinit(); }
+
+	// Slabs are slab_size bytes (more for larger allocations) and created on demand. The slab flags must allow every flags value later passed to alloc().
+	bool init(ocl& o, size_t slab_size, arena_mode mode, cl_mem_flags slab_flags = CL_MEM_READ_WRITE)
+	{
+		deinit();
+
+		m_pOCL = &o;
+		m_mode = mode;
+		m_slab_flags = slab_flags;
+		m_alignment = o.get_sub_buffer_alignment();
+		m_slab_size = align(std::max<size_t>(slab_size, m_alignment));
+
+		return true;
+	}
+
+	void deinit()
+	{
+		if (!m_pOCL)
+			return;
+
+		reset();
+		assert(m_allocs.empty());
+
+		for (uint32_t i = 0; i < m_slabs.size(); i++)
+			m_pOCL->destroy_buffer(m_slabs[i].m_buf);
+		m_slabs.resize(0);
+
+		m_pOCL = nullptr;
+	}
+
+	bool is_initialized() const { return m_pOCL != nullptr; }
+	arena_mode get_mode() const { return m_mode; }
+
+	// Returns a sub-buffer of size bytes, or nullptr on failure. flags are the sub-buffer's access flags (CL_MEM_READ_ONLY etc.).
+	// Failures aren't reported, so callers can fall back to regular buffers.
+	cl_mem alloc(cl_mem_flags flags, size_t size)
+	{
+		if ((!m_pOCL) || (!size))
+			return nullptr;
+
+		const size_t aligned_size = align(size);
+
+		uint32_t slab_index;
+		size_t ofs;
+		if (!find_space(aligned_size, slab_index, ofs))
+		{
+			// Add a slab, big enough for this allocation.
+			slab s;
+			s.m_size = std::max(m_slab_size, aligned_size);
+			s.m_buf = m_pOCL->alloc_buffer(m_slab_flags, s.m_size, false);
+			if (!s.m_buf)
+				return nullptr;
+
+			s.m_used = 0;
+			if (m_mode == cModeFreeList)
+				s.m_free.push_back(range(0, s.m_size));
+
+			m_slabs.push_back(s);
+			m_total_slab_bytes += s.m_size;
+
+			if (!find_space(aligned_size, slab_index, ofs))
+				return nullptr;
+		}
+
+		cl_mem sub = m_pOCL->create_sub_buffer(m_slabs[slab_index].m_buf, flags, ofs, size, false);
+		if (!sub)
+		{
+			release_space(slab_index, ofs, aligned_size);
+			return nullptr;
+		}
+
+		alloc_info info;
+		info.m_buf = sub;
+		info.m_slab_index = slab_index;
+		info.m_ofs = ofs;
+		info.m_size = aligned_size;
+		m_allocs.push_back(info);
+
+		m_bytes_in_use += aligned_size;
+		m_peak_bytes_in_use = std::max(m_peak_bytes_in_use, m_bytes_in_use);
+		m_total_allocs++;
+
+		return sub;
+	}
+
+	// The same as ocl's functions of the same name, but carved from the arena.
+	cl_mem alloc_read_buffer(size_t size) { return alloc(CL_MEM_READ_ONLY, size); }
+	cl_mem alloc_write_buffer(size_t size) { return alloc(CL_MEM_WRITE_ONLY, size); }
+
+	cl_mem alloc_and_init_read_buffer(cl_command_queue command_queue, const void* pInit, size_t size)
+	{
+		cl_mem buf = alloc(CL_MEM_READ_ONLY, size);
+		if ((buf) && (!m_pOCL->write_to_buffer(command_queue, buf, pInit, size)))
+		{
+			free(buf);
+			return nullptr;
+		}
+		return buf;
+	}
+
+	// Free list mode: releases the sub-buffer and returns its space to the slab. In bump mode sub-buffers are only released by reset(), so this does nothing.
+	void free(cl_mem buf)
+	{
+		if ((!buf) || (m_mode != cModeFreeList))
+			return;
+
+		// Most recent allocations are the most likely to be freed first.
+		for (size_t i = m_allocs.size(); i-- > 0; )
+		{
+			if (m_allocs[i].m_buf == buf)
+			{
+				const alloc_info info = m_allocs[i];
+				m_allocs[i] = m_allocs.back();
+				m_allocs.pop_back();
+
+				m_pOCL->destroy_buffer(info.m_buf);
+				release_space(info.m_slab_index, info.m_ofs, info.m_size);
+				m_bytes_in_use -= info.m_size;
+				return;
+			}
+		}
+
+		assert(0);
+	}
+
+	// Releases every sub-buffer at once and makes all the slab space available again. Nothing queued may still be using them.
+	void reset()
+	{
+		for (uint32_t i = 0; i < m_allocs.size(); i++)
+			m_pOCL->destroy_buffer(m_allocs[i].m_buf);
+		m_allocs.resize(0);
+
+		for (uint32_t i = 0; i < m_slabs.size(); i++)
+		{
+			m_slabs[i].m_used = 0;
+			m_slabs[i].m_free.resize(0);
+			if (m_mode == cModeFreeList)
+				m_slabs[i].m_free.push_back(range(0, m_slabs[i].m_size));
+		}
+
+		m_bytes_in_use = 0;
+	}
+
+	uint32_t get_num_slabs() const { return (uint32_t)m_slabs.size(); }
+	uint64_t get_total_slab_bytes() const { return m_total_slab_bytes; }
+	uint64_t get_bytes_in_use() const { return m_bytes_in_use; }
+	uint64_t get_peak_bytes_in_use() const { return m_peak_bytes_in_use; }
+	uint64_t get_total_allocs() const { return m_total_allocs; }
+
+private:
+	ocl* m_pOCL = nullptr;
+	arena_mode m_mode = cModeBump;
+	cl_mem_flags m_slab_flags = CL_MEM_READ_WRITE;
+	size_t m_alignment = 1;
+	size_t m_slab_size = 0;
+
+	// [first, first + second)
+	typedef std::pair<size_t, size_t> range;
+
+	struct slab
+	{
+		cl_mem m_buf;
+		size_t m_size;
+		size_t m_used;					// Bump mode
+		std::vector<range> m_free;		// Free list mode, sorted by offset, never adjacent
+	};
+	std::vector<slab> m_slabs;
+
+	struct alloc_info
+	{
+		cl_mem m_buf;
+		uint32_t m_slab_index;
+		size_t m_ofs;
+		size_t m_size;
+	};
+	std::vector<alloc_info> m_allocs;
+
+	uint64_t m_total_slab_bytes = 0;
+	uint64_t m_bytes_in_use = 0;
+	uint64_t m_peak_bytes_in_use = 0;
+	uint64_t m_total_allocs = 0;
+
+	ocl_buffer_arena(const ocl_buffer_arena&);
+	ocl_buffer_arena& operator= (const ocl_buffer_arena&);
+
+	// Works for any alignment, not just powers of 2 (CL_DEVICE_MEM_BASE_ADDR_ALIGN always is one in practice).
+	size_t align(size_t size) const { return ((size + m_alignment - 1) / m_alignment) * m_alignment; }
+
+	// First fit. Takes the space if found.
+	bool find_space(size_t size, uint32_t& slab_index, size_t& ofs)
+	{
+		for (uint32_t i = 0; i < m_slabs.size(); i++)
+		{
+			slab& s = m_slabs[i];
+
+			if (m_mode == cModeBump)
+			{
+				if (s.m_size - s.m_used >= size)
+				{
+					slab_index = i;
+					ofs = s.m_used;
+					s.m_used += size;
+					return true;
+				}
+				continue;
+			}
+
+			for (uint32_t j = 0; j < s.m_free.size(); j++)
+			{
+				range& f = s.m_free[j];
+				if (f.second >= size)
+				{
+					slab_index = i;
+					ofs = f.first;
+
+					f.first += size;
+					f.second -= size;
+					if (!f.second)
+						s.m_free.erase(s.m_free.begin() + j);
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	void release_space(uint32_t slab_index, size_t ofs, size_t size)
+	{
+		slab& s = m_slabs[slab_index];
+
+		if (m_mode == cModeBump)
+		{
+			// Only the most recent allocation can be given back.
+			if (ofs + size == s.m_used)
+				s.m_used = ofs;
+			return;
+		}
+
+		std::vector<range>& free_list = s.m_free;
+
+		uint32_t i = (uint32_t)(std::lower_bound(free_list.begin(), free_list.end(), range(ofs, 0)) - free_list.begin());
+		free_list.insert(free_list.begin() + i, range(ofs, size));
+
+		// Coalesce with the next and previous ranges.
+		if ((i + 1 < free_list.size()) && (free_list[i].first + free_list[i].second == free_list[i + 1].first))
+		{
+			free_list[i].second += free_list[i + 1].second;
+			free_list.erase(free_list.begin() + i + 1);
+		}
+
+		if ((i) && (free_list[i - 1].first + free_list[i - 1].second == free_list[i].first))
+		{
+			free_list[i - 1].second += free_list[i].second;
+			free_list.erase(free_list.begin() + i);
+		}
+	}
+};